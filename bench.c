@@ -0,0 +1,996 @@
+//
+// Microbenchmarks for uthreads, their synchronization and channels, with pthread equivalents.
+//
+//   benchmark [-f csv|json] [-p 1,2,4] [-n iterations] [-r repeats] [name ...]
+//
+// Each uthread benchmark is run once for every processor count given with -p (by default 1, 2,
+// 4, ... up to the number of online CPUs), in a child process since uthread_init can only be
+// called once.  The pthread benchmarks are run once, in a child of their own.  Every result
+// is the best of the repeats, in nanoseconds per operation, printed as a CSV row or as a JSON
+// object on a line of its own.  Names restrict the run to benchmarks whose name contains one
+// of them.
+//
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "uthread.h"
+#include "uthread_mutex_cond.h"
+#include "uthread_sem.h"
+#include "uthread_barrier.h"
+#include "uthread_future.h"
+#include "uthread_parallel.h"
+#include "coro.h"
+#include "chan.h"
+#include "chan_fd.h"
+
+#define MAX_PROCS     64
+#define CONTENDERS    4
+#define SELECT_CHANS  4
+#define FD_MSG_SIZE   64
+
+static long     iterations;
+static int      json;
+static uint64_t timed_start, timed_stop;
+
+static uint64_t now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A benchmark with costly set-up or tear-down times only the part between these two.
+static void timer_restart () {
+  timed_start = now ();
+}
+
+static void timer_stop () {
+  timed_stop = now ();
+}
+
+//
+// UTHREADS
+//
+
+static void* noop (void* arg) {
+  return arg;
+}
+
+static void ut_create_join (long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    uthread_join (uthread_create (noop, 0), 0);
+}
+
+static void ut_yield (long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    uthread_yield ();
+}
+
+static void* yielder (void* arg) {
+  ut_yield ((long) arg);
+  return 0;
+}
+
+static void ut_switch (long n) {
+  uthread_t t = uthread_create (yielder, (void*) n);
+  ut_yield (n);
+  uthread_join (t, 0);
+}
+
+static uthread_mutex_t ut_mutex;
+static uthread_cond_t  ut_cond;
+static volatile long   counter;
+static volatile int    turn;
+
+static void ut_mutex_uncontended (long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    uthread_mutex_lock   (ut_mutex);
+    counter++;
+    uthread_mutex_unlock (ut_mutex);
+  }
+}
+
+static void* ut_mutex_contender (void* arg) {
+  ut_mutex_uncontended ((long) arg);
+  return 0;
+}
+
+static void ut_mutex_contended (long n) {
+  uthread_t t [CONTENDERS];
+  int       i;
+  for (i = 0; i < CONTENDERS; i++)
+    t [i] = uthread_create (ut_mutex_contender, (void*) (n / CONTENDERS));
+  for (i = 0; i < CONTENDERS; i++)
+    uthread_join (t [i], 0);
+}
+
+static void* ut_cond_ponger (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++) {
+    uthread_mutex_lock   (ut_mutex);
+    while (turn != 1)
+      uthread_cond_wait  (ut_cond);
+    turn = 0;
+    uthread_cond_signal  (ut_cond);
+    uthread_mutex_unlock (ut_mutex);
+  }
+  return 0;
+}
+
+static void ut_cond_pingpong (long n) {
+  uthread_t t = uthread_create (ut_cond_ponger, (void*) n);
+  long      i;
+  for (i = 0; i < n; i++) {
+    uthread_mutex_lock   (ut_mutex);
+    turn = 1;
+    uthread_cond_signal  (ut_cond);
+    while (turn != 0)
+      uthread_cond_wait  (ut_cond);
+    uthread_mutex_unlock (ut_mutex);
+  }
+  uthread_join (t, 0);
+}
+
+static uthread_sem_t ut_ping, ut_pong;
+
+static void* ut_sem_ponger (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++) {
+    uthread_sem_wait   (ut_ping);
+    uthread_sem_signal (ut_pong);
+  }
+  return 0;
+}
+
+static void ut_sem_pingpong (long n) {
+  uthread_t t = uthread_create (ut_sem_ponger, (void*) n);
+  long      i;
+  for (i = 0; i < n; i++) {
+    uthread_sem_signal (ut_ping);
+    uthread_sem_wait   (ut_pong);
+  }
+  uthread_join (t, 0);
+}
+
+//
+// BARRIERS
+//
+// Every participant but the calling thread is a uthread of its own.  The first round only
+// gathers them, so thread creation is not timed, nor is joining them afterwards.
+//
+
+static uthread_barrier_t barrier;
+static uthread_latch_t*  latches;
+static long              rounds;
+
+static void* barrier_participant (void* arg) {
+  long i;
+  for (i = 0; i <= rounds; i++)
+    uthread_barrier_wait (barrier);
+  return 0;
+}
+
+static void barrier_round (long n, int participants) {
+  uthread_t* t = malloc (participants * sizeof (uthread_t));
+  long       i;
+  barrier = uthread_barrier_create (participants);
+  rounds  = n;
+  for (i = 1; i < participants; i++)
+    t [i] = uthread_create (barrier_participant, 0);
+  uthread_barrier_wait (barrier);
+  timer_restart ();
+  for (i = 0; i < n; i++)
+    uthread_barrier_wait (barrier);
+  timer_stop ();
+  for (i = 1; i < participants; i++)
+    uthread_join (t [i], 0);
+  uthread_barrier_destroy (barrier);
+  free (t);
+}
+
+// Each round is a fresh latch that every participant counts down and then waits on.
+static void* latch_participant (void* arg) {
+  long i;
+  for (i = 0; i <= rounds; i++) {
+    uthread_latch_count_down (latches [i], 1);
+    uthread_latch_wait       (latches [i]);
+  }
+  return 0;
+}
+
+static void latch_round (long n, int participants) {
+  uthread_t* t = malloc (participants * sizeof (uthread_t));
+  long       i;
+  latches = malloc ((n + 1) * sizeof (uthread_latch_t));
+  for (i = 0; i <= n; i++)
+    latches [i] = uthread_latch_create (participants);
+  rounds = n;
+  for (i = 1; i < participants; i++)
+    t [i] = uthread_create (latch_participant, 0);
+  uthread_latch_count_down (latches [0], 1);
+  uthread_latch_wait       (latches [0]);
+  timer_restart ();
+  for (i = 1; i <= n; i++) {
+    uthread_latch_count_down (latches [i], 1);
+    uthread_latch_wait       (latches [i]);
+  }
+  timer_stop ();
+  for (i = 1; i < participants; i++)
+    uthread_join (t [i], 0);
+  for (i = 0; i <= n; i++)
+    uthread_latch_destroy (latches [i]);
+  free (latches);
+  free (t);
+}
+
+static void barrier_round_2      (long n) { barrier_round (n, 2); }
+static void barrier_round_16     (long n) { barrier_round (n, 16); }
+static void barrier_round_256    (long n) { barrier_round (n, 256); }
+static void barrier_round_4096   (long n) { barrier_round (n, 4096); }
+static void barrier_round_100000 (long n) { barrier_round (n, 100000); }
+static void latch_2              (long n) { latch_round   (n, 2); }
+static void latch_16             (long n) { latch_round   (n, 16); }
+static void latch_256            (long n) { latch_round   (n, 256); }
+static void latch_4096           (long n) { latch_round   (n, 4096); }
+static void latch_100000         (long n) { latch_round   (n, 100000); }
+
+//
+// FUTURES
+//
+
+static void future_await (long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    uthread_future_t f = uthread_async (noop, 0);
+    uthread_await          (f);
+    uthread_future_destroy (f);
+  }
+}
+
+// The promise side alone, with no thread: the result is in place before the await.
+static void future_set_await (long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    uthread_future_t f = uthread_future_create ();
+    uthread_future_set     (f, 0);
+    uthread_await          (f);
+    uthread_future_destroy (f);
+  }
+}
+
+//
+// PARALLEL LOOPS
+//
+
+#define PARALLEL_GRAIN 64
+
+static void parallel_body (void* ctx, long begin, long end) {
+  long* a = ctx;
+  long  i;
+  for (i = begin; i < end; i++)
+    a [i] = a [i] * 3 + 1;
+}
+
+// Per element, for a loop body of a few instructions split into grains of PARALLEL_GRAIN.
+static void parallel_for (long n) {
+  long* a = calloc (n, sizeof (long));
+  timer_restart ();
+  uthread_parallel_for (0, n, PARALLEL_GRAIN, parallel_body, a);
+  timer_stop ();
+  free (a);
+}
+
+// The same loop run serially, for comparison.
+static void parallel_for_serial (long n) {
+  long* a = calloc (n, sizeof (long));
+  timer_restart ();
+  parallel_body (a, 0, n);
+  timer_stop ();
+  free (a);
+}
+
+static void parallel_task (void* arg) {
+}
+
+static void task_spawn_sync (long n) {
+  uthread_task_group_t group = uthread_task_group_create ();
+  long                 i;
+  for (i = 0; i < n; i++)
+    uthread_task_spawn (group, parallel_task, 0);
+  uthread_task_sync          (group);
+  uthread_task_group_destroy (group);
+}
+
+//
+// COROUTINES
+//
+
+static void* counting (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++)
+    coro_yield ((void*) i);
+  return 0;
+}
+
+// Per item of a generator: one resume and one yield.
+static void coro_resume_yield (long n) {
+  coro_t coro = coro_create (counting, (void*) n);
+  void*  value;
+  while (coro_resume (coro, &value))
+    ;
+  coro_destroy (coro);
+}
+
+static void coro_create_destroy (long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    coro_destroy (coro_create (counting, 0));
+}
+
+//
+// CHANNELS
+//
+
+static chan_t* chans [SELECT_CHANS];
+static chan_t* replies;
+
+static void* chan_sender (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++)
+    chan_send (chans [i % SELECT_CHANS], (void*) 1);
+  return 0;
+}
+
+static void* chan_echoer (void* arg) {
+  long  i, n = (long) arg;
+  void* value;
+  for (i = 0; i < n; i++) {
+    chan_recv (chans [0], &value);
+    chan_send (replies, value);
+  }
+  return 0;
+}
+
+static void chan_open (size_t capacity) {
+  int i;
+  for (i = 0; i < SELECT_CHANS; i++)
+    chans [i] = chan_init (capacity);
+  replies = chan_init (capacity);
+}
+
+static void chan_dispose_all () {
+  int i;
+  for (i = 0; i < SELECT_CHANS; i++)
+    chan_dispose (chans [i]);
+  chan_dispose (replies);
+}
+
+static void chan_throughput (long n, size_t capacity) {
+  uthread_t t;
+  void*     value;
+  long      i;
+  chan_open (capacity);
+  t = uthread_create (chan_sender, (void*) (n * SELECT_CHANS));
+  for (i = 0; i < n; i++) {
+    int j;
+    for (j = 0; j < SELECT_CHANS; j++)
+      chan_recv (chans [j], &value);
+  }
+  uthread_join (t, 0);
+  chan_dispose_all ();
+}
+
+static void chan_latency (long n, size_t capacity) {
+  uthread_t t;
+  void*     value;
+  long      i;
+  chan_open (capacity);
+  t = uthread_create (chan_echoer, (void*) n);
+  for (i = 0; i < n; i++) {
+    chan_send (chans [0], (void*) 1);
+    chan_recv (replies, &value);
+  }
+  uthread_join (t, 0);
+  chan_dispose_all ();
+}
+
+static void chan_unbuffered_tput    (long n) { chan_throughput (n / SELECT_CHANS, 0); }
+static void chan_buffered_tput      (long n) { chan_throughput (n / SELECT_CHANS, 128); }
+static void chan_unbuffered_latency (long n) { chan_latency    (n, 0); }
+static void chan_buffered_latency   (long n) { chan_latency    (n, 1); }
+
+static void chan_select_recv (long n) {
+  uthread_t t;
+  void*     value;
+  long      i;
+  chan_open (16);
+  t = uthread_create (chan_sender, (void*) n);
+  for (i = 0; i < n; i++)
+    chan_select (chans, SELECT_CHANS, &value, 0, 0, 0);
+  uthread_join (t, 0);
+  chan_dispose_all ();
+}
+
+//
+// FD ADAPTORS
+//
+
+static chan_t* fd_out;
+
+static void* fd_producer (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++) {
+    chan_fd_msg_t* msg = chan_fd_msg_new (FD_MSG_SIZE);
+    memset (msg->data, 'x', FD_MSG_SIZE);
+    chan_send (fd_out, msg);
+  }
+  chan_close (fd_out);
+  return 0;
+}
+
+// Messages of FD_MSG_SIZE bytes through chan_to_fd, a socketpair and chan_from_fd.
+static void fd_tput (long n, chan_framing_t framing) {
+  int       sv [2];
+  uthread_t producer, writer, reader;
+  chan_t*   in;
+  void*     value;
+  long      i;
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv)) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  fd_out   = chan_init (128);
+  writer   = chan_to_fd   (fd_out, sv [0], framing);
+  in       = chan_from_fd (sv [1], framing, &reader);
+  producer = uthread_create (fd_producer, (void*) n);
+  for (i = 0; i < n && chan_recv (in, &value) == 0; i++)
+    free (value);
+  uthread_join (producer, 0);
+  uthread_join (writer, 0);
+  shutdown     (sv [0], SHUT_WR);
+  uthread_join (reader, 0);
+  chan_dispose (in);
+  chan_dispose (fd_out);
+  close (sv [0]);
+  close (sv [1]);
+}
+
+static void fd_lines_tput  (long n) { fd_tput (n, CHAN_FRAME_LINES); }
+static void fd_length_tput (long n) { fd_tput (n, CHAN_FRAME_LENGTH); }
+
+//
+// PTHREADS
+//
+
+static pthread_mutex_t pt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pt_cond  = PTHREAD_COND_INITIALIZER;
+static sem_t           pt_ping, pt_pong;
+static int             pipes [2][2];
+
+static void pt_create_join (long n) {
+  pthread_t t;
+  long      i;
+  for (i = 0; i < n; i++) {
+    pthread_create (&t, 0, noop, 0);
+    pthread_join   (t, 0);
+  }
+}
+
+static void pt_yield (long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    sched_yield ();
+}
+
+static void* pt_yielder (void* arg) {
+  pt_yield ((long) arg);
+  return 0;
+}
+
+// Both threads share one CPU, so that every yield is a switch between them.
+static void pt_switch (long n) {
+  pthread_t t;
+  cpu_set_t one, saved;
+  CPU_ZERO (&one);
+  CPU_SET  (sched_getcpu () < 0 ? 0 : sched_getcpu (), &one);
+  pthread_getaffinity_np (pthread_self (), sizeof (saved), &saved);
+  pthread_setaffinity_np (pthread_self (), sizeof (one), &one);
+  pthread_create (&t, 0, pt_yielder, (void*) n);
+  pthread_setaffinity_np (t, sizeof (one), &one);
+  pt_yield (n);
+  pthread_join (t, 0);
+  pthread_setaffinity_np (pthread_self (), sizeof (saved), &saved);
+}
+
+static void pt_mutex_uncontended (long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    pthread_mutex_lock   (&pt_mutex);
+    counter++;
+    pthread_mutex_unlock (&pt_mutex);
+  }
+}
+
+static void* pt_mutex_contender (void* arg) {
+  pt_mutex_uncontended ((long) arg);
+  return 0;
+}
+
+static void pt_mutex_contended (long n) {
+  pthread_t t [CONTENDERS];
+  int       i;
+  for (i = 0; i < CONTENDERS; i++)
+    pthread_create (&t [i], 0, pt_mutex_contender, (void*) (n / CONTENDERS));
+  for (i = 0; i < CONTENDERS; i++)
+    pthread_join (t [i], 0);
+}
+
+static void* pt_cond_ponger (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++) {
+    pthread_mutex_lock   (&pt_mutex);
+    while (turn != 1)
+      pthread_cond_wait  (&pt_cond, &pt_mutex);
+    turn = 0;
+    pthread_cond_signal  (&pt_cond);
+    pthread_mutex_unlock (&pt_mutex);
+  }
+  return 0;
+}
+
+static void pt_cond_pingpong (long n) {
+  pthread_t t;
+  long      i;
+  pthread_create (&t, 0, pt_cond_ponger, (void*) n);
+  for (i = 0; i < n; i++) {
+    pthread_mutex_lock   (&pt_mutex);
+    turn = 1;
+    pthread_cond_signal  (&pt_cond);
+    while (turn != 0)
+      pthread_cond_wait  (&pt_cond, &pt_mutex);
+    pthread_mutex_unlock (&pt_mutex);
+  }
+  pthread_join (t, 0);
+}
+
+static void* pt_sem_ponger (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++) {
+    sem_wait (&pt_ping);
+    sem_post (&pt_pong);
+  }
+  return 0;
+}
+
+static void pt_sem_pingpong (long n) {
+  pthread_t t;
+  long      i;
+  pthread_create (&t, 0, pt_sem_ponger, (void*) n);
+  for (i = 0; i < n; i++) {
+    sem_post (&pt_ping);
+    sem_wait (&pt_pong);
+  }
+  pthread_join (t, 0);
+}
+
+//
+// PTHREAD CHANNELS
+//
+// A bounded queue under a mutex with two conditions, the usual way to build a channel on
+// pthreads.  An unbuffered one has a single slot and its sender waits until the value is
+// taken.  A channel used with pt_chan_select also counts its values in an eventfd, which
+// the select polls.
+//
+
+struct pt_chan {
+  pthread_mutex_t lock;
+  pthread_cond_t  not_empty, not_full, taken;
+  void*           slots [128];
+  int             size, head, count, unbuffered;
+  unsigned long   sent, received;
+  int             event;
+};
+
+static struct pt_chan pt_chans [SELECT_CHANS], pt_replies;
+
+static void pt_chan_init (struct pt_chan* c, int capacity, int selectable) {
+  pthread_mutex_init (&c->lock, 0);
+  pthread_cond_init  (&c->not_empty, 0);
+  pthread_cond_init  (&c->not_full, 0);
+  pthread_cond_init  (&c->taken, 0);
+  c->unbuffered = capacity == 0;
+  c->size       = capacity == 0 ? 1 : capacity;
+  c->head       = c->count = 0;
+  c->sent       = c->received = 0;
+  c->event      = selectable ? eventfd (0, EFD_SEMAPHORE) : -1;
+}
+
+static void pt_chan_destroy (struct pt_chan* c) {
+  pthread_mutex_destroy (&c->lock);
+  pthread_cond_destroy  (&c->not_empty);
+  pthread_cond_destroy  (&c->not_full);
+  pthread_cond_destroy  (&c->taken);
+  if (c->event >= 0)
+    close (c->event);
+}
+
+static void pt_chan_send (struct pt_chan* c, void* value) {
+  unsigned long ticket;
+  uint64_t      one = 1;
+  pthread_mutex_lock (&c->lock);
+  while (c->count == c->size)
+    pthread_cond_wait (&c->not_full, &c->lock);
+  c->slots [(c->head + c->count++) % c->size] = value;
+  ticket = ++c->sent;
+  pthread_cond_signal (&c->not_empty);
+  if (c->event >= 0 && write (c->event, &one, sizeof (one)) != sizeof (one))
+    abort ();
+  while (c->unbuffered && c->received < ticket)
+    pthread_cond_wait (&c->taken, &c->lock);
+  pthread_mutex_unlock (&c->lock);
+}
+
+static void* pt_chan_recv (struct pt_chan* c) {
+  void* value;
+  pthread_mutex_lock (&c->lock);
+  while (c->count == 0)
+    pthread_cond_wait (&c->not_empty, &c->lock);
+  value   = c->slots [c->head];
+  c->head = (c->head + 1) % c->size;
+  c->count--;
+  c->received++;
+  pthread_cond_signal (&c->not_full);
+  if (c->unbuffered)
+    pthread_cond_broadcast (&c->taken);
+  pthread_mutex_unlock (&c->lock);
+  return value;
+}
+
+// Receives from whichever of the n selectable channels has a value, starting the search at
+// a different one each time as chan_select does.  Returns the index of that channel.
+static int pt_chan_select (struct pt_chan* c, int n, void** value) {
+  static int    start;
+  struct pollfd fds [SELECT_CHANS];
+  uint64_t      one;
+  int           i;
+  for (i = 0; i < n; i++) {
+    fds [i].fd     = c [i].event;
+    fds [i].events = POLLIN;
+  }
+  for (;;) {
+    if (poll (fds, n, -1) < 0)
+      continue;
+    start = (start + 1) % n;
+    for (i = 0; i < n; i++) {
+      int j = (start + i) % n;
+      if (fds [j].revents & POLLIN) {
+        if (read (c [j].event, &one, sizeof (one)) != sizeof (one))
+          abort ();
+        *value = pt_chan_recv (&c [j]);
+        return j;
+      }
+    }
+  }
+}
+
+static void pt_chan_open (int capacity, int selectable) {
+  int i;
+  for (i = 0; i < SELECT_CHANS; i++)
+    pt_chan_init (&pt_chans [i], capacity, selectable);
+  pt_chan_init (&pt_replies, capacity, 0);
+}
+
+static void pt_chan_destroy_all () {
+  int i;
+  for (i = 0; i < SELECT_CHANS; i++)
+    pt_chan_destroy (&pt_chans [i]);
+  pt_chan_destroy (&pt_replies);
+}
+
+static void* pt_chan_sender (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++)
+    pt_chan_send (&pt_chans [i % SELECT_CHANS], (void*) 1);
+  return 0;
+}
+
+static void* pt_chan_echoer (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++)
+    pt_chan_send (&pt_replies, pt_chan_recv (&pt_chans [0]));
+  return 0;
+}
+
+static void pt_chan_throughput (long n, int capacity) {
+  pthread_t t;
+  long      i;
+  pt_chan_open (capacity, 0);
+  pthread_create (&t, 0, pt_chan_sender, (void*) (n * SELECT_CHANS));
+  for (i = 0; i < n; i++) {
+    int j;
+    for (j = 0; j < SELECT_CHANS; j++)
+      pt_chan_recv (&pt_chans [j]);
+  }
+  pthread_join (t, 0);
+  pt_chan_destroy_all ();
+}
+
+static void pt_chan_latency (long n, int capacity) {
+  pthread_t t;
+  long      i;
+  pt_chan_open (capacity, 0);
+  pthread_create (&t, 0, pt_chan_echoer, (void*) n);
+  for (i = 0; i < n; i++) {
+    pt_chan_send (&pt_chans [0], (void*) 1);
+    pt_chan_recv (&pt_replies);
+  }
+  pthread_join (t, 0);
+  pt_chan_destroy_all ();
+}
+
+static void pt_chan_unbuffered_tput    (long n) { pt_chan_throughput (n / SELECT_CHANS, 0); }
+static void pt_chan_buffered_tput      (long n) { pt_chan_throughput (n / SELECT_CHANS, 128); }
+static void pt_chan_unbuffered_latency (long n) { pt_chan_latency    (n, 0); }
+static void pt_chan_buffered_latency   (long n) { pt_chan_latency    (n, 1); }
+
+static void pt_chan_select_recv (long n) {
+  pthread_t t;
+  void*     value;
+  long      i;
+  pt_chan_open (16, 1);
+  pthread_create (&t, 0, pt_chan_sender, (void*) n);
+  for (i = 0; i < n; i++)
+    pt_chan_select (pt_chans, SELECT_CHANS, &value);
+  pthread_join (t, 0);
+  pt_chan_destroy_all ();
+}
+
+//
+// PIPES
+//
+
+static void* pipe_sender (void* arg) {
+  long i, n = (long) arg;
+  for (i = 0; i < n; i++)
+    if (write (pipes [0][1], &i, sizeof (i)) != sizeof (i))
+      break;
+  return 0;
+}
+
+static void* pipe_echoer (void* arg) {
+  long i, n = (long) arg, value;
+  for (i = 0; i < n; i++)
+    if (read (pipes [0][0], &value, sizeof (value)) != sizeof (value) || write (pipes [1][1], &value, sizeof (value)) != sizeof (value))
+      break;
+  return 0;
+}
+
+static void pipe_tput (long n) {
+  pthread_t t;
+  long      i, value;
+  pthread_create (&t, 0, pipe_sender, (void*) n);
+  for (i = 0; i < n; i++)
+    if (read (pipes [0][0], &value, sizeof (value)) != sizeof (value))
+      break;
+  pthread_join (t, 0);
+}
+
+static void pipe_latency (long n) {
+  pthread_t t;
+  long      i, value;
+  pthread_create (&t, 0, pipe_echoer, (void*) n);
+  for (i = 0; i < n; i++)
+    if (write (pipes [0][1], &i, sizeof (i)) != sizeof (i) || read (pipes [1][0], &value, sizeof (value)) != sizeof (value))
+      break;
+  pthread_join (t, 0);
+}
+
+//
+// DRIVER
+//
+
+struct benchmark {
+  const char* name;
+  const char* impl;
+  void      (*run) (long n);
+  int         divisor;
+};
+
+static struct benchmark uthread_benchmarks [] = {
+  {"create_join",             "uthread", ut_create_join,          10},
+  {"yield",                   "uthread", ut_yield,                1},
+  {"switch",                  "uthread", ut_switch,               1},
+  {"mutex_uncontended",       "uthread", ut_mutex_uncontended,    1},
+  {"mutex_contended",         "uthread", ut_mutex_contended,      1},
+  {"cond_pingpong",           "uthread", ut_cond_pingpong,        1},
+  {"sem_pingpong",            "uthread", ut_sem_pingpong,         1},
+  {"barrier_round_2",         "uthread", barrier_round_2,         2},
+  {"barrier_round_16",        "uthread", barrier_round_16,        16},
+  {"barrier_round_256",       "uthread", barrier_round_256,       256},
+  {"barrier_round_4096",      "uthread", barrier_round_4096,      4096},
+  {"barrier_round_100000",    "uthread", barrier_round_100000,    100000},
+  {"latch_2",                 "uthread", latch_2,                 2},
+  {"latch_16",                "uthread", latch_16,                16},
+  {"latch_256",               "uthread", latch_256,               256},
+  {"latch_4096",              "uthread", latch_4096,              4096},
+  {"latch_100000",            "uthread", latch_100000,            100000},
+  {"future_await",            "uthread", future_await,            10},
+  {"future_set_await",        "uthread", future_set_await,        1},
+  {"parallel_for",            "uthread", parallel_for,            1},
+  {"parallel_for_serial",     "uthread", parallel_for_serial,     1},
+  {"task_spawn_sync",         "uthread", task_spawn_sync,         1},
+  {"coro_resume",             "uthread", coro_resume_yield,       1},
+  {"coro_create_destroy",     "uthread", coro_create_destroy,     1},
+  {"chan_unbuffered_tput",    "uthread", chan_unbuffered_tput,    1},
+  {"chan_buffered_tput",      "uthread", chan_buffered_tput,      1},
+  {"chan_unbuffered_latency", "uthread", chan_unbuffered_latency, 1},
+  {"chan_buffered_latency",   "uthread", chan_buffered_latency,   1},
+  {"chan_select",             "uthread", chan_select_recv,        1},
+  {"fd_lines_tput",           "uthread", fd_lines_tput,           1},
+  {"fd_length_tput",          "uthread", fd_length_tput,          1},
+  {0}
+};
+
+static struct benchmark pthread_benchmarks [] = {
+  {"create_join",             "pthread", pt_create_join,             10},
+  {"yield",                   "pthread", pt_yield,                   1},
+  {"switch",                  "pthread", pt_switch,                  10},
+  {"mutex_uncontended",       "pthread", pt_mutex_uncontended,       1},
+  {"mutex_contended",         "pthread", pt_mutex_contended,         1},
+  {"cond_pingpong",           "pthread", pt_cond_pingpong,           1},
+  {"sem_pingpong",            "pthread", pt_sem_pingpong,            1},
+  {"chan_unbuffered_tput",    "pthread", pt_chan_unbuffered_tput,    10},
+  {"chan_buffered_tput",      "pthread", pt_chan_buffered_tput,      10},
+  {"chan_unbuffered_latency", "pthread", pt_chan_unbuffered_latency, 10},
+  {"chan_buffered_latency",   "pthread", pt_chan_buffered_latency,   10},
+  {"chan_select",             "pthread", pt_chan_select_recv,        10},
+  {"pipe_tput",               "pipe",    pipe_tput,                  10},
+  {"pipe_latency",            "pipe",    pipe_latency,               10},
+  {0}
+};
+
+static int selected (const char* name, char** names, int num_names) {
+  int i;
+  if (num_names == 0)
+    return 1;
+  for (i = 0; i < num_names; i++)
+    if (strstr (name, names [i]))
+      return 1;
+  return 0;
+}
+
+static void report (struct benchmark* b, int procs, long n, double ns) {
+  if (json)
+    printf ("{\"benchmark\": \"%s\", \"impl\": \"%s\", \"procs\": %d, \"iterations\": %ld, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f}\n",
+            b->name, b->impl, procs, n, ns, 1e9 / ns);
+  else
+    printf ("%s,%s,%d,%ld,%.1f,%.0f\n", b->name, b->impl, procs, n, ns, 1e9 / ns);
+  fflush (stdout);
+}
+
+static void run_all (struct benchmark* benchmarks, int procs, int repeats, char** names, int num_names) {
+  struct benchmark* b;
+  for (b = benchmarks; b->name; b++)
+    if (selected (b->name, names, num_names)) {
+      long   n    = iterations / b->divisor > 0 ? iterations / b->divisor : 1;
+      double best = 0;
+      int    r;
+      for (r = 0; r < repeats; r++) {
+        timed_stop  = 0;
+        timed_start = now ();
+        b->run (n);
+        if (! timed_stop)
+          timer_stop ();
+        double   ns = (double) (timed_stop - timed_start) / n;
+        if (r == 0 || ns < best)
+          best = ns;
+      }
+      report (b, procs, n, best);
+    }
+}
+
+static void run_uthreads (int procs, int repeats, char** names, int num_names) {
+  // Thread stacks come from malloc.  Keep them in the one heap rather than a mapping each, or
+  // the 100000 participants of the largest barriers would pass the kernel's limit on mappings,
+  // and keep freed ones there for the next thread, as malloc does by itself once it has seen
+  // a large block freed.
+  mallopt (M_ARENA_MAX, 1);
+  mallopt (M_MMAP_THRESHOLD, 32 * 1024 * 1024);
+  mallopt (M_TRIM_THRESHOLD, 64 * 1024 * 1024);
+  uthread_init (procs);
+  ut_mutex = uthread_mutex_create ();
+  ut_cond  = uthread_cond_create  (ut_mutex);
+  ut_ping  = uthread_sem_create   (0);
+  ut_pong  = uthread_sem_create   (0);
+  run_all (uthread_benchmarks, procs, repeats, names, num_names);
+}
+
+static void run_pthreads (int repeats, char** names, int num_names) {
+  sem_init (&pt_ping, 0, 0);
+  sem_init (&pt_pong, 0, 0);
+  if (pipe (pipes [0]) || pipe (pipes [1])) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+  run_all (pthread_benchmarks, (int) sysconf (_SC_NPROCESSORS_ONLN), repeats, names, num_names);
+}
+
+static void run_child (int procs, int repeats, char** names, int num_names) {
+  pid_t pid;
+  int   status;
+  fflush (stdout);
+  pid = fork ();
+  if (pid == 0) {
+    if (procs)
+      run_uthreads (procs, repeats, names, num_names);
+    else
+      run_pthreads (repeats, names, num_names);
+    exit (EXIT_SUCCESS);
+  }
+  if (pid < 0 || waitpid (pid, &status, 0) < 0 || ! WIFEXITED (status) || WEXITSTATUS (status)) {
+    if (procs)
+      fprintf (stderr, "benchmark: uthread run with %d processors failed\n", procs);
+    else
+      fprintf (stderr, "benchmark: pthread run failed\n");
+  }
+}
+
+int main (int argc, char** argv) {
+  int  procs [MAX_PROCS], num_procs = 0, repeats = 3, opt, i;
+  char *list, *p;
+
+  iterations = 100000;
+  while ((opt = getopt (argc, argv, "f:p:n:r:")) != -1)
+    switch (opt) {
+      case 'f':
+        json = strcmp (optarg, "json") == 0;
+        break;
+      case 'p':
+        for (list = optarg; (p = strtok (list, ",")) && num_procs < MAX_PROCS; list = 0)
+          if ((procs [num_procs] = atoi (p)) > 0)
+            num_procs++;
+        break;
+      case 'n':
+        iterations = atol (optarg);
+        break;
+      case 'r':
+        repeats = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-f csv|json] [-p 1,2,4] [-n iterations] [-r repeats] [name ...]\n", argv [0]);
+        return EXIT_FAILURE;
+    }
+  if (iterations < 100)
+    iterations = 100;
+  if (repeats < 1)
+    repeats = 1;
+  if (num_procs == 0) {
+    int cpus = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+      cpus = 1;
+    for (i = 1; i <= cpus && num_procs < MAX_PROCS; i *= 2)
+      procs [num_procs++] = i;
+    if (procs [num_procs - 1] != cpus && num_procs < MAX_PROCS)
+      procs [num_procs++] = cpus;
+  }
+  if (! json)
+    printf ("benchmark,impl,procs,iterations,ns_per_op,ops_per_sec\n");
+  for (i = 0; i < num_procs; i++)
+    run_child (procs [i], repeats, argv + optind, argc - optind);
+  run_child (0, repeats, argv + optind, argc - optind);
+  return EXIT_SUCCESS;
+}
@@ -7,139 +7,193 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include <limits.h>
 
 #include "chan.h"
 #define EPIPE -1
 #define ENOMEM -1
+#define EINVAL -1
 int errno;
 
-static int buffered_chan_init(chan_t* chan, size_t capacity);
-static int buffered_chan_send(chan_t* chan, void* data);
-static int buffered_chan_recv(chan_t* chan, void** data);
+static chan_t* chan_new(size_t elem_size, size_t capacity, int spsc);
+
+static int buffered_chan_init(chan_t* chan, size_t capacity, int spsc);
+static int buffered_chan_send(chan_t* chan, const void* elem,
+    uint64_t deadline);
+static int buffered_chan_recv(chan_t* chan, void* elem, uint64_t deadline);
 
 static int unbuffered_chan_init(chan_t* chan);
-static int unbuffered_chan_send(chan_t* chan, void* data);
-static int unbuffered_chan_recv(chan_t* chan, void** data);
+static int unbuffered_chan_send(chan_t* chan, const void* elem,
+    uint64_t deadline);
+static int unbuffered_chan_recv(chan_t* chan, void* elem, uint64_t deadline);
 
 static int chan_can_recv(chan_t* chan);
 static int chan_can_send(chan_t* chan);
 static int chan_is_buffered(chan_t* chan);
 
+static void chan_waitq_init(chan_waitq_t* waitq);
+static void chan_unpark(chan_t* chan, chan_waitq_t* waitq);
+static void chan_unpark_n(chan_t* chan, chan_waitq_t* waitq, size_t n);
+static void chan_unpark_all(chan_t* chan, chan_waitq_t* waitq);
+static void chan_notify_recv(chan_t* chan);
+static void chan_notify_recv_n(chan_t* chan, size_t n);
+static void chan_notify_set(chan_t* chan);
+static int select_recv_ready(chan_t* chan);
+static int select_send_ready(chan_t* chan);
+static void chan_stats_register(chan_t* chan);
+static void chan_stats_unregister(chan_t* chan);
+
 // Allocates and returns a new channel. The capacity specifies whether the
 // channel should be buffered or not. A capacity of 0 will create an unbuffered
 // channel. Sets errno and returns NULL if initialization failed.
 chan_t* chan_init(size_t capacity)
 {
-    chan_t* chan = (chan_t*) malloc(sizeof(chan_t));
-    if (!chan)
+    return chan_new(0, capacity, 0);
+}
+
+// Allocates and returns a new buffered channel for exactly one sending thread
+// and one receiving thread. Sends and receives go through a lock-free ring and
+// only block when it is full or empty. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_spsc(size_t capacity)
+{
+    return chan_new(0, capacity, 1);
+}
+
+// Allocates and returns a new channel whose elements are values of elem_size
+// bytes, stored inline in the channel and copied in and out. The capacity is
+// as for chan_init. Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_typed(size_t elem_size, size_t capacity)
+{
+    if (elem_size == 0)
     {
-        errno = ENOMEM;
+        errno = EINVAL;
         return NULL;
     }
+    return chan_new(elem_size, capacity, 0);
+}
 
-    if (capacity > 0)
+// Allocates and returns a new buffered channel with no capacity limit, whose
+// elements are values of elem_size bytes, or pointers if elem_size is 0. Sets
+// errno and returns NULL if initialization failed.
+chan_t* chan_init_unbounded(size_t elem_size)
+{
+    chan_t* chan = chan_new(elem_size, 0, 0);
+    if (!chan)
     {
-        if (buffered_chan_init(chan, capacity) != 0)
-        {
-            free(chan);
-            return NULL;
-        }
+        return NULL;
     }
-    else
+
+    chan->seg = seg_queue_init(elem_size ? elem_size : sizeof(void*), 0);
+    if (!chan->seg)
     {
-        if (unbuffered_chan_init(chan) != 0)
-        {
-        printf("bad result\n");
-            free(chan);
-            return NULL;
-        }
+        chan_dispose(chan);
+        return NULL;
     }
-    
     return chan;
 }
 
-static int buffered_chan_init(chan_t* chan, size_t capacity)
+// Arranges for on_high(arg, size) to be called by the sender that takes an
+// unbounded channel from below high queued values to high or more. Returns 0,
+// or -1 if the channel is not unbounded. If -1 is returned, errno will be
+// set.
+int chan_set_watermark(chan_t* chan, size_t high,
+    void (*on_high)(void* arg, size_t size), void* arg)
 {
-    queue_t* queue = queue_init(capacity);
-    if (!queue)
+    if (!chan->seg)
     {
+        errno = EINVAL;
         return -1;
     }
 
-    if (unbuffered_chan_init(chan) != 0)
-    {
-        queue_dispose(queue);
-        return -1;
-    }
-    
-    chan->queue = queue;
+    seg_queue_set_watermark(chan->seg, high, on_high, arg);
     return 0;
 }
 
-static int unbuffered_chan_init(chan_t* chan)
+static chan_t* chan_new(size_t elem_size, size_t capacity, int spsc)
 {
-    chan->w_mu = uthread_mutex_create();
-    if (chan->w_mu == 0)
+    chan_t* chan = NULL;
+    if (posix_memalign((void**) &chan, QUEUE_CACHE_LINE, sizeof(chan_t)) != 0)
     {
-        return -1;
+        errno = ENOMEM;
+        return NULL;
     }
 
-    chan->r_mu = uthread_mutex_create();
-    if (chan->r_mu == 0)
+    if (unbuffered_chan_init(chan) != 0)
     {
-        uthread_mutex_destroy(chan->w_mu);
-        return -1;
+        free(chan);
+        return NULL;
     }
 
-    chan->m_mu = uthread_mutex_create();
-    if ( chan->m_mu == 0)
+    chan->elem_size = elem_size;
+    chan_stats_register(chan);
+    if (capacity > 0 && buffered_chan_init(chan, capacity, spsc) != 0)
     {
-        uthread_mutex_destroy(chan->w_mu);
-        uthread_mutex_destroy(chan->r_mu);
-        return -1;
+        chan_dispose(chan);
+        return NULL;
     }
 
-    chan->r_cond = uthread_cond_create(chan->m_mu);
-    if (chan->r_cond == 0)
-    {
-        uthread_mutex_destroy(chan->m_mu);
-        uthread_mutex_destroy(chan->w_mu);
-        uthread_mutex_destroy(chan->r_mu);
-        return -1;
-    }
+    return chan;
+}
+
+// Returns the number of bytes moved per element, which for a channel of
+// pointers is the size of a pointer.
+static inline size_t chan_elem_size(chan_t* chan)
+{
+    return chan->elem_size ? chan->elem_size : sizeof(void*);
+}
 
-    chan->w_cond = uthread_cond_create(chan->m_mu);
-    if ( chan->w_cond == 0)
+static int buffered_chan_init(chan_t* chan, size_t capacity, int spsc)
+{
+    if (spsc)
     {
-        uthread_mutex_destroy(chan->m_mu);
-        uthread_mutex_destroy(chan->w_mu);
-        uthread_mutex_destroy(chan->r_mu);
-        uthread_cond_destroy(chan->r_cond);
-        return -1;
+        chan->spsc = spsc_queue_init(capacity, chan_elem_size(chan));
+        return chan->spsc ? 0 : -1;
     }
 
+    chan->mpmc = mpmc_queue_init(capacity, chan_elem_size(chan));
+    return chan->mpmc ? 0 : -1;
+}
+
+static int unbuffered_chan_init(chan_t* chan)
+{
     chan->closed = 0;
-    chan->r_waiting = 0;
-    chan->w_waiting = 0;
-    chan->queue = NULL;
-    chan->data = NULL;
+    chan->elem_size = 0;
+    chan->mpmc = NULL;
+    chan->spsc = NULL;
+    chan->seg = NULL;
+    spinlock_create(&chan->lock);
+    chan_waitq_init(&chan->r_waiters);
+    chan_waitq_init(&chan->w_waiters);
+    chan->set = NULL;
+    chan->set_prev = NULL;
+    chan->set_next = NULL;
+    chan->set_queued = 0;
+    chan->set_linked = 0;
     return 0;
 }
 
 // Releases the channel resources.
 void chan_dispose(chan_t* chan)
 {
-    if (chan_is_buffered(chan))
+    chan_stats_unregister(chan);
+    if (chan->set)
     {
-        queue_dispose(chan->queue);
+        chan_set_remove(chan->set, chan);
     }
 
-    uthread_mutex_destroy(chan->w_mu);
-    uthread_mutex_destroy(chan->r_mu);
-
-    uthread_mutex_destroy(chan->m_mu);
-    uthread_cond_destroy(chan->r_cond);
-    uthread_cond_destroy(chan->w_cond);
+    if (chan->mpmc)
+    {
+        mpmc_queue_dispose(chan->mpmc);
+    }
+    if (chan->spsc)
+    {
+        spsc_queue_dispose(chan->spsc);
+    }
+    if (chan->seg)
+    {
+        seg_queue_dispose(chan->seg);
+    }
     free(chan);
 }
 
@@ -151,32 +205,24 @@ void chan_dispose(chan_t* chan)
 // successfully closed, -1 otherwise. If -1 is returned, errno will be set.
 int chan_close(chan_t* chan)
 {
-    int success = 0;
-    uthread_mutex_lock(chan->m_mu);
-    if (chan->closed)
+    if (__atomic_exchange_n(&chan->closed, 1, __ATOMIC_SEQ_CST))
     {
         // Channel already closed.
-        success = -1;
         errno = EPIPE;
+        return -1;
     }
-    else
-    {
-        // Otherwise close it.
-        chan->closed = 1;
-        uthread_cond_broadcast(chan->r_cond);
-        uthread_cond_broadcast(chan->w_cond);
-    }
-    uthread_mutex_unlock(chan->m_mu);
-    return success;
+
+    // Every parked operation fails; a select retries and sees the close.
+    chan_unpark_all(chan, &chan->r_waiters);
+    chan_unpark_all(chan, &chan->w_waiters);
+    chan_notify_set(chan);
+    return 0;
 }
 
 // Returns 0 if the channel is open and 1 if it is closed.
 int chan_is_closed(chan_t* chan)
 {
-    uthread_mutex_lock(chan->m_mu);
-    int closed = chan->closed;
-    uthread_mutex_unlock(chan->m_mu);
-    return closed;
+    return __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE);
 }
 
 // Sends a value into the channel. If the channel is unbuffered, this will
@@ -184,6 +230,40 @@ int chan_is_closed(chan_t* chan)
 // capacity, this will block until a receiver receives a value. Returns 0 if
 // the send succeeded or -1 if it failed. If -1 is returned, errno will be set.
 int chan_send(chan_t* chan, void* data)
+{
+    return chan_send_value(chan, chan->elem_size ? data : &data);
+}
+
+// Receives a value from the channel. This will block until there is data to
+// receive. Returns 0 if the receive succeeded or -1 if it failed. If -1 is
+// returned, errno will be set.
+int chan_recv(chan_t* chan, void** data)
+{
+    return chan_recv_value(chan, data);
+}
+
+// Sends a copy of the element at elem into the channel, blocking as chan_send
+// does. For a channel made by chan_init or chan_init_spsc the element is a
+// void*. Returns 0 if the send succeeded or -1 if it failed. If -1 is
+// returned, errno will be set.
+int chan_send_value(chan_t* chan, const void* elem)
+{
+    return chan_send_value_deadline(chan, elem, UTHREAD_FOREVER);
+}
+
+// Receives an element from the channel and copies it to elem, unless elem is
+// NULL, blocking as chan_recv does. Returns 0 if the receive succeeded or -1
+// if it failed. If -1 is returned, errno will be set.
+int chan_recv_value(chan_t* chan, void* elem)
+{
+    return chan_recv_value_deadline(chan, elem, UTHREAD_FOREVER);
+}
+
+// As chan_send_value, but gives up once deadline, a time on the uthread_now
+// clock, has passed. Returns 0 if the send succeeded, CHAN_TIMEOUT if it
+// timed out, or -1 if it failed. If -1 is returned, errno will be set.
+int chan_send_value_deadline(chan_t* chan, const void* elem,
+    uint64_t deadline)
 {
     if (chan_is_closed(chan))
     {
@@ -193,337 +273,1604 @@ int chan_send(chan_t* chan, void* data)
     }
 
     return chan_is_buffered(chan) ?
-        buffered_chan_send(chan, data) :
-        unbuffered_chan_send(chan, data);
+        buffered_chan_send(chan, elem, deadline) :
+        unbuffered_chan_send(chan, elem, deadline);
 }
 
-// Receives a value from the channel. This will block until there is data to
-// receive. Returns 0 if the receive succeeded or -1 if it failed. If -1 is
-// returned, errno will be set.
-int chan_recv(chan_t* chan, void** data)
+// As chan_recv_value, but gives up once deadline has passed. Returns 0 if the
+// receive succeeded, CHAN_TIMEOUT if it timed out, or -1 if it failed. If -1
+// is returned, errno will be set.
+int chan_recv_value_deadline(chan_t* chan, void* elem, uint64_t deadline)
 {
     return chan_is_buffered(chan) ?
-        buffered_chan_recv(chan, data) :
-        unbuffered_chan_recv(chan, data);
+        buffered_chan_recv(chan, elem, deadline) :
+        unbuffered_chan_recv(chan, elem, deadline);
 }
 
-static int buffered_chan_send(chan_t* chan, void* data)
+// As chan_send, but gives up once deadline has passed. Returns 0 if the send
+// succeeded, CHAN_TIMEOUT if it timed out, or -1 if it failed. If -1 is
+// returned, errno will be set.
+int chan_send_deadline(chan_t* chan, void* data, uint64_t deadline)
 {
-    uthread_mutex_lock(chan->m_mu);
-    while (chan->queue->size == chan->queue->capacity)
-    {
-        // Block until something is removed.
-        chan->w_waiting++;
-        uthread_cond_wait(chan->w_cond);
-        chan->w_waiting--;
-    }
+    return chan_send_value_deadline(chan, chan->elem_size ? data : &data,
+        deadline);
+}
 
-    int success = queue_add(chan->queue, data);
+// As chan_recv, but gives up once deadline has passed. Returns 0 if the
+// receive succeeded, CHAN_TIMEOUT if it timed out, or -1 if it failed. If -1
+// is returned, errno will be set.
+int chan_recv_deadline(chan_t* chan, void** data, uint64_t deadline)
+{
+    return chan_recv_value_deadline(chan, data, deadline);
+}
 
-    if (chan->r_waiting > 0)
-    {
-        // Signal waiting reader.
-        uthread_cond_signal(chan->r_cond);
-    }
+// Converts a timeout in nanoseconds to a deadline, saturating rather than
+// wrapping so that a huge timeout means forever.
+static uint64_t chan_deadline(uint64_t timeout_ns)
+{
+    uint64_t now = uthread_now();
+    return timeout_ns < UTHREAD_FOREVER - now ?
+        now + timeout_ns : UTHREAD_FOREVER;
+}
 
-    uthread_mutex_unlock(chan->m_mu);
-    return success;
+// As chan_send, but gives up after timeout_ns nanoseconds.
+int chan_send_timeout(chan_t* chan, void* data, uint64_t timeout_ns)
+{
+    return chan_send_deadline(chan, data, chan_deadline(timeout_ns));
 }
 
-static int buffered_chan_recv(chan_t* chan, void** data)
+// As chan_recv, but gives up after timeout_ns nanoseconds.
+int chan_recv_timeout(chan_t* chan, void** data, uint64_t timeout_ns)
 {
-    uthread_mutex_lock(chan->m_mu);
-    while (chan->queue->size == 0)
-    {
-        if (chan->closed)
-        {
-            uthread_mutex_unlock(chan->m_mu);
-            errno = EPIPE;
-            return -1;
-        }
+    return chan_recv_deadline(chan, data, chan_deadline(timeout_ns));
+}
 
-        // Block until something is added.
-        chan->r_waiting++;
-        uthread_cond_wait(chan->r_cond);
-        chan->r_waiting--;
-    }
+#if CHAN_STATS
+// Every live channel is on the statistics list. Counters are updated with
+// relaxed atomic adds, and the clock is only read around operations that
+// actually block.
+static spinlock_t chan_stats_lock = 0;
+static chan_t*    chan_stats_list = NULL;
+static int        chan_stats_count = 0;
+static int        chan_stats_atexit = 0;
+
+static void chan_stats_dump_at_exit()
+{
+    chan_stats_dump(stderr);
+}
+#endif
 
-    void* msg = queue_remove(chan->queue);
-    if (data)
+static void chan_stats_register(chan_t* chan)
+{
+#if CHAN_STATS
+    memset(&chan->stats, 0, sizeof(chan->stats));
+    chan->stats.chan = chan;
+    spinlock_lock(&chan_stats_lock);
+    if (!chan_stats_atexit)
     {
-        *data = msg;
+        atexit(chan_stats_dump_at_exit);
+        chan_stats_atexit = 1;
     }
-
-    if (chan->w_waiting > 0)
+    chan->stats_prev = NULL;
+    chan->stats_next = chan_stats_list;
+    if (chan_stats_list)
     {
-        // Signal waiting writer.
-        uthread_cond_signal(chan->w_cond);
+        chan_stats_list->stats_prev = chan;
     }
-
-    uthread_mutex_unlock(chan->m_mu);
-    return 0;
+    chan_stats_list = chan;
+    chan_stats_count++;
+    spinlock_unlock(&chan_stats_lock);
+#endif
 }
 
-static int unbuffered_chan_send(chan_t* chan, void* data)
+static void chan_stats_unregister(chan_t* chan)
 {
-    uthread_mutex_lock(chan->w_mu);
-    uthread_mutex_lock(chan->m_mu);
-
-    if (chan->closed)
+#if CHAN_STATS
+    spinlock_lock(&chan_stats_lock);
+    if (chan->stats_prev)
     {
-        uthread_mutex_unlock(chan->m_mu);
-        uthread_mutex_unlock(chan->w_mu);
-        errno = EPIPE;
-        return -1;
+        chan->stats_prev->stats_next = chan->stats_next;
+    }
+    else
+    {
+        chan_stats_list = chan->stats_next;
+    }
+    if (chan->stats_next)
+    {
+        chan->stats_next->stats_prev = chan->stats_prev;
     }
+    chan_stats_count--;
+    spinlock_unlock(&chan_stats_lock);
+#endif
+}
 
-    chan->data = data;
-    chan->w_waiting++;
+// Returns the capacity of a buffered channel, or the high watermark of an
+// unbounded one, or 0 for an unbuffered one.
+static size_t chan_capacity(chan_t* chan)
+{
+    return chan->spsc ? chan->spsc->capacity :
+        chan->mpmc ? chan->mpmc->capacity :
+        chan->seg ? chan->seg->high : 0;
+}
 
-    if (chan->r_waiting > 0)
+#if CHAN_STATS
+// Counts an occupancy sample of size elements in the histogram.
+static void chan_stats_sample(chan_t* chan, size_t size)
+{
+    size_t capacity = chan_capacity(chan);
+    size_t bucket;
+    if (size == 0)
+    {
+        bucket = 0;
+    }
+    else if (size >= capacity)
+    {
+        bucket = CHAN_STATS_BUCKETS - 1;
+    }
+    else
     {
-        // Signal waiting reader.
-        uthread_cond_signal(chan->r_cond);
+        bucket = 1 + size * (CHAN_STATS_BUCKETS - 2) / capacity;
     }
+    __atomic_add_fetch(&chan->stats.occupancy[bucket], 1, __ATOMIC_RELAXED);
+}
+#endif
+
+// Counts n elements added to a buffered channel.
+static void chan_stats_sent(chan_t* chan, size_t n)
+{
+#if CHAN_STATS
+    __atomic_add_fetch(&chan->stats.sends, n, __ATOMIC_RELAXED);
+    chan_stats_sample(chan, chan_size(chan));
+#endif
+}
 
-    // Block until reader consumed chan->data.
-    uthread_cond_wait(chan->w_cond);
+// Counts n elements removed from a buffered channel.
+static void chan_stats_received(chan_t* chan, size_t n)
+{
+#if CHAN_STATS
+    __atomic_add_fetch(&chan->stats.recvs, n, __ATOMIC_RELAXED);
+    chan_stats_sample(chan, chan_size(chan));
+#endif
+}
+
+// Counts a value handed over on an unbuffered channel, to a parked receiver
+// if sender_waited is 0 and from a parked sender otherwise.
+static void chan_stats_transferred(chan_t* chan, int sender_waited)
+{
+#if CHAN_STATS
+    __atomic_add_fetch(&chan->stats.sends, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chan->stats.recvs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chan->stats.occupancy[sender_waited ?
+        CHAN_STATS_BUCKETS - 1 : 0], 1, __ATOMIC_RELAXED);
+#endif
+}
 
-    uthread_mutex_unlock(chan->m_mu);
-    uthread_mutex_unlock(chan->w_mu);
+// Returns the time to pass to chan_stats_blocked, read only if statistics
+// are collected.
+static uint64_t chan_stats_clock()
+{
+#if CHAN_STATS
+    return uthread_now();
+#else
     return 0;
+#endif
+}
+
+// Counts a thread that blocked on waitq from blocked_at until now.
+static void chan_stats_blocked(chan_t* chan, chan_waitq_t* waitq,
+    uint64_t blocked_at)
+{
+#if CHAN_STATS
+    __atomic_add_fetch(waitq == &chan->w_waiters ?
+        &chan->stats.send_blocked : &chan->stats.recv_blocked, 1,
+        __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chan->stats.blocked_ns, uthread_now() - blocked_at,
+        __ATOMIC_RELAXED);
+#endif
 }
 
-static int unbuffered_chan_recv(chan_t* chan, void** data)
+// A thread blocked on one or more channels. Whichever channel wakes it first
+// claims fired with a single compare-and-swap, so a thread waiting in a select
+// is woken exactly once however many of its channels become ready. index is
+// set by a peer that completed one of the thread's unbuffered operations, and
+// stays -1 if the thread was merely woken to try again. woken is the index of
+// the waiter through which a channel claimed the thread, and stays -1 if it
+// was not claimed that way. timed_out is set when the thread's deadline timer
+// claimed it instead.
+typedef struct chan_parker_t
+{
+    uthread_t    thread;
+    volatile int fired;
+    int          index;
+    int          woken;
+    int          timed_out;
+} chan_parker_t;
+
+// One registration of a parker on the wait queue of one channel. On an
+// unbuffered channel elem is the value a sender offers, or where a receiver
+// wants the value (NULL to discard it), and index identifies the operation to
+// its parker.
+typedef struct chan_waiter_t
 {
-    uthread_mutex_lock(chan->r_mu);
-    uthread_mutex_lock(chan->m_mu);
+    chan_parker_t*        parker;
+    int                   linked;
+    struct chan_waiter_t* prev;
+    struct chan_waiter_t* next;
+    void*                 elem;
+    int                   index;
+} chan_waiter_t;
+
+static void chan_waitq_init(chan_waitq_t* waitq)
+{
+    waitq->head = NULL;
+    waitq->tail = NULL;
+    waitq->count = 0;
+}
 
-    while (!chan->closed && !chan->w_waiting)
+// Removes waiter from waitq. The channel lock must be held.
+static void chan_waitq_unlink(chan_waitq_t* waitq, chan_waiter_t* waiter)
+{
+    if (waiter->prev)
     {
-        // Block until writer has set chan->data.
-        chan->r_waiting++;
-        uthread_cond_wait(chan->r_cond);
-        chan->r_waiting--;
+        waiter->prev->next = waiter->next;
     }
-
-    if (chan->closed)
+    else
     {
-        uthread_mutex_unlock(chan->m_mu);
-        uthread_mutex_unlock(chan->r_mu);
-        errno = EPIPE;
-        return -1;
+        waitq->head = waiter->next;
     }
 
-    if (data)
+    if (waiter->next)
     {
-        *data = chan->data;
+        waiter->next->prev = waiter->prev;
+    }
+    else
+    {
+        waitq->tail = waiter->prev;
     }
-    chan->w_waiting--;
-
-    // Signal waiting writer.
-    uthread_cond_signal(chan->w_cond);
 
-    uthread_mutex_unlock(chan->m_mu);
-    uthread_mutex_unlock(chan->r_mu);
-    return 0;
+    waiter->linked = 0;
+    __atomic_sub_fetch(&waitq->count, 1, __ATOMIC_RELAXED);
 }
 
-// Returns the number of items in the channel buffer. If the channel is
-// unbuffered, this will return 0.
-int chan_size(chan_t* chan)
+// Appends waiter to waitq. The caller must already have counted it, and the
+// channel lock must be held.
+static void chan_waitq_link(chan_waitq_t* waitq, chan_waiter_t* waiter)
 {
-    int size = 0;
-    if (chan_is_buffered(chan))
+    waiter->linked = 1;
+    waiter->next = NULL;
+    waiter->prev = waitq->tail;
+    if (waitq->tail)
     {
-        uthread_mutex_lock(chan->m_mu);
-        size = chan->queue->size;
-        uthread_mutex_unlock(chan->m_mu);
+        waitq->tail->next = waiter;
     }
-    return size;
+    else
+    {
+        waitq->head = waiter;
+    }
+    waitq->tail = waiter;
 }
 
-typedef struct
+static void chan_parker_init(chan_parker_t* parker)
 {
-    int     recv;    // 1 when it is recv, 0 when it is read
-    chan_t* chan;    // selected channel
-    void*   msg_in;  // message to send
-    int     index;   // array index
-} select_op_t;
+    parker->thread = uthread_self();
+    parker->fired = 0;
+    parker->index = -1;
+    parker->woken = -1;
+    parker->timed_out = 0;
+}
 
-// A select statement chooses which of a set of possible send or receive
-// operations will proceed. The return value indicates which channel's
-// operation has proceeded. If more than one operation can proceed, one is
-// selected randomly. If none can proceed, -1 is returned. Select is intended
-// to be used in conjunction with a switch statement. In the case of a receive
-// operation, the received value will be pointed to by the provided pointer. In
-// the case of a send, the value at the same index as the channel will be sent.
-int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
-    chan_t* send_chans[], int send_count, void* send_msgs[])
+static int chan_parker_claim(chan_parker_t* parker)
 {
-    // TODO: Add support for blocking selects.
-
-    select_op_t candidates[recv_count + send_count];
-    int count = 0;
-    int i;
+    int expected = 0;
+    return __atomic_compare_exchange_n(&parker->fired, &expected, 1, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
 
-    // Determine receive candidates.
-    for (i = 0; i < recv_count; i++)
+// Removes waiters from the head of waitq until one can be claimed, and
+// returns it, or NULL if there is none. The channel lock must be held.
+static chan_waiter_t* chan_waitq_claim(chan_waitq_t* waitq)
+{
+    while (waitq->head)
     {
-        chan_t* chan = recv_chans[i];
-        if (chan_can_recv(chan))
+        chan_waiter_t* waiter = waitq->head;
+        chan_waitq_unlink(waitq, waiter);
+        if (chan_parker_claim(waiter->parker))
         {
-            select_op_t op;
-            op.recv = 1;
-            op.chan = chan;
-            op.index = i;
-            candidates[count++] = op;
+            waiter->parker->woken = waiter->index;
+            return waiter;
         }
     }
+    return NULL;
+}
 
-    // Determine send candidates.
-    for (i = 0; i < send_count; i++)
+// Appends waiter to waitq, unless ready(chan) holds once the waiter has been
+// counted or the channel is closed. Returns 1 if the waiter was queued and 0
+// otherwise. Counting the waiter before the final check, and checking the
+// count after publishing a change, means a wakeup can never be lost.
+static int chan_register(chan_t* chan, chan_waitq_t* waitq,
+    chan_waiter_t* waiter, int (*ready)(chan_t*))
+{
+    spinlock_lock(&chan->lock);
+    __atomic_add_fetch(&waitq->count, 1, __ATOMIC_SEQ_CST);
+    if (ready(chan) || chan->closed)
     {
-        chan_t* chan = send_chans[i];
-        if (chan_can_send(chan))
-        {
-            select_op_t op;
-            op.recv = 0;
-            op.chan = chan;
-            op.msg_in = send_msgs[i];
-            op.index = i + recv_count;
-            candidates[count++] = op;
-        }
+        __atomic_sub_fetch(&waitq->count, 1, __ATOMIC_RELAXED);
+        spinlock_unlock(&chan->lock);
+        return 0;
     }
-    
-    if (count == 0) return -1;
 
+    chan_waitq_link(waitq, waiter);
+    spinlock_unlock(&chan->lock);
+    return 1;
+}
 
-    // Seed rand using 3.
-    srand(3);
-
-    // Select candidate and perform operation.
-    select_op_t select = candidates[rand() % count];
-    if (select.recv && chan_recv(select.chan, recv_out) != 0)
+// Removes waiter from waitq if no channel operation has done so already.
+static void chan_unregister(chan_t* chan, chan_waitq_t* waitq,
+    chan_waiter_t* waiter)
+{
+    spinlock_lock(&chan->lock);
+    if (waiter->linked)
     {
-        return -1;
+        chan_waitq_unlink(waitq, waiter);
     }
-    else if (!select.recv && chan_send(select.chan, select.msg_in) != 0)
+    spinlock_unlock(&chan->lock);
+}
+
+// Fired by the scheduler when a parked thread's deadline passes. Claims the
+// parker, unless a channel got there first, and wakes its thread. The waiter
+// stays on its wait queue, but can no longer be claimed, so no wakeup meant
+// for another thread is spent on it.
+static void chan_timer_fire(void* arg)
+{
+    chan_parker_t* parker = arg;
+    if (chan_parker_claim(parker))
     {
-        return -1;
+        parker->timed_out = 1;
+        uthread_unblock(parker->thread);
     }
-    return select.index;
 }
 
-static int chan_can_recv(chan_t* chan)
+// Blocks the calling thread until its parker is claimed, by a channel or, once
+// deadline has passed, by a timer.
+static void chan_block(chan_parker_t* parker, uint64_t deadline)
 {
-    if (chan_is_buffered(chan))
+    if (deadline == UTHREAD_FOREVER)
     {
-        return chan_size(chan) > 0;
+        uthread_block();
+        return;
     }
 
-    uthread_mutex_lock(chan->m_mu);
-    int sender = chan->w_waiting > 0;
-    uthread_mutex_unlock(chan->m_mu);
-    return sender;
+    uthread_timer_t timer;
+    uthread_timer_start(&timer, deadline, chan_timer_fire, parker);
+    uthread_block();
+    uthread_timer_cancel(&timer);
 }
 
-static int chan_can_send(chan_t* chan)
+// Blocks the calling thread on waitq until woken by chan_unpark, unless
+// ready(chan) already holds or the channel is closed. Returns 1 if deadline
+// passed first, in which case the thread has withdrawn from waitq, and 0
+// otherwise.
+static int chan_park(chan_t* chan, chan_waitq_t* waitq,
+    int (*ready)(chan_t*), uint64_t deadline)
 {
-    int send;
-    if (chan_is_buffered(chan))
+    chan_parker_t parker;
+    chan_waiter_t waiter;
+
+    if (deadline != UTHREAD_FOREVER && uthread_now() >= deadline)
     {
-        // Can send if buffered channel is not full.
-        uthread_mutex_lock(chan->m_mu);
-        send = chan->queue->size < chan->queue->capacity;
-        uthread_mutex_unlock(chan->m_mu);
+        return 1;
     }
-    else
+
+    chan_parker_init(&parker);
+    waiter.parker = &parker;
+    waiter.index = 0;
+    if (!chan_register(chan, waitq, &waiter, ready))
     {
-        // Can send if unbuffered channel has receiver.
-        uthread_mutex_lock(chan->m_mu);
-        send = chan->r_waiting > 0;
-        uthread_mutex_unlock(chan->m_mu);
+        return 0;
     }
 
-    return send;
-}
-
-static int chan_is_buffered(chan_t* chan)
-{
-    return chan->queue != NULL;
+    uint64_t blocked_at = chan_stats_clock();
+    chan_block(&parker, deadline);
+    chan_stats_blocked(chan, waitq, blocked_at);
+    if (parker.timed_out)
+    {
+        chan_unregister(chan, waitq, &waiter);
+        return 1;
+    }
+    return 0;
 }
 
-int chan_send_int32(chan_t* chan, int32_t data)
+// Wakes one thread parked on waitq, if there is one. Only takes the channel
+// lock when the count shows somebody is, or is about to be, parked. Waiters
+// whose parker was already claimed through another channel are dropped.
+static void chan_unpark(chan_t* chan, chan_waitq_t* waitq)
 {
-    int32_t* wrapped = malloc(sizeof(int32_t));
-    if (!wrapped)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waitq->count, __ATOMIC_RELAXED) == 0)
     {
-        return -1;
+        return;
     }
 
-    *wrapped = data;
+    spinlock_lock(&chan->lock);
+    chan_waiter_t* waiter = chan_waitq_claim(waitq);
+    uthread_t thread = waiter ? waiter->parker->thread : NULL;
+    spinlock_unlock(&chan->lock);
 
-    int success = chan_send(chan, wrapped);
-    if (success != 0)
+    if (thread)
     {
-        free(wrapped);
+        uthread_unblock(thread);
     }
-
-    return success;
 }
 
-int chan_recv_int32(chan_t* chan, int32_t* data)
+// Wakes up to n threads parked on waitq, taking the channel lock once.
+static void chan_unpark_n(chan_t* chan, chan_waitq_t* waitq, size_t n)
 {
-    int32_t* wrapped = NULL;
-    int success = chan_recv(chan, (void*) &wrapped);
-    if (wrapped != NULL)
+    if (n <= 1)
     {
-        *data = *wrapped;
-        free(wrapped);
+        if (n == 1)
+        {
+            chan_unpark(chan, waitq);
+        }
+        return;
     }
 
-    return success;
-}
-
-int chan_send_int64(chan_t* chan, int64_t data)
-{
-    int64_t* wrapped = malloc(sizeof(int64_t));
-    if (!wrapped)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waitq->count, __ATOMIC_RELAXED) == 0)
     {
-        return -1;
+        return;
     }
 
-    *wrapped = data;
+    uthread_queue_t ready;
+    uthread_initqueue(&ready);
 
-    int success = chan_send(chan, wrapped);
-    if (success != 0)
+    spinlock_lock(&chan->lock);
+    chan_waiter_t* waiter;
+    while (n > 0 && (waiter = chan_waitq_claim(waitq)))
     {
-        free(wrapped);
+        uthread_enqueue(&ready, waiter->parker->thread);
+        n--;
     }
+    spinlock_unlock(&chan->lock);
 
-    return success;
+    uthread_unblock_queue(&ready);
 }
 
-int chan_recv_int64(chan_t* chan, int64_t* data)
+// Wakes every thread parked on waitq.
+static void chan_unpark_all(chan_t* chan, chan_waitq_t* waitq)
 {
-    int64_t* wrapped = NULL;
-    int success = chan_recv(chan, (void*) &wrapped);
-    if (wrapped != NULL)
+    uthread_queue_t ready;
+    uthread_initqueue(&ready);
+
+    spinlock_lock(&chan->lock);
+    chan_waiter_t* waiter;
+    while ((waiter = chan_waitq_claim(waitq)))
     {
-        *data = *wrapped;
-        free(wrapped);
+        uthread_enqueue(&ready, waiter->parker->thread);
     }
+    spinlock_unlock(&chan->lock);
 
-    return success;
+    uthread_unblock_queue(&ready);
 }
 
-int chan_send_double(chan_t* chan, double data)
+// Appends chan to the ready list of its set. The set lock must be held.
+static void chan_set_append(chan_set_t* set, chan_t* chan)
 {
-    double* wrapped = malloc(sizeof(double));
-    if (!wrapped)
+    chan->set_next = NULL;
+    chan->set_prev = set->tail;
+    if (set->tail)
     {
-        return -1;
+        set->tail->set_next = chan;
+    }
+    else
+    {
+        set->head = chan;
+    }
+    set->tail = chan;
+    chan->set_linked = 1;
+}
+
+// Removes chan from the ready list of its set. The set lock must be held.
+static void chan_set_unlink(chan_set_t* set, chan_t* chan)
+{
+    if (chan->set_prev)
+    {
+        chan->set_prev->set_next = chan->set_next;
+    }
+    else
+    {
+        set->head = chan->set_next;
+    }
+
+    if (chan->set_next)
+    {
+        chan->set_next->set_prev = chan->set_prev;
+    }
+    else
+    {
+        set->tail = chan->set_prev;
+    }
+    chan->set_linked = 0;
+}
+
+// Called after chan may have become receivable: wakes one parked receiver or
+// select, and queues chan on its readiness set unless it is queued already.
+static void chan_notify_recv(chan_t* chan)
+{
+    chan_notify_recv_n(chan, 1);
+}
+
+// As chan_notify_recv, after n values were made receivable at once: wakes up
+// to n parked receivers.
+static void chan_notify_recv_n(chan_t* chan, size_t n)
+{
+    chan_unpark_n(chan, &chan->r_waiters, n);
+    chan_notify_set(chan);
+}
+
+// Queues chan on its readiness set, if it has one and is not queued already.
+static void chan_notify_set(chan_t* chan)
+{
+    chan_set_t* set = __atomic_load_n(&chan->set, __ATOMIC_ACQUIRE);
+    if (!set || __atomic_exchange_n(&chan->set_queued, 1, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+
+    spinlock_lock(&set->lock);
+    uthread_t waiter = NULL;
+    if (chan->set == set)
+    {
+        // chan_set_add may have queued it since this sender set the flag.
+        if (!chan->set_linked)
+        {
+            chan_set_append(set, chan);
+        }
+        waiter = uthread_dequeue(&set->waiters);
+    }
+    else
+    {
+        // Removed from the set while this notification was in flight.
+        chan->set_queued = 0;
+    }
+    spinlock_unlock(&set->lock);
+
+    if (waiter)
+    {
+        uthread_unblock(waiter);
+    }
+}
+
+static int buffered_chan_add(chan_t* chan, const void* elem)
+{
+    int result = chan->spsc ? spsc_queue_add(chan->spsc, elem) :
+        chan->seg ? seg_queue_add(chan->seg, elem) :
+        mpmc_queue_add(chan->mpmc, elem);
+    if (result == 0)
+    {
+        chan_stats_sent(chan, 1);
+    }
+    return result;
+}
+
+static int buffered_chan_remove(chan_t* chan, void* elem)
+{
+    int result = chan->spsc ? spsc_queue_remove(chan->spsc, elem) :
+        chan->seg ? seg_queue_remove(chan->seg, elem) :
+        mpmc_queue_remove(chan->mpmc, elem);
+    if (result == 0)
+    {
+        chan_stats_received(chan, 1);
+    }
+    return result;
+}
+
+static size_t buffered_chan_add_many(chan_t* chan, const void* elems, size_t n)
+{
+    size_t added = chan->spsc ? spsc_queue_add_many(chan->spsc, elems, n) :
+        chan->seg ? seg_queue_add_many(chan->seg, elems, n) :
+        mpmc_queue_add_many(chan->mpmc, elems, n);
+    if (added > 0)
+    {
+        chan_stats_sent(chan, added);
+    }
+    return added;
+}
+
+static size_t buffered_chan_remove_many(chan_t* chan, void* elems, size_t n)
+{
+    size_t removed = chan->spsc ? spsc_queue_remove_many(chan->spsc, elems, n) :
+        chan->seg ? seg_queue_remove_many(chan->seg, elems, n) :
+        mpmc_queue_remove_many(chan->mpmc, elems, n);
+    if (removed > 0)
+    {
+        chan_stats_received(chan, removed);
+    }
+    return removed;
+}
+
+static int buffered_chan_can_send(chan_t* chan)
+{
+    return chan->spsc ?
+        spsc_queue_size(chan->spsc) < chan->spsc->capacity :
+        chan->seg ? 1 :
+        mpmc_queue_can_add(chan->mpmc);
+}
+
+static int buffered_chan_can_recv(chan_t* chan)
+{
+    return chan->spsc ?
+        spsc_queue_size(chan->spsc) > 0 :
+        chan->seg ? seg_queue_size(chan->seg) > 0 :
+        mpmc_queue_can_remove(chan->mpmc);
+}
+
+static int buffered_chan_send(chan_t* chan, const void* elem,
+    uint64_t deadline)
+{
+    int timed_out = 0;
+    while (buffered_chan_add(chan, elem) != 0)
+    {
+        if (chan_is_closed(chan))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        if (timed_out)
+        {
+            return CHAN_TIMEOUT;
+        }
+
+        // Block until something is removed, then try once more even if the
+        // deadline has passed.
+        timed_out = chan_park(chan, &chan->w_waiters, buffered_chan_can_send,
+            deadline);
+    }
+
+    chan_notify_recv(chan);
+    return 0;
+}
+
+static int buffered_chan_recv(chan_t* chan, void* elem, uint64_t deadline)
+{
+    int timed_out = 0;
+    while (buffered_chan_remove(chan, elem) != 0)
+    {
+        if (chan_is_closed(chan))
+        {
+            // Values sent before the close are still delivered.
+            if (buffered_chan_remove(chan, elem) == 0)
+            {
+                break;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+        if (timed_out)
+        {
+            return CHAN_TIMEOUT;
+        }
+
+        // Block until something is added.
+        timed_out = chan_park(chan, &chan->r_waiters, buffered_chan_can_recv,
+            deadline);
+    }
+
+    chan_unpark(chan, &chan->w_waiters);
+    return 0;
+}
+
+static int buffered_chan_send_many(chan_t* chan, const void* elems, size_t n)
+{
+    size_t sent;
+    while ((sent = buffered_chan_add_many(chan, elems, n)) == 0)
+    {
+        if (chan_is_closed(chan))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Block until something is removed.
+        chan_park(chan, &chan->w_waiters, buffered_chan_can_send,
+            UTHREAD_FOREVER);
+    }
+
+    chan_notify_recv_n(chan, sent);
+    return (int) sent;
+}
+
+static int buffered_chan_recv_many(chan_t* chan, void* elems, size_t max,
+    size_t min)
+{
+    size_t size = chan_elem_size(chan);
+    size_t received = 0;
+    size_t released = 0;
+    for (;;)
+    {
+        received += buffered_chan_remove_many(chan,
+            elems ? (char*) elems + received * size : NULL, max - received);
+        if (received >= min && (received > 0 || !chan_is_closed(chan)))
+        {
+            break;
+        }
+
+        if (chan_is_closed(chan))
+        {
+            // Values sent before the close are still delivered.
+            received += buffered_chan_remove_many(chan,
+                elems ? (char*) elems + received * size : NULL, max - received);
+            if (received == 0)
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            break;
+        }
+
+        // Senders may be blocked on the room made so far, so wake them before
+        // blocking until something is added.
+        chan_unpark_n(chan, &chan->w_waiters, received - released);
+        released = received;
+        chan_park(chan, &chan->r_waiters, buffered_chan_can_recv,
+            UTHREAD_FOREVER);
+    }
+
+    chan_unpark_n(chan, &chan->w_waiters, received - released);
+    return (int) received;
+}
+
+// Hands a copy of the element at elem to a parked receiver, if there is one.
+// Returns the receiver's thread, which the caller must wake once it has
+// released the channel lock, or NULL if no receiver is parked. The channel
+// lock must be held.
+static uthread_t unbuffered_chan_give(chan_t* chan, const void* elem)
+{
+    chan_waiter_t* peer = chan_waitq_claim(&chan->r_waiters);
+    if (!peer)
+    {
+        return NULL;
+    }
+
+    if (peer->elem)
+    {
+        memcpy(peer->elem, elem, chan_elem_size(chan));
+    }
+    peer->parker->index = peer->index;
+    chan_stats_transferred(chan, 0);
+    return peer->parker->thread;
+}
+
+// Copies the element of a parked sender to elem, unless elem is NULL. Returns
+// the sender's thread, which the caller must wake once it has released the
+// channel lock, or NULL if no sender is parked. The channel lock must be held.
+static uthread_t unbuffered_chan_take(chan_t* chan, void* elem)
+{
+    chan_waiter_t* peer = chan_waitq_claim(&chan->w_waiters);
+    if (!peer)
+    {
+        return NULL;
+    }
+
+    if (elem)
+    {
+        memcpy(elem, peer->elem, chan_elem_size(chan));
+    }
+    peer->parker->index = peer->index;
+    chan_stats_transferred(chan, 1);
+    return peer->parker->thread;
+}
+
+// Parks the calling thread on waitq with elem until a peer completes the
+// exchange. Called with the channel lock held, which it releases. Returns 0 if
+// the exchange happened, CHAN_TIMEOUT if deadline passed first, or sets errno
+// and returns -1 if the channel was closed first.
+static int unbuffered_chan_wait(chan_t* chan, chan_waitq_t* waitq, void* elem,
+    uint64_t deadline)
+{
+    chan_parker_t parker;
+    chan_waiter_t waiter;
+
+    chan_parker_init(&parker);
+    waiter.parker = &parker;
+    waiter.elem = elem;
+    waiter.index = 0;
+    __atomic_add_fetch(&waitq->count, 1, __ATOMIC_SEQ_CST);
+    chan_waitq_link(waitq, &waiter);
+    spinlock_unlock(&chan->lock);
+
+    if (waitq == &chan->w_waiters)
+    {
+        // A waiting sender makes the channel receivable.
+        chan_notify_set(chan);
+    }
+    uint64_t blocked_at = chan_stats_clock();
+    chan_block(&parker, deadline);
+    chan_stats_blocked(chan, waitq, blocked_at);
+
+    if (parker.timed_out)
+    {
+        chan_unregister(chan, waitq, &waiter);
+        return CHAN_TIMEOUT;
+    }
+    if (parker.index < 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+static int unbuffered_chan_send(chan_t* chan, const void* elem,
+    uint64_t deadline)
+{
+    spinlock_lock(&chan->lock);
+    if (chan->closed)
+    {
+        spinlock_unlock(&chan->lock);
+        errno = EPIPE;
+        return -1;
+    }
+
+    uthread_t peer = unbuffered_chan_give(chan, elem);
+    if (peer)
+    {
+        spinlock_unlock(&chan->lock);
+        uthread_unblock(peer);
+        return 0;
+    }
+
+    if (deadline != UTHREAD_FOREVER && uthread_now() >= deadline)
+    {
+        spinlock_unlock(&chan->lock);
+        return CHAN_TIMEOUT;
+    }
+
+    // Block until a receiver has copied the value from elem.
+    return unbuffered_chan_wait(chan, &chan->w_waiters, (void*) elem,
+        deadline);
+}
+
+static int unbuffered_chan_recv(chan_t* chan, void* elem, uint64_t deadline)
+{
+    spinlock_lock(&chan->lock);
+    if (chan->closed)
+    {
+        spinlock_unlock(&chan->lock);
+        errno = EPIPE;
+        return -1;
+    }
+
+    uthread_t peer = unbuffered_chan_take(chan, elem);
+    if (peer)
+    {
+        spinlock_unlock(&chan->lock);
+        uthread_unblock(peer);
+        return 0;
+    }
+
+    if (deadline != UTHREAD_FOREVER && uthread_now() >= deadline)
+    {
+        spinlock_unlock(&chan->lock);
+        return CHAN_TIMEOUT;
+    }
+
+    // Block until a sender has copied its value to elem.
+    return unbuffered_chan_wait(chan, &chan->r_waiters, elem, deadline);
+}
+
+// Sends up to n elements from items, an array of elements as passed to
+// chan_send_value. Blocks until at least one element has been sent, then sends
+// as many more as the channel accepts without blocking. On a buffered channel
+// the elements are added to the ring as a batch and receivers are woken once.
+// Returns the number of elements sent, or -1 if the channel is closed. If -1
+// is returned, errno will be set.
+int chan_send_many(chan_t* chan, const void* items, size_t n)
+{
+    if (chan_is_closed(chan))
+    {
+        // Cannot send on closed channel.
+        errno = EPIPE;
+        return -1;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    if (chan_is_buffered(chan))
+    {
+        return buffered_chan_send_many(chan, items, n);
+    }
+
+    // An unbuffered channel hands over one element per receiver, and only
+    // carries on while receivers are already waiting.
+    size_t size = chan_elem_size(chan);
+    size_t sent = 0;
+    do
+    {
+        if (unbuffered_chan_send(chan, (const char*) items + sent * size,
+            UTHREAD_FOREVER) != 0)
+        {
+            return sent > 0 ? (int) sent : -1;
+        }
+        sent++;
+    } while (sent < n && select_send_ready(chan));
+    return (int) sent;
+}
+
+// Receives up to max elements into out, an array of elements as passed to
+// chan_recv_value, unless out is NULL. Blocks until at least min elements
+// have been received, or the channel is closed and drained, then takes as
+// many more as are available without blocking. Returns the number of elements
+// received, or -1 if the channel is closed and nothing was received. If -1 is
+// returned, errno will be set.
+int chan_recv_many(chan_t* chan, void* out, size_t max, size_t min)
+{
+    if (min > max)
+    {
+        min = max;
+    }
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    if (chan_is_buffered(chan))
+    {
+        return buffered_chan_recv_many(chan, out, max, min);
+    }
+
+    size_t size = chan_elem_size(chan);
+    size_t received = 0;
+    while (received < max && (received < min || select_recv_ready(chan)))
+    {
+        if (unbuffered_chan_recv(chan,
+            out ? (char*) out + received * size : NULL, UTHREAD_FOREVER) != 0)
+        {
+            return received > 0 ? (int) received : -1;
+        }
+        received++;
+    }
+    return (int) received;
+}
+
+// Returns the number of items in the channel buffer. If the channel is
+// unbuffered, this will return 0.
+int chan_size(chan_t* chan)
+{
+    int size = 0;
+    if (chan->spsc)
+    {
+        size = spsc_queue_size(chan->spsc);
+    }
+    else if (chan->mpmc)
+    {
+        size = mpmc_queue_size(chan->mpmc);
+    }
+    else if (chan->seg)
+    {
+        size = seg_queue_size(chan->seg);
+    }
+    return size;
+}
+
+// Labels the channel in its statistics. name is not copied and must outlive
+// the channel.
+void chan_set_name(chan_t* chan, const char* name)
+{
+#if CHAN_STATS
+    chan->stats.name = name;
+#endif
+}
+
+// Copies the statistics of the channel to stats.
+void chan_stats(chan_t* chan, chan_stats_t* stats)
+{
+#if CHAN_STATS
+    *stats = chan->stats;
+#else
+    memset(stats, 0, sizeof(*stats));
+    stats->chan = chan;
+#endif
+    stats->capacity = chan_capacity(chan);
+}
+
+#if CHAN_STATS
+static int chan_stats_compare(const void* a, const void* b)
+{
+    unsigned long long wa = ((const chan_stats_t*) a)->blocked_ns;
+    unsigned long long wb = ((const chan_stats_t*) b)->blocked_ns;
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+#endif
+
+// Copies the statistics of up to max live channels to stats, longest total
+// blocked time first. Returns the number copied.
+int chan_stats_all(chan_stats_t* stats, int max)
+{
+    int count = 0;
+#if CHAN_STATS
+    spinlock_lock(&chan_stats_lock);
+    chan_stats_t* all = (chan_stats_t*) malloc(
+        (chan_stats_count ? chan_stats_count : 1) * sizeof(chan_stats_t));
+    chan_t* chan;
+    for (chan = chan_stats_list; chan; chan = chan->stats_next)
+    {
+        chan_stats(chan, &all[count++]);
+    }
+    spinlock_unlock(&chan_stats_lock);
+
+    qsort(all, count, sizeof(chan_stats_t), chan_stats_compare);
+    if (count > max)
+    {
+        count = max;
+    }
+    memcpy(stats, all, count * sizeof(chan_stats_t));
+    free(all);
+#endif
+    return count;
+}
+
+// Prints the statistics of every live channel that has been used, longest
+// total blocked time first, with the occupancy histogram in percent from
+// empty to full.
+void chan_stats_dump(FILE* file)
+{
+#if CHAN_STATS
+    spinlock_lock(&chan_stats_lock);
+    int count = chan_stats_count;
+    spinlock_unlock(&chan_stats_lock);
+    chan_stats_t* stats = (chan_stats_t*) malloc(
+        (count ? count : 1) * sizeof(chan_stats_t));
+    count = chan_stats_all(stats, count);
+
+    fprintf(file, "%-24s %8s %12s %12s %10s %10s %14s  %s\n", "channel",
+        "capacity", "sends", "recvs", "send_blk", "recv_blk", "blocked_ns",
+        "occupancy % (empty .. full)");
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        chan_stats_t* s = &stats[i];
+        if (s->sends == 0 && s->recvs == 0)
+        {
+            continue;
+        }
+
+        char label[32];
+        if (!s->name)
+        {
+            snprintf(label, sizeof(label), "%p", (void*) s->chan);
+        }
+        fprintf(file, "%-24s %8zu %12lu %12lu %10lu %10lu %14llu ",
+            s->name ? s->name : label, s->capacity, s->sends, s->recvs,
+            s->send_blocked, s->recv_blocked, s->blocked_ns);
+
+        unsigned long samples = 0;
+        int b;
+        for (b = 0; b < CHAN_STATS_BUCKETS; b++)
+        {
+            samples += s->occupancy[b];
+        }
+        for (b = 0; b < CHAN_STATS_BUCKETS; b++)
+        {
+            fprintf(file, " %3lu", samples ? s->occupancy[b] * 100 / samples : 0);
+        }
+        fprintf(file, "\n");
+    }
+    free(stats);
+#endif
+}
+
+// Per-worker xorshift state for choosing among ready select cases. It is
+// seeded lazily from its own address, which differs between workers.
+static __thread uint32_t select_seed;
+
+static uint32_t select_random()
+{
+    uint32_t x = select_seed;
+    if (x == 0)
+    {
+        x = (uint32_t) (uintptr_t) &select_seed | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    select_seed = x;
+    return x;
+}
+
+// A parked sender makes an unbuffered channel receivable, and a parked
+// receiver makes it sendable.
+static int select_recv_ready(chan_t* chan)
+{
+    return chan_is_buffered(chan) ?
+        buffered_chan_can_recv(chan) :
+        __atomic_load_n(&chan->w_waiters.count, __ATOMIC_SEQ_CST) > 0;
+}
+
+static int select_send_ready(chan_t* chan)
+{
+    return chan_is_buffered(chan) ?
+        buffered_chan_can_send(chan) :
+        __atomic_load_n(&chan->r_waiters.count, __ATOMIC_SEQ_CST) > 0;
+}
+
+// Attempts a receive without parking. Returns 0 if a value was received, 1 if
+// the channel is not ready, or -1 if the channel is closed and drained.
+static int select_try_recv(chan_t* chan, void* elem)
+{
+    if (chan_is_buffered(chan))
+    {
+        if (buffered_chan_remove(chan, elem) != 0)
+        {
+            if (!chan_is_closed(chan) || buffered_chan_remove(chan, elem) != 0)
+            {
+                return chan_is_closed(chan) ? -1 : 1;
+            }
+        }
+        chan_unpark(chan, &chan->w_waiters);
+        return 0;
+    }
+
+    if (chan_is_closed(chan))
+    {
+        return -1;
+    }
+    if (!select_recv_ready(chan))
+    {
+        return 1;
+    }
+
+    spinlock_lock(&chan->lock);
+    uthread_t peer = chan->closed ? NULL : unbuffered_chan_take(chan, elem);
+    int closed = chan->closed;
+    spinlock_unlock(&chan->lock);
+    if (peer)
+    {
+        uthread_unblock(peer);
+        return 0;
+    }
+    return closed ? -1 : 1;
+}
+
+// Attempts a send without parking. Returns 0 if the value was sent, 1 if the
+// channel is not ready, or -1 if the channel is closed.
+static int select_try_send(chan_t* chan, const void* elem)
+{
+    if (chan_is_closed(chan))
+    {
+        return -1;
+    }
+
+    if (chan_is_buffered(chan))
+    {
+        if (buffered_chan_add(chan, elem) != 0)
+        {
+            return 1;
+        }
+        chan_notify_recv(chan);
+        return 0;
+    }
+
+    if (!select_send_ready(chan))
+    {
+        return 1;
+    }
+
+    spinlock_lock(&chan->lock);
+    uthread_t peer = chan->closed ? NULL : unbuffered_chan_give(chan, elem);
+    int closed = chan->closed;
+    spinlock_unlock(&chan->lock);
+    if (peer)
+    {
+        uthread_unblock(peer);
+        return 0;
+    }
+    return closed ? -1 : 1;
+}
+
+// Sends a value into the channel only if that can be done without blocking:
+// a buffered channel has room, or a receiver is parked on an unbuffered one.
+// A buffered send touches only the lock-free ring, plus the channel lock if a
+// receiver has to be woken. Returns 0 if the value was sent, CHAN_WOULDBLOCK
+// if it was not, or -1 if the channel is closed. If -1 is returned, errno
+// will be set.
+int chan_try_send(chan_t* chan, void* data)
+{
+    return chan_try_send_value(chan, chan->elem_size ? data : &data);
+}
+
+// Receives a value from the channel only if that can be done without
+// blocking. Returns 0 if a value was received, CHAN_WOULDBLOCK if none was
+// available, or -1 if the channel is closed and drained. If -1 is returned,
+// errno will be set.
+int chan_try_recv(chan_t* chan, void** data)
+{
+    return chan_try_recv_value(chan, data);
+}
+
+// As chan_try_send, with elem as passed to chan_send_value.
+int chan_try_send_value(chan_t* chan, const void* elem)
+{
+    int result = select_try_send(chan, elem);
+    if (result < 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return result == 0 ? 0 : CHAN_WOULDBLOCK;
+}
+
+// As chan_try_recv, with elem as passed to chan_recv_value.
+int chan_try_recv_value(chan_t* chan, void* elem)
+{
+    int result = select_try_recv(chan, elem);
+    if (result < 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return result == 0 ? 0 : CHAN_WOULDBLOCK;
+}
+
+// Queues waiter on waitq of unbuffered chan to be completed by a peer, unless
+// the channel is closed or a peer of another thread is already parked on
+// peers, in which case select should try again. Waiters on peers that were
+// claimed elsewhere are dropped on the way. Returns 1 if the waiter was
+// queued and 0 otherwise.
+static int unbuffered_chan_register(chan_t* chan, chan_waitq_t* waitq,
+    chan_waitq_t* peers, chan_waiter_t* waiter)
+{
+    spinlock_lock(&chan->lock);
+    chan_waiter_t* peer = peers->head;
+    while (peer)
+    {
+        chan_waiter_t* next = peer->next;
+        if (__atomic_load_n(&peer->parker->fired, __ATOMIC_ACQUIRE))
+        {
+            chan_waitq_unlink(peers, peer);
+        }
+        else if (peer->parker != waiter->parker)
+        {
+            break;
+        }
+        peer = next;
+    }
+    if (peer || chan->closed)
+    {
+        spinlock_unlock(&chan->lock);
+        return 0;
+    }
+
+    __atomic_add_fetch(&waitq->count, 1, __ATOMIC_SEQ_CST);
+    chan_waitq_link(waitq, waiter);
+    spinlock_unlock(&chan->lock);
+
+    if (waitq == &chan->w_waiters)
+    {
+        chan_notify_set(chan);
+    }
+    return 1;
+}
+
+// Passes on the wakeup that a buffered channel spent on a select which then
+// did not take case index: another thread parked on the same side of that
+// channel is woken in its place.
+static void select_pass_wakeup(chan_t* recv_chans[], int recv_count,
+    chan_t* send_chans[], int index)
+{
+    if (index < recv_count)
+    {
+        chan_t* chan = recv_chans[index];
+        if (chan_is_buffered(chan))
+        {
+            chan_unpark(chan, &chan->r_waiters);
+        }
+    }
+    else
+    {
+        chan_t* chan = send_chans[index - recv_count];
+        if (chan_is_buffered(chan))
+        {
+            chan_unpark(chan, &chan->w_waiters);
+        }
+    }
+}
+
+// A select statement chooses which of a set of possible send or receive
+// operations will proceed. The return value indicates which channel's
+// operation has proceeded. If more than one operation can proceed, one is
+// selected randomly. If none can proceed, select blocks until one can, without
+// consuming CPU. If the chosen operation fails because its channel is closed,
+// or there are no channels at all, -1 is returned. Select is intended
+// to be used in conjunction with a switch statement. In the case of a receive
+// operation, the received value will be pointed to by the provided pointer. In
+// the case of a send, the value at the same index as the channel will be sent.
+int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[])
+{
+    return chan_select_deadline(recv_chans, recv_count, recv_out, send_chans,
+        send_count, send_msgs, UTHREAD_FOREVER);
+}
+
+// As chan_select, but returns CHAN_TIMEOUT if no operation could proceed
+// before deadline, a time on the uthread_now clock. A deadline that has
+// already passed, such as 0, makes select poll each operation once.
+int chan_select_deadline(chan_t* recv_chans[], int recv_count,
+    void** recv_out, chan_t* send_chans[], int send_count, void* send_msgs[],
+    uint64_t deadline)
+{
+    int count = recv_count + send_count;
+    if (count == 0)
+    {
+        return -1;
+    }
+
+    chan_waiter_t waiters[count];
+    chan_parker_t parker;
+    int woken = -1;
+    for (;;)
+    {
+        // Try every operation once, starting at a random one so that no
+        // channel is favoured, or at the one whose channel woke this thread.
+        int start = woken >= 0 ? woken : select_random() % count;
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            int index = start + i < count ? start + i : start + i - count;
+            int result;
+            if (index < recv_count)
+            {
+                result = select_try_recv(recv_chans[index], recv_out);
+            }
+            else
+            {
+                chan_t* chan = send_chans[index - recv_count];
+                void** msg = &send_msgs[index - recv_count];
+                result = select_try_send(chan, chan->elem_size ? *msg : msg);
+            }
+            if (index == woken && result != 0)
+            {
+                // The value or room the wakeup was for has gone elsewhere;
+                // a thread still parked on that channel may need it.
+                select_pass_wakeup(recv_chans, recv_count, send_chans, woken);
+            }
+            if (result == 0)
+            {
+                return index;
+            }
+            if (result < 0)
+            {
+                errno = EPIPE;
+                return -1;
+            }
+        }
+
+        if (deadline != UTHREAD_FOREVER && uthread_now() >= deadline)
+        {
+            return CHAN_TIMEOUT;
+        }
+
+        // Nothing is ready: park on every channel at once. The first channel
+        // to become ready wakes this thread, which then withdraws from the
+        // others. A peer that completed an unbuffered operation has recorded
+        // its index; otherwise everything is tried again.
+        chan_parker_init(&parker);
+        int registered;
+        for (registered = 0; registered < count; registered++)
+        {
+            chan_waiter_t* waiter = &waiters[registered];
+            chan_t* chan;
+            chan_waitq_t* waitq;
+            chan_waitq_t* peers;
+            int (*ready)(chan_t*);
+            if (registered < recv_count)
+            {
+                chan = recv_chans[registered];
+                waitq = &chan->r_waiters;
+                peers = &chan->w_waiters;
+                ready = select_recv_ready;
+                waiter->elem = recv_out;
+            }
+            else
+            {
+                chan = send_chans[registered - recv_count];
+                waitq = &chan->w_waiters;
+                peers = &chan->r_waiters;
+                ready = select_send_ready;
+                void** msg = &send_msgs[registered - recv_count];
+                waiter->elem = chan->elem_size ? *msg : msg;
+            }
+            waiter->parker = &parker;
+            waiter->index = registered;
+
+            int queued = chan_is_buffered(chan) ?
+                chan_register(chan, waitq, waiter, ready) :
+                unbuffered_chan_register(chan, waitq, peers, waiter);
+            if (!queued)
+            {
+                break;
+            }
+        }
+
+        if (registered == count)
+        {
+            chan_block(&parker, deadline);
+        }
+        else if (!chan_parker_claim(&parker))
+        {
+            // A channel has already claimed this thread and its wakeup must
+            // be absorbed.
+            uthread_block();
+        }
+
+        for (i = 0; i < registered; i++)
+        {
+            if (i < recv_count)
+            {
+                chan_unregister(recv_chans[i], &recv_chans[i]->r_waiters,
+                    &waiters[i]);
+            }
+            else
+            {
+                chan_unregister(send_chans[i - recv_count],
+                    &send_chans[i - recv_count]->w_waiters, &waiters[i]);
+            }
+        }
+
+        if (parker.index >= 0)
+        {
+            return parker.index;
+        }
+        if (parker.timed_out)
+        {
+            return CHAN_TIMEOUT;
+        }
+        woken = parker.woken;
+    }
+}
+
+static int chan_can_recv(chan_t* chan)
+{
+    if (chan_is_buffered(chan))
+    {
+        return chan_size(chan) > 0;
+    }
+
+    // Can receive if unbuffered channel has a sender.
+    return select_recv_ready(chan);
+}
+
+static int chan_can_send(chan_t* chan)
+{
+    // Can send if buffered channel is not full, or if unbuffered channel has
+    // a receiver.
+    return select_send_ready(chan);
+}
+
+static int chan_is_buffered(chan_t* chan)
+{
+    return chan->mpmc != NULL || chan->spsc != NULL || chan->seg != NULL;
+}
+
+// Sends the value at elem on a channel made by chan_init_typed, whose elements
+// must be size bytes. Sets errno to EINVAL and returns -1 if they are not.
+static int chan_send_sized(chan_t* chan, const void* elem, size_t size)
+{
+    if (chan->elem_size != size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return chan_send_value(chan, elem);
+}
+
+// As chan_send_sized, for a receive into elem.
+static int chan_recv_sized(chan_t* chan, void* elem, size_t size)
+{
+    if (chan->elem_size != size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return chan_recv_value(chan, elem);
+}
+
+int chan_send_int32(chan_t* chan, int32_t data)
+{
+    if (chan->elem_size != 0)
+    {
+        return chan_send_sized(chan, &data, sizeof(int32_t));
+    }
+
+    int32_t* wrapped = malloc(sizeof(int32_t));
+    if (!wrapped)
+    {
+        return -1;
+    }
+
+    *wrapped = data;
+
+    int success = chan_send(chan, wrapped);
+    if (success != 0)
+    {
+        free(wrapped);
+    }
+
+    return success;
+}
+
+int chan_recv_int32(chan_t* chan, int32_t* data)
+{
+    if (chan->elem_size != 0)
+    {
+        return chan_recv_sized(chan, data, sizeof(int32_t));
+    }
+
+    int32_t* wrapped = NULL;
+    int success = chan_recv(chan, (void*) &wrapped);
+    if (wrapped != NULL)
+    {
+        *data = *wrapped;
+        free(wrapped);
+    }
+
+    return success;
+}
+
+int chan_send_int64(chan_t* chan, int64_t data)
+{
+    if (chan->elem_size != 0)
+    {
+        return chan_send_sized(chan, &data, sizeof(int64_t));
+    }
+
+    int64_t* wrapped = malloc(sizeof(int64_t));
+    if (!wrapped)
+    {
+        return -1;
+    }
+
+    *wrapped = data;
+
+    int success = chan_send(chan, wrapped);
+    if (success != 0)
+    {
+        free(wrapped);
+    }
+
+    return success;
+}
+
+int chan_recv_int64(chan_t* chan, int64_t* data)
+{
+    if (chan->elem_size != 0)
+    {
+        return chan_recv_sized(chan, data, sizeof(int64_t));
+    }
+
+    int64_t* wrapped = NULL;
+    int success = chan_recv(chan, (void*) &wrapped);
+    if (wrapped != NULL)
+    {
+        *data = *wrapped;
+        free(wrapped);
+    }
+
+    return success;
+}
+
+int chan_send_double(chan_t* chan, double data)
+{
+    if (chan->elem_size != 0)
+    {
+        return chan_send_sized(chan, &data, sizeof(double));
+    }
+
+    double* wrapped = malloc(sizeof(double));
+    if (!wrapped)
+    {
+        return -1;
     }
 
     *wrapped = data;
@@ -539,6 +1886,11 @@ int chan_send_double(chan_t* chan, double data)
 
 int chan_recv_double(chan_t* chan, double* data)
 {
+    if (chan->elem_size != 0)
+    {
+        return chan_recv_sized(chan, data, sizeof(double));
+    }
+
     double* wrapped = NULL;
     int success = chan_recv(chan, (void*) &wrapped);
     if (wrapped != NULL)
@@ -552,6 +1904,11 @@ int chan_recv_double(chan_t* chan, double* data)
 
 int chan_send_buf(chan_t* chan, void* data, size_t size)
 {
+    if (chan->elem_size != 0)
+    {
+        return chan_send_sized(chan, data, size);
+    }
+
     void* wrapped = malloc(size);
     if (!wrapped)
     {
@@ -571,6 +1928,11 @@ int chan_send_buf(chan_t* chan, void* data, size_t size)
 
 int chan_recv_buf(chan_t* chan, void* data, size_t size)
 {
+    if (chan->elem_size != 0)
+    {
+        return chan_recv_sized(chan, data, size);
+    }
+
     void* wrapped = NULL;
     int success = chan_recv(chan, (void*) &wrapped);
     if (wrapped != NULL)
@@ -582,6 +1944,142 @@ int chan_recv_buf(chan_t* chan, void* data, size_t size)
     return success;
 }
 
+// Every pooled buffer is preceded by a header naming its pool and the length
+// of the message it holds, padded to a cache line so payloads stay aligned.
+typedef struct chan_pool_hdr_t
+{
+    chan_pool_t* pool;
+    size_t       len;
+} chan_pool_hdr_t;
+
+#define CHAN_POOL_HDR_SIZE QUEUE_CACHE_LINE
+
+static inline chan_pool_hdr_t* chan_pool_hdr(void* buf)
+{
+    return (chan_pool_hdr_t*) ((char*) buf - CHAN_POOL_HDR_SIZE);
+}
+
+// Allocates and returns a pool of count buffers of buf_size bytes each. The
+// buffers are carved out of a single cache-aligned slab. Sets errno and
+// returns NULL if initialization failed.
+chan_pool_t* chan_pool_init(size_t buf_size, size_t count)
+{
+    if (buf_size == 0 || count == 0 || count > INT_MAX)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_pool_t* pool = (chan_pool_t*) malloc(sizeof(chan_pool_t));
+    if (!pool)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pool->buf_size = buf_size;
+    pool->stride = CHAN_POOL_HDR_SIZE +
+        (buf_size + QUEUE_CACHE_LINE - 1) / QUEUE_CACHE_LINE * QUEUE_CACHE_LINE;
+    pool->count = count;
+    if (posix_memalign((void**) &pool->slab, QUEUE_CACHE_LINE,
+        pool->stride * count) != 0)
+    {
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pool->free_bufs = mpmc_queue_init(count, sizeof(void*));
+    if (!pool->free_bufs)
+    {
+        free(pool->slab);
+        free(pool);
+        return NULL;
+    }
+
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        chan_pool_hdr_t* hdr = (chan_pool_hdr_t*) (pool->slab + i * pool->stride);
+        void* buf = (char*) hdr + CHAN_POOL_HDR_SIZE;
+        hdr->pool = pool;
+        hdr->len = 0;
+        mpmc_queue_add(pool->free_bufs, &buf);
+    }
+    pool->free = uthread_sem_create((int) count);
+    return pool;
+}
+
+// Releases the pool resources. Every buffer must have been released first.
+void chan_pool_dispose(chan_pool_t* pool)
+{
+    uthread_sem_destroy(pool->free);
+    mpmc_queue_dispose(pool->free_bufs);
+    free(pool->slab);
+    free(pool);
+}
+
+// Returns a buffer of the pool's buf_size bytes, blocking until one is free.
+void* chan_pool_acquire(chan_pool_t* pool)
+{
+    void* buf;
+    uthread_sem_wait(pool->free);
+
+    // The semaphore guarantees a buffer, but a release that has claimed an
+    // earlier slot of the ring may not have published it yet.
+    while (mpmc_queue_remove(pool->free_bufs, &buf) != 0)
+    {
+        uthread_yield();
+    }
+    chan_pool_hdr(buf)->len = 0;
+    return buf;
+}
+
+// Returns a buffer obtained from chan_pool_acquire to its pool.
+void chan_pool_release(void* buf)
+{
+    chan_pool_t* pool = chan_pool_hdr(buf)->pool;
+    mpmc_queue_add(pool->free_bufs, &buf);
+    uthread_sem_signal(pool->free);
+}
+
+// Sends ownership of the pooled buffer buf, holding a message of len bytes,
+// through a channel of pointers. Only the pointer is copied. Returns 0 if the
+// send succeeded or -1 if it failed, in which case the caller still owns buf.
+int chan_send_pooled(chan_t* chan, void* buf, size_t len)
+{
+    if (chan->elem_size != 0 || len > chan_pool_hdr(buf)->pool->buf_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    chan_pool_hdr(buf)->len = len;
+    return chan_send_value(chan, &buf);
+}
+
+// Receives ownership of a pooled buffer sent with chan_send_pooled, storing it
+// in buf and its message length in len, unless len is NULL. Returns 0 if the
+// receive succeeded or -1 if it failed.
+int chan_recv_pooled(chan_t* chan, void** buf, size_t* len)
+{
+    if (chan->elem_size != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (chan_recv_value(chan, buf) != 0)
+    {
+        return -1;
+    }
+    if (len)
+    {
+        *len = chan_pool_hdr(*buf)->len;
+    }
+    return 0;
+}
+
 // returns all of the channels that can proceed with a communication
 int chan_alt(chan_t* recv_chans[], int recv_count, int canrecv[])
 {
@@ -601,3 +2099,500 @@ int chan_alt(chan_t* recv_chans[], int recv_count, int canrecv[])
 }
 
 
+
+// Allocates and returns a new, empty readiness set. Returns NULL if
+// initialization failed.
+chan_set_t* chan_set_init()
+{
+    chan_set_t* set = (chan_set_t*) malloc(sizeof(chan_set_t));
+    if (!set)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    spinlock_create(&set->lock);
+    set->head = NULL;
+    set->tail = NULL;
+    uthread_initqueue(&set->waiters);
+    return set;
+}
+
+// Releases the set resources. Channels still registered with the set must be
+// removed first.
+void chan_set_dispose(chan_set_t* set)
+{
+    free(set);
+}
+
+// Registers a channel with the set. A channel can belong to at most one set.
+// Returns 0 if the channel was added or -1 if it already belongs to a set.
+int chan_set_add(chan_set_t* set, chan_t* chan)
+{
+    // Claim the channel first: the lock of this set does not keep another
+    // set from adding it at the same time.
+    spinlock_lock(&set->lock);
+    chan_set_t* none = NULL;
+    if (!__atomic_compare_exchange_n(&chan->set, &none, set, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        spinlock_unlock(&set->lock);
+        return -1;
+    }
+
+    // The channel may already be receivable, so queue it and let
+    // chan_set_wait decide.
+    chan->set_queued = 1;
+    if (!chan->set_linked)
+    {
+        chan_set_append(set, chan);
+    }
+    uthread_t waiter = uthread_dequeue(&set->waiters);
+    spinlock_unlock(&set->lock);
+
+    if (waiter)
+    {
+        uthread_unblock(waiter);
+    }
+    return 0;
+}
+
+// Unregisters a channel from the set. Returns 0 if the channel was removed or
+// -1 if it did not belong to the set.
+int chan_set_remove(chan_set_t* set, chan_t* chan)
+{
+    spinlock_lock(&set->lock);
+    if (chan->set != set)
+    {
+        spinlock_unlock(&set->lock);
+        return -1;
+    }
+
+    __atomic_store_n(&chan->set, NULL, __ATOMIC_SEQ_CST);
+    if (chan->set_linked)
+    {
+        chan_set_unlink(set, chan);
+    }
+    chan->set_queued = 0;
+    spinlock_unlock(&set->lock);
+    return 0;
+}
+
+// Blocks until at least one channel in the set can be received from (or has
+// been closed) and stores up to max such channels in ready. Returns the number
+// stored. Readiness is level-triggered: a channel that is still receivable on
+// the next call is reported again.
+int chan_set_wait(chan_set_t* set, chan_t* ready[], int max)
+{
+    spinlock_lock(&set->lock);
+    for (;;)
+    {
+        chan_t* requeue = NULL;
+        int count = 0;
+        while (count < max && set->head)
+        {
+            chan_t* chan = set->head;
+            chan_set_unlink(set, chan);
+
+            // Clear the flag before checking, so that a send racing with the
+            // check either is seen by it or queues the channel again.
+            __atomic_store_n(&chan->set_queued, 0, __ATOMIC_SEQ_CST);
+            if (!select_recv_ready(chan) && !chan_is_closed(chan))
+            {
+                continue;
+            }
+
+            ready[count++] = chan;
+            if (!__atomic_exchange_n(&chan->set_queued, 1, __ATOMIC_SEQ_CST))
+            {
+                // Keep it queued so the next wait looks at it again.
+                chan->set_next = requeue;
+                requeue = chan;
+            }
+        }
+
+        while (requeue)
+        {
+            chan_t* chan = requeue;
+            requeue = chan->set_next;
+            chan_set_append(set, chan);
+        }
+
+        if (count > 0)
+        {
+            spinlock_unlock(&set->lock);
+            return count;
+        }
+
+        uthread_enqueue(&set->waiters, uthread_self());
+        spinlock_unlock(&set->lock);
+        uthread_block();
+        spinlock_lock(&set->lock);
+    }
+}
+
+// Returns the slot for position pos.
+static inline mpmc_slot_t* chan_bcast_slot(chan_bcast_t* bcast, size_t pos)
+{
+    return (mpmc_slot_t*) (bcast->slots + (pos & (bcast->capacity - 1)) * bcast->stride);
+}
+
+// Allocates and returns a new broadcast channel for values of elem_size bytes,
+// or of pointers if elem_size is 0, holding up to capacity values rounded up to
+// a power of two, with the given policy for slow subscribers. Sets errno and
+// returns NULL if initialization failed.
+chan_bcast_t* chan_bcast_init(size_t elem_size, size_t capacity,
+    chan_bcast_policy_t policy)
+{
+    size_t size = elem_size ? elem_size : sizeof(void*);
+    size_t stride = (sizeof(mpmc_slot_t) + size + sizeof(mpmc_slot_t) - 1)
+        / sizeof(mpmc_slot_t) * sizeof(mpmc_slot_t);
+    if (capacity == 0 || capacity > INT_MAX / stride)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_bcast_t* bcast = NULL;
+    if (posix_memalign((void**) &bcast, QUEUE_CACHE_LINE, sizeof(chan_bcast_t)) != 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    bcast->capacity = queue_pow2(capacity);
+    bcast->slots = (char*) malloc(bcast->capacity * stride);
+    if (!bcast->slots)
+    {
+        free(bcast);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    bcast->claim = 0;
+    bcast->min_cursor = 0;
+    bcast->dropped = 0;
+    bcast->elem_size = size;
+    bcast->stride = stride;
+    bcast->policy = policy;
+    bcast->closed = 0;
+    spinlock_create(&bcast->lock);
+    bcast->subs = NULL;
+    uthread_initqueue(&bcast->r_waiters);
+    uthread_initqueue(&bcast->w_waiters);
+    bcast->r_count = 0;
+    bcast->w_count = 0;
+
+    // Slot i starts out as if position i - capacity had been read from it.
+    size_t i;
+    for (i = 0; i < bcast->capacity; i++)
+    {
+        chan_bcast_slot(bcast, i)->seq = 0;
+    }
+    return bcast;
+}
+
+// Releases the channel resources. Every subscription must have been
+// cancelled first.
+void chan_bcast_dispose(chan_bcast_t* bcast)
+{
+    free(bcast->slots);
+    free(bcast);
+}
+
+// Recomputes the cursor of the slowest subscriber. With no subscribers
+// nothing holds the publishers back. Positions are compared by signed
+// distance, since cursors may move past the claim read here. The lock must be
+// held.
+static void chan_bcast_update_min(chan_bcast_t* bcast)
+{
+    size_t min = __atomic_load_n(&bcast->claim, __ATOMIC_SEQ_CST);
+    chan_sub_t* sub;
+    for (sub = bcast->subs; sub; sub = sub->next)
+    {
+        size_t cursor = __atomic_load_n(&sub->cursor, __ATOMIC_SEQ_CST);
+        if ((intptr_t) (cursor - min) < 0)
+        {
+            min = cursor;
+        }
+    }
+    bcast->min_cursor = min;
+}
+
+static int chan_bcast_is_closed(chan_bcast_t* bcast)
+{
+    return __atomic_load_n(&bcast->closed, __ATOMIC_SEQ_CST);
+}
+
+// Returns 1 if position pos would not overrun the slowest subscriber. A stale
+// pos behind the cursor counts as room; claiming it fails and is retried.
+static int chan_bcast_has_room(chan_bcast_t* bcast, size_t pos)
+{
+    return (intptr_t) (pos - bcast->min_cursor) < (intptr_t) bcast->capacity;
+}
+
+// Wakes every thread on queue, whose count is *count, if the count shows there
+// is one.
+static void chan_bcast_wake(chan_bcast_t* bcast, uthread_queue_t* queue,
+    volatile int* count)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(count, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+
+    uthread_queue_t ready;
+    spinlock_lock(&bcast->lock);
+    ready = *queue;
+    uthread_initqueue(queue);
+    __atomic_store_n(count, 0, __ATOMIC_RELAXED);
+    spinlock_unlock(&bcast->lock);
+
+    uthread_unblock_queue(&ready);
+}
+
+// Reserves the next position for a publish, blocking or dropping as the
+// policy says while the slowest subscriber has no room. Returns 0 and stores
+// the position in pos, 1 if the value is dropped, or -1 if the channel is
+// closed.
+static int chan_bcast_claim(chan_bcast_t* bcast, size_t* pos)
+{
+    for (;;)
+    {
+        if (chan_bcast_is_closed(bcast))
+        {
+            return -1;
+        }
+
+        size_t claim = __atomic_load_n(&bcast->claim, __ATOMIC_RELAXED);
+        if (bcast->policy != CHAN_BCAST_OVERWRITE && !chan_bcast_has_room(bcast, claim))
+        {
+            // The cached cursor may be stale, so look again before giving up.
+            spinlock_lock(&bcast->lock);
+            chan_bcast_update_min(bcast);
+            claim = __atomic_load_n(&bcast->claim, __ATOMIC_SEQ_CST);
+            if (!chan_bcast_has_room(bcast, claim))
+            {
+                if (bcast->policy == CHAN_BCAST_DROP)
+                {
+                    bcast->dropped++;
+                    spinlock_unlock(&bcast->lock);
+                    return 1;
+                }
+
+                // Block until a subscriber moves on; it checks w_count after
+                // advancing, so counting first means the wakeup is not lost.
+                __atomic_add_fetch(&bcast->w_count, 1, __ATOMIC_SEQ_CST);
+                chan_bcast_update_min(bcast);
+                claim = __atomic_load_n(&bcast->claim, __ATOMIC_SEQ_CST);
+                if (!chan_bcast_has_room(bcast, claim) && !bcast->closed)
+                {
+                    uthread_enqueue(&bcast->w_waiters, uthread_self());
+                    spinlock_unlock(&bcast->lock);
+                    uthread_block();
+                    continue;
+                }
+                __atomic_sub_fetch(&bcast->w_count, 1, __ATOMIC_RELAXED);
+            }
+            spinlock_unlock(&bcast->lock);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&bcast->claim, &claim, claim + 1, 1,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            *pos = claim;
+            return 0;
+        }
+    }
+}
+
+// Publishes a copy of the element at elem to every current subscriber.
+// Returns 0 if the value was published, 1 if it was dropped under
+// CHAN_BCAST_DROP, or -1 if the channel is closed. If -1 is returned, errno
+// will be set.
+int chan_bcast_publish(chan_bcast_t* bcast, const void* elem)
+{
+    size_t pos;
+    int result = chan_bcast_claim(bcast, &pos);
+    if (result != 0)
+    {
+        if (result < 0)
+        {
+            errno = EPIPE;
+        }
+        return result;
+    }
+
+    // Wait for the publisher of the previous lap of this slot, which can only
+    // still be writing it if publishers are a whole ring apart.
+    mpmc_slot_t* slot = chan_bcast_slot(bcast, pos);
+    size_t prev = pos >= bcast->capacity ? 2 * (pos - bcast->capacity) + 2 : 0;
+    while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != prev)
+    {
+        uthread_yield();
+    }
+
+    // Mark the slot as being written, so that readers of the previous lap
+    // notice their copy may be torn.
+    __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot + 1, elem, bcast->elem_size);
+    __atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+
+    chan_bcast_wake(bcast, &bcast->r_waiters, &bcast->r_count);
+    return 0;
+}
+
+// Closes the channel. Subscribers still receive the values published before
+// the close. Returns 0 if the channel was closed or -1 if it already was. If
+// -1 is returned, errno will be set.
+int chan_bcast_close(chan_bcast_t* bcast)
+{
+    if (__atomic_exchange_n(&bcast->closed, 1, __ATOMIC_SEQ_CST))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    chan_bcast_wake(bcast, &bcast->r_waiters, &bcast->r_count);
+    chan_bcast_wake(bcast, &bcast->w_waiters, &bcast->w_count);
+    return 0;
+}
+
+// Subscribes to the channel. The subscription receives every value published
+// from now on. Returns NULL if allocation failed.
+chan_sub_t* chan_bcast_subscribe(chan_bcast_t* bcast)
+{
+    chan_sub_t* sub = (chan_sub_t*) malloc(sizeof(chan_sub_t));
+    if (!sub)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    sub->bcast = bcast;
+    sub->dropped = 0;
+    sub->prev = NULL;
+    spinlock_lock(&bcast->lock);
+    sub->cursor = __atomic_load_n(&bcast->claim, __ATOMIC_SEQ_CST);
+    sub->next = bcast->subs;
+    if (bcast->subs)
+    {
+        bcast->subs->prev = sub;
+    }
+    bcast->subs = sub;
+    spinlock_unlock(&bcast->lock);
+    return sub;
+}
+
+// Cancels and releases a subscription.
+void chan_bcast_unsubscribe(chan_sub_t* sub)
+{
+    chan_bcast_t* bcast = sub->bcast;
+    spinlock_lock(&bcast->lock);
+    if (sub->prev)
+    {
+        sub->prev->next = sub->next;
+    }
+    else
+    {
+        bcast->subs = sub->next;
+    }
+    if (sub->next)
+    {
+        sub->next->prev = sub->prev;
+    }
+    spinlock_unlock(&bcast->lock);
+    free(sub);
+
+    // A publisher may have been waiting for this subscriber.
+    chan_bcast_wake(bcast, &bcast->w_waiters, &bcast->w_count);
+}
+
+// Returns 1 if the value for position pos has been published, or overwritten
+// by a later one, or if the channel is closed and nothing is left to publish.
+static int chan_bcast_ready(chan_bcast_t* bcast, size_t pos)
+{
+    return __atomic_load_n(&chan_bcast_slot(bcast, pos)->seq, __ATOMIC_SEQ_CST) >= 2 * pos + 2 ||
+        (chan_bcast_is_closed(bcast) &&
+         __atomic_load_n(&bcast->claim, __ATOMIC_SEQ_CST) == pos);
+}
+
+// Receives the next value for the subscription and copies it to elem, unless
+// elem is NULL, blocking until one is published. Returns 0 if a value was
+// received or -1 if the channel is closed and the subscription has drained it.
+// If -1 is returned, errno will be set.
+int chan_sub_recv(chan_sub_t* sub, void* elem)
+{
+    chan_bcast_t* bcast = sub->bcast;
+    size_t pos = sub->cursor;
+    for (;;)
+    {
+        mpmc_slot_t* slot = chan_bcast_slot(bcast, pos);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == 2 * pos + 2)
+        {
+            if (elem)
+            {
+                memcpy(elem, slot + 1, bcast->elem_size);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            {
+                break;
+            }
+            // Overwritten while being copied; fall through to skip ahead.
+            seq = 2 * pos + 3;
+        }
+
+        if (seq > 2 * pos + 2)
+        {
+            // Lapped by the publishers: skip to the oldest value that can
+            // still be in the ring.
+            size_t oldest = __atomic_load_n(&bcast->claim, __ATOMIC_ACQUIRE)
+                - bcast->capacity;
+            if ((intptr_t) (oldest - pos) > 0)
+            {
+                sub->dropped += oldest - pos;
+                pos = oldest;
+            }
+            else
+            {
+                pos++;
+                sub->dropped++;
+            }
+            continue;
+        }
+
+        if (chan_bcast_is_closed(bcast) &&
+            __atomic_load_n(&bcast->claim, __ATOMIC_SEQ_CST) == pos)
+        {
+            sub->cursor = pos;
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Nothing to read yet: park until the next publish. Counting first
+        // and checking after means the publisher's wakeup is not lost.
+        spinlock_lock(&bcast->lock);
+        __atomic_add_fetch(&bcast->r_count, 1, __ATOMIC_SEQ_CST);
+        if (chan_bcast_ready(bcast, pos))
+        {
+            __atomic_sub_fetch(&bcast->r_count, 1, __ATOMIC_RELAXED);
+            spinlock_unlock(&bcast->lock);
+            continue;
+        }
+        uthread_enqueue(&bcast->r_waiters, uthread_self());
+        spinlock_unlock(&bcast->lock);
+        uthread_block();
+    }
+
+    __atomic_store_n(&sub->cursor, pos + 1, __ATOMIC_SEQ_CST);
+    if (bcast->policy == CHAN_BCAST_BLOCK)
+    {
+        chan_bcast_wake(bcast, &bcast->w_waiters, &bcast->w_count);
+    }
+    return 0;
+}
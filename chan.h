@@ -2,11 +2,53 @@
 #define __chan_h__
 
 #include <stdint.h>
+#include <stdio.h>
 
+#include "spinlock.h"
 #include "uthread.h"
+#include "uthread_util.h"
 #include "uthread_mutex_cond.h"
+#include "uthread_sem.h"
 #include "queue.h"
 
+// Per-channel statistics are collected when the library is compiled with
+// -DCHAN_STATS=1. Otherwise the statistics functions below report nothing and
+// cost nothing.
+#ifndef CHAN_STATS
+#define CHAN_STATS 0
+#endif
+
+#define CHAN_STATS_BUCKETS 10
+
+// Statistics of one channel. Blocked counts and time cover chan_send,
+// chan_recv and their variants, but not select. occupancy is sampled after
+// every operation that moves a value. Bucket 0 counts samples that found a
+// buffered channel empty, the last bucket those that found it full, and the
+// buckets in between split the rest evenly. An unbuffered transfer counts as
+// full when the sender was parked first, i.e. the receiver was the
+// bottleneck, and as empty when the receiver was.
+typedef struct chan_stats_t
+{
+    const char*          name;
+    const struct chan_t* chan;
+    size_t               capacity;
+    unsigned long        sends;
+    unsigned long        recvs;
+    unsigned long        send_blocked;
+    unsigned long        recv_blocked;
+    unsigned long long   blocked_ns;
+    unsigned long        occupancy[CHAN_STATS_BUCKETS];
+} chan_stats_t;
+
+// Threads waiting for a channel to become ready, in arrival order. count is
+// read without the channel lock to skip the lock when nobody is waiting.
+typedef struct chan_waitq_t
+{
+    struct chan_waiter_t* head;
+    struct chan_waiter_t* tail;
+    volatile int          count;
+} chan_waitq_t;
+
 // Defines a thread-safe communication pipe. Channels are either buffered or
 // unbuffered. An unbuffered channel is synchronized. Receiving on either type
 // of channel will block until there is data to receive. If the channel is
@@ -15,31 +57,192 @@
 // copied to the buffer, meaning it will block if the channel is full.
 typedef struct chan_t
 {
-    // Buffered channel properties
-    queue_t*         queue;
-    
-    // Unbuffered channel properties
-    uthread_mutex_t  r_mu;
-    uthread_mutex_t  w_mu;
-    void*            data;
-
-    // Shared properties
-    uthread_mutex_t  m_mu;
-    uthread_cond_t   r_cond;
-    uthread_cond_t   w_cond;
+    // Read-mostly fields, on a line of their own. Size of the values carried
+    // by a channel made by chan_init_typed, or 0 for a channel of pointers.
+    size_t           elem_size __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // Buffered channel properties. The buffer is a lock-free ring, an
+    // spsc_queue_t for channels made by chan_init_spsc and an mpmc_queue_t
+    // otherwise, or the segment list of a channel made by
+    // chan_init_unbounded.
+    mpmc_queue_t*    mpmc;
+    spsc_queue_t*    spsc;
+    seg_queue_t*     seg;
+
     int              closed;
-    int              r_waiting;
-    int              w_waiting;
+
+    // Readiness set this channel is registered with, if any.
+    struct chan_set_t* set;
+
+    // Threads parked until the channel can be received from (r_waiters) or
+    // sent to (w_waiters): blocked buffered operations and blocking selects.
+    // An unbuffered channel has no other state: its senders and receivers
+    // park here with their element, and the thread that arrives second
+    // copies the value directly and wakes its peer. lock only protects these
+    // queues. Buffered operations only take it to park or when a non-zero
+    // count shows someone to wake; unbuffered operations take it once.
+    // Receivers write r_waiters when they park and senders read its count on
+    // every send, and the other way round for w_waiters, so each queue has a
+    // cache line of its own and a busy sender and receiver on different
+    // workers only share a line when one of them actually parks.
+    chan_waitq_t     r_waiters __attribute__((aligned(QUEUE_CACHE_LINE)));
+    chan_waitq_t     w_waiters __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // The lock, taken by both sides, and this channel's links on its set's
+    // ready list. set_queued is set by whichever sender first finds the
+    // channel off the list, so each channel is queued at most once.
+    spinlock_t       lock __attribute__((aligned(QUEUE_CACHE_LINE)));
+    struct chan_t*   set_prev;
+    struct chan_t*   set_next;
+    volatile int     set_queued;
+    int              set_linked;
+
+#if CHAN_STATS
+    // Counters, and links on the list of live channels.
+    chan_stats_t     stats;
+    struct chan_t*   stats_prev;
+    struct chan_t*   stats_next;
+#endif
 } chan_t;
 
+// A readiness set watches many channels for receiving. A channel is put on the
+// set's ready list by the operation that makes it receivable (a send, or
+// closing it), so waiting on a set costs time proportional to the number of
+// ready channels rather than the number watched.
+typedef struct chan_set_t
+{
+    spinlock_t       lock;
+    chan_t*          head;
+    chan_t*          tail;
+    uthread_queue_t  waiters;
+} chan_set_t;
+
+// What a broadcast channel does when its slowest subscriber is capacity
+// messages behind: block the publisher until that subscriber catches up,
+// drop the new message, or overwrite the oldest one, so subscribers that fell
+// behind skip it.
+typedef enum chan_bcast_policy_t
+{
+    CHAN_BCAST_BLOCK,
+    CHAN_BCAST_DROP,
+    CHAN_BCAST_OVERWRITE
+} chan_bcast_policy_t;
+
+// A broadcast channel delivers every published value to every subscriber.
+// Values are stored once in a shared ring and each subscriber reads them at
+// its own cursor, so a publish costs the same however many subscribers there
+// are. Each slot carries a sequence number, 2 * pos + 2 once the value for
+// position pos is in it and odd while it is being written, which lets
+// subscribers read without locking and notice when a value was overwritten
+// under them. lock protects the subscriber list and the two wait queues;
+// publishers only take it to park or when a count shows someone to wake.
+typedef struct chan_bcast_t
+{
+    volatile size_t      claim __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t               min_cursor;
+    size_t               dropped;
+
+    size_t               elem_size __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t               capacity;
+    size_t               stride;
+    char*                slots;
+    chan_bcast_policy_t  policy;
+    int                  closed;
+
+    spinlock_t           lock;
+    struct chan_sub_t*   subs;
+    uthread_queue_t      r_waiters;
+    uthread_queue_t      w_waiters;
+    volatile int         r_count;
+    volatile int         w_count;
+} chan_bcast_t;
+
+// One subscriber's view of a broadcast channel. A subscription must only be
+// read from by one thread at a time. dropped counts the values it missed
+// because they were overwritten before it read them.
+typedef struct chan_sub_t
+{
+    chan_bcast_t*        bcast;
+    volatile size_t      cursor;
+    size_t               dropped;
+    struct chan_sub_t*   prev;
+    struct chan_sub_t*   next;
+} chan_sub_t;
+
+// A pool of fixed-size message buffers for passing large messages without
+// copying them. A producer acquires a buffer, fills it in place and sends it
+// with chan_send_pooled, which only moves the pointer; the consumer reads it in
+// place and releases it. A pool can serve any number of channels. Free buffers
+// are kept on a lock-free ring, and free counts them so that acquiring from an
+// exhausted pool blocks until a buffer is released.
+typedef struct chan_pool_t
+{
+    size_t           buf_size;
+    size_t           stride;
+    size_t           count;
+    char*            slab;
+    mpmc_queue_t*    free_bufs;
+    uthread_sem_t    free;
+} chan_pool_t;
+
 // added for select
 int chan_alt(chan_t* recv_chans[], int recv_count, int *canrecv);
 
+// Allocates and returns a new, empty readiness set. Returns NULL if
+// initialization failed.
+chan_set_t* chan_set_init();
+
+// Releases the set resources. Channels still registered with the set must be
+// removed first.
+void chan_set_dispose(chan_set_t* set);
+
+// Registers a channel with the set. A channel can belong to at most one set.
+// Returns 0 if the channel was added or -1 if it already belongs to a set.
+int chan_set_add(chan_set_t* set, chan_t* chan);
+
+// Unregisters a channel from the set. Returns 0 if the channel was removed or
+// -1 if it did not belong to the set.
+int chan_set_remove(chan_set_t* set, chan_t* chan);
+
+// Blocks until at least one channel in the set can be received from (or has
+// been closed) and stores up to max such channels in ready. Returns the number
+// stored. Readiness is level-triggered: a channel that is still receivable on
+// the next call is reported again.
+int chan_set_wait(chan_set_t* set, chan_t* ready[], int max);
+
 // Allocates and returns a new channel. The capacity specifies whether the
 // channel should be buffered or not. A capacity of 0 will create an unbuffered
 // channel. Sets errno and returns NULL if initialization failed.
 chan_t* chan_init(size_t capacity);
 
+// Allocates and returns a new buffered channel for exactly one sending thread
+// and one receiving thread. Sends and receives go through a lock-free ring and
+// only block when it is full or empty. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_spsc(size_t capacity);
+
+// Allocates and returns a new channel whose elements are values of elem_size
+// bytes, stored inline in the channel and copied in and out, so no message
+// needs its own allocation. The capacity is as for chan_init. The typed
+// send/recv functions below copy inline when their size matches elem_size.
+// Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_typed(size_t elem_size, size_t capacity);
+
+// Allocates and returns a new buffered channel with no capacity limit, whose
+// elements are values of elem_size bytes as for chan_init_typed, or pointers
+// if elem_size is 0. Sends never block: the buffer grows a segment at a time
+// to absorb bursts, and drained segments are recycled or freed, so memory
+// follows the number of queued values. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_unbounded(size_t elem_size);
+
+// Arranges for on_high(arg, size) to be called by the sender that takes an
+// unbounded channel from below high queued values to high or more. It is
+// called again only after the channel has dropped below high. Returns 0, or
+// -1 if the channel is not unbounded.
+int chan_set_watermark(chan_t* chan, size_t high,
+    void (*on_high)(void* arg, size_t size), void* arg);
+
 // Releases the channel resources.
 void chan_dispose(chan_t* chan);
 
@@ -57,13 +260,86 @@ int chan_is_closed(chan_t* chan);
 // Sends a value into the channel. If the channel is unbuffered, this will
 // block until a receiver receives the value. If the channel is buffered and at
 // capacity, this will block until a receiver receives a value. Returns 0 if
-// the send succeeded or -1 if it failed.
+// the send succeeded or -1 if it failed. On a channel made by chan_init_typed
+// this is chan_send_value, and data points at the element.
 int chan_send(chan_t* chan, void* data);
 
 // Receives a value from the channel. This will block until there is data to
 // receive. Returns 0 if the receive succeeded or -1 if it failed.
 int chan_recv(chan_t* chan, void** data);
 
+// Sends a copy of the element at elem into the channel, blocking as chan_send
+// does. For a channel made by chan_init or chan_init_spsc the element is a
+// void*. Returns 0 if the send succeeded or -1 if it failed.
+int chan_send_value(chan_t* chan, const void* elem);
+
+// Receives an element from the channel and copies it to elem, unless elem is
+// NULL, blocking as chan_recv does. Returns 0 if the receive succeeded or -1
+// if it failed.
+int chan_recv_value(chan_t* chan, void* elem);
+
+// Sends up to n elements from items, an array of elements as passed to
+// chan_send_value. Blocks until at least one element has been sent, then sends
+// as many more as the channel accepts without blocking. On a buffered channel
+// the elements are added to the ring as a batch and receivers are woken once.
+// Returns the number of elements sent, or -1 if the channel is closed.
+int chan_send_many(chan_t* chan, const void* items, size_t n);
+
+// Receives up to max elements into out, an array of elements as passed to
+// chan_recv_value, unless out is NULL. Blocks until at least min elements
+// have been received, or the channel is closed and drained, then takes as
+// many more as are available without blocking. Returns the number of elements
+// received, or -1 if the channel is closed and nothing was received.
+int chan_recv_many(chan_t* chan, void* out, size_t max, size_t min);
+
+// Returned by the timed operations below when their deadline passes first.
+// Deadlines are times on the uthread_now clock, in nanoseconds; a timed-out
+// thread withdraws from the channel without disturbing any other waiter.
+#define CHAN_TIMEOUT -2
+
+// As chan_send and chan_recv, but give up after timeout_ns nanoseconds.
+// Return 0 on success, CHAN_TIMEOUT on timeout or -1 on failure.
+int chan_send_timeout(chan_t* chan, void* data, uint64_t timeout_ns);
+int chan_recv_timeout(chan_t* chan, void** data, uint64_t timeout_ns);
+
+// As chan_send, chan_recv, chan_send_value and chan_recv_value, but give up
+// once deadline has passed, so one deadline can be passed down a pipeline.
+// UTHREAD_FOREVER never expires. Return as chan_send_timeout does.
+int chan_send_deadline(chan_t* chan, void* data, uint64_t deadline);
+int chan_recv_deadline(chan_t* chan, void** data, uint64_t deadline);
+int chan_send_value_deadline(chan_t* chan, const void* elem,
+    uint64_t deadline);
+int chan_recv_value_deadline(chan_t* chan, void* elem, uint64_t deadline);
+
+// Labels the channel in its statistics. name is not copied and must outlive
+// the channel. Does nothing unless statistics are collected.
+void chan_set_name(chan_t* chan, const char* name);
+
+// Copies the statistics of the channel to stats.
+void chan_stats(chan_t* chan, chan_stats_t* stats);
+
+// Copies the statistics of up to max live channels to stats, longest total
+// blocked time first. Returns the number copied.
+int chan_stats_all(chan_stats_t* stats, int max);
+
+// Prints the statistics of every live channel that has been used, longest
+// total blocked time first. Called at exit when statistics are collected.
+void chan_stats_dump(FILE* file);
+
+// Returned by the try operations below when they would have to block.
+#define CHAN_WOULDBLOCK -3
+
+// Non-blocking chan_send and chan_recv. A buffered channel with room or data
+// completes through its lock-free ring without taking the channel lock unless
+// a blocked peer has to be woken; an unbuffered channel completes only if a
+// peer is already parked. Return 0 on success, CHAN_WOULDBLOCK if the
+// operation would block or -1 if the channel is closed (and, for a receive,
+// drained).
+int chan_try_send(chan_t* chan, void* data);
+int chan_try_recv(chan_t* chan, void** data);
+int chan_try_send_value(chan_t* chan, const void* elem);
+int chan_try_recv_value(chan_t* chan, void* elem);
+
 // Returns the number of items in the channel buffer. If the channel is
 // unbuffered, this will return 0.
 int chan_size(chan_t* chan);
@@ -71,14 +347,28 @@ int chan_size(chan_t* chan);
 // A select statement chooses which of a set of possible send or receive
 // operations will proceed. The return value indicates which channel's
 // operation has proceeded. If more than one operation can proceed, one is
-// selected randomly. If none can proceed, -1 is returned. Select is intended
+// selected randomly. If none can proceed, select blocks until one can, without
+// consuming CPU. If the chosen operation fails because its channel is closed,
+// or there are no channels at all, -1 is returned. Select is intended
 // to be used in conjunction with a switch statement. In the case of a receive
 // operation, the received value will be pointed to by the provided pointer. In
 // the case of a send, the value at the same index as the channel will be sent.
+// For a channel made by chan_init_typed, recv_out and send_msgs[i] point at
+// elements instead.
 int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
     chan_t* send_chans[], int send_count, void* send_msgs[]);
 
-// Typed interface to send/recv chan.
+// As chan_select, but returns CHAN_TIMEOUT if no operation could proceed
+// before deadline. A deadline that has already passed, such as 0, makes
+// select poll each operation once without blocking.
+int chan_select_deadline(chan_t* recv_chans[], int recv_count,
+    void** recv_out, chan_t* send_chans[], int send_count, void* send_msgs[],
+    uint64_t deadline);
+
+// Typed interface to send/recv chan. On a channel of pointers each value is
+// sent in its own allocation; on a channel made by chan_init_typed it is sent
+// in place, and errno is set to EINVAL and -1 returned unless the elements
+// are the size of the value.
 int chan_send_int32(chan_t*, int32_t);
 int chan_send_int64(chan_t*, int64_t);
 #if ULONG_MAX == 4294967295UL
@@ -98,4 +388,63 @@ int chan_recv_int64(chan_t*, int64_t*);
 int chan_recv_double(chan_t*, double*);
 int chan_recv_buf(chan_t*, void*, size_t);
 
+// Allocates and returns a new broadcast channel for values of elem_size bytes,
+// or of pointers if elem_size is 0, holding up to capacity values rounded up to
+// a power of two, with the given policy for slow subscribers. Sets errno and
+// returns NULL if initialization failed.
+chan_bcast_t* chan_bcast_init(size_t elem_size, size_t capacity,
+    chan_bcast_policy_t policy);
+
+// Releases the channel resources. Every subscription must have been
+// cancelled first.
+void chan_bcast_dispose(chan_bcast_t* bcast);
+
+// Publishes a copy of the element at elem to every current subscriber. Under
+// CHAN_BCAST_BLOCK this blocks while the slowest subscriber is capacity values
+// behind. Returns 0 if the value was published, 1 if it was dropped under
+// CHAN_BCAST_DROP, or -1 if the channel is closed.
+int chan_bcast_publish(chan_bcast_t* bcast, const void* elem);
+
+// Closes the channel. Subscribers still receive the values published before
+// the close. Returns 0 if the channel was closed or -1 if it already was.
+int chan_bcast_close(chan_bcast_t* bcast);
+
+// Subscribes to the channel. The subscription receives every value published
+// from now on. Returns NULL if allocation failed.
+chan_sub_t* chan_bcast_subscribe(chan_bcast_t* bcast);
+
+// Cancels and releases a subscription.
+void chan_bcast_unsubscribe(chan_sub_t* sub);
+
+// Receives the next value for the subscription and copies it to elem, unless
+// elem is NULL, blocking until one is published. Returns 0 if a value was
+// received or -1 if the channel is closed and the subscription has drained it.
+int chan_sub_recv(chan_sub_t* sub, void* elem);
+
+// Allocates and returns a pool of count buffers of buf_size bytes each. Sets
+// errno and returns NULL if initialization failed.
+chan_pool_t* chan_pool_init(size_t buf_size, size_t count);
+
+// Releases the pool resources. Every buffer must have been released first.
+void chan_pool_dispose(chan_pool_t* pool);
+
+// Returns a buffer of the pool's buf_size bytes, blocking until one is free.
+void* chan_pool_acquire(chan_pool_t* pool);
+
+// Returns a buffer obtained from chan_pool_acquire to its pool.
+void chan_pool_release(void* buf);
+
+// Sends ownership of the pooled buffer buf, holding a message of len bytes,
+// through a channel of pointers. Only the pointer is copied. Returns 0 if the
+// send succeeded or -1 if it failed, in which case the caller still owns buf.
+// Both calls set errno to EINVAL on a channel made by chan_init_typed, even
+// one whose elements are the size of a pointer.
+int chan_send_pooled(chan_t* chan, void* buf, size_t len);
+
+// Receives ownership of a pooled buffer sent with chan_send_pooled, storing it
+// in buf and its message length in len, unless len is NULL. The receiver
+// releases the buffer with chan_pool_release once done with it. Returns 0 if
+// the receive succeeded or -1 if it failed.
+int chan_recv_pooled(chan_t* chan, void** buf, size_t* len);
+
 #endif
@@ -0,0 +1,465 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "chan_fd.h"
+
+// Capacity of the channel made by chan_from_fd.
+#define CHAN_FD_BUFFER 256
+
+// Initial size of the reader's buffer, and size of its spill area.
+#define CHAN_FD_READ 65536
+
+// Number of messages sent or written at once.
+#define CHAN_FD_BATCH 64
+
+typedef struct chan_fd_t
+{
+    int            fd;
+    chan_framing_t framing;
+    chan_t*        chan;
+} chan_fd_t;
+
+// Allocates a message with room for len bytes of data.
+chan_fd_msg_t* chan_fd_msg_new(size_t len)
+{
+    chan_fd_msg_t* msg = (chan_fd_msg_t*) malloc(sizeof(chan_fd_msg_t) + len);
+    if (msg)
+    {
+        msg->len = len;
+    }
+    return msg;
+}
+
+static int chan_fd_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+    {
+        return -1;
+    }
+    return flags & O_NONBLOCK ? 0 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static chan_fd_t* chan_fd_new(int fd, chan_framing_t framing, chan_t* chan)
+{
+    if (chan_fd_nonblock(fd) != 0)
+    {
+        return NULL;
+    }
+    chan_fd_t* adaptor = (chan_fd_t*) malloc(sizeof(chan_fd_t));
+    if (adaptor)
+    {
+        adaptor->fd = fd;
+        adaptor->framing = framing;
+        adaptor->chan = chan;
+    }
+    return adaptor;
+}
+
+// Sends the count messages of batch. Returns 0, or -1 if the channel was
+// closed, in which case the messages not sent are freed.
+static int chan_fd_flush(chan_t* chan, chan_fd_msg_t** batch, size_t count)
+{
+    size_t sent = 0;
+    while (sent < count)
+    {
+        int n = chan_send_many(chan, batch + sent, count - sent);
+        if (n < 0)
+        {
+            while (sent < count)
+            {
+                free(batch[sent++]);
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// Returns the size the buffer needs for the frame that starts it, given that
+// it holds end bytes of a total of size, or 0 if the frame is malformed.
+static size_t chan_fd_frame_size(const char* buf, size_t end, size_t size,
+    chan_framing_t framing)
+{
+    if (framing == CHAN_FRAME_LENGTH)
+    {
+        if (end < 4)
+        {
+            return size;
+        }
+        const unsigned char* header = (const unsigned char*) buf;
+        size_t len = (size_t) header[0] << 24 | (size_t) header[1] << 16 |
+            (size_t) header[2] << 8 | header[3];
+        return len > CHAN_FD_MAX_MSG ? 0 : (4 + len > size ? 4 + len : size);
+    }
+
+    // A line that fills the buffer needs a larger one.
+    if (end < size)
+    {
+        return size;
+    }
+    return size > CHAN_FD_MAX_MSG ? 0 : size * 2;
+}
+
+// Body of the reader of chan_from_fd. The buffer holds the unparsed input
+// from start to end. Each read fills the rest of the buffer and, if there is
+// more input than that, the spill area, whose contents are then appended to
+// the grown buffer. Complete frames are cut out into messages and sent as a
+// batch once the input read so far has been parsed.
+static void* chan_fd_read(void* arg)
+{
+    chan_fd_t*     adaptor = (chan_fd_t*) arg;
+    int            fd = adaptor->fd;
+    chan_framing_t framing = adaptor->framing;
+    chan_t*        chan = adaptor->chan;
+    free(adaptor);
+
+    size_t size = CHAN_FD_READ;
+    char*  buf = (char*) malloc(size);
+    char*  spill = (char*) malloc(CHAN_FD_READ);
+    size_t start = 0;
+    size_t end = 0;
+    size_t scan = 0;
+    int    eof = 0;
+    int    failed = !buf || !spill;
+    int    stopped = 0;
+    chan_fd_msg_t* batch[CHAN_FD_BATCH];
+
+    while (!eof && !failed)
+    {
+        // Move the partial frame to the front and make sure the buffer can
+        // hold all of it.
+        if (start > 0)
+        {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            scan -= start;
+            start = 0;
+        }
+        size_t need = chan_fd_frame_size(buf, end, size, framing);
+        if (need == 0)
+        {
+            break;
+        }
+        if (need > size)
+        {
+            char* grown = (char*) realloc(buf, need);
+            if (!grown)
+            {
+                break;
+            }
+            buf = grown;
+            size = need;
+        }
+
+        struct iovec iov[2];
+        iov[0].iov_base = buf + end;
+        iov[0].iov_len = size - end;
+        iov[1].iov_base = spill;
+        iov[1].iov_len = CHAN_FD_READ;
+        ssize_t n = readv(fd, iov, 2);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (uthread_wait_fd(fd, UTHREAD_IO_READ, UTHREAD_FOREVER) < 0)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (n == 0)
+        {
+            eof = 1;
+        }
+        else if ((size_t) n > size - end)
+        {
+            size_t spilled = n - (size - end);
+            char* grown = (char*) realloc(buf, size * 2 > size + spilled ?
+                size * 2 : size + spilled);
+            if (!grown)
+            {
+                break;
+            }
+            buf = grown;
+            memcpy(buf + size, spill, spilled);
+            end = size + spilled;
+            size = size * 2 > size + spilled ? size * 2 : size + spilled;
+        }
+        else
+        {
+            end += n;
+        }
+
+        size_t count = 0;
+        for (;;)
+        {
+            chan_fd_msg_t* msg;
+            if (framing == CHAN_FRAME_LENGTH)
+            {
+                if (end - start < 4)
+                {
+                    break;
+                }
+                const unsigned char* header = (unsigned char*) buf + start;
+                size_t len = (size_t) header[0] << 24 |
+                    (size_t) header[1] << 16 | (size_t) header[2] << 8 |
+                    header[3];
+                if (len > CHAN_FD_MAX_MSG || end - start < 4 + len)
+                {
+                    break;
+                }
+                msg = chan_fd_msg_new(len);
+                if (msg)
+                {
+                    memcpy(msg->data, buf + start + 4, len);
+                }
+                start += 4 + len;
+            }
+            else
+            {
+                char* newline = (char*) memchr(buf + scan, '\n', end - scan);
+                size_t stop = newline ? (size_t) (newline - buf) : end;
+                if (!newline && !(eof && start < end))
+                {
+                    scan = end;
+                    break;
+                }
+                msg = chan_fd_msg_new(stop - start);
+                if (msg)
+                {
+                    memcpy(msg->data, buf + start, stop - start);
+                }
+                start = newline ? stop + 1 : stop;
+            }
+            scan = start;
+
+            if (!msg)
+            {
+                failed = 1;
+                break;
+            }
+            batch[count++] = msg;
+            if (count == CHAN_FD_BATCH)
+            {
+                stopped = failed = chan_fd_flush(chan, batch, count) != 0;
+                count = 0;
+                if (failed)
+                {
+                    break;
+                }
+            }
+        }
+        if (chan_fd_flush(chan, batch, count) != 0)
+        {
+            stopped = failed = 1;
+        }
+    }
+
+    // Anything short of a clean end of stream, with no partial frame left
+    // over, is an error, unless the receiver closed the channel first.
+    void* result = NULL;
+    if (!stopped && (failed || !eof || start < end))
+    {
+        result = (void*) -1;
+    }
+    free(buf);
+    free(spill);
+    chan_close(chan);
+    return result;
+}
+
+// Starts the reader of fd, stores its thread in reader and returns its
+// channel, or NULL.
+chan_t* chan_from_fd(int fd, chan_framing_t framing, uthread_t* reader)
+{
+    chan_t* chan = chan_init(CHAN_FD_BUFFER);
+    if (!chan)
+    {
+        return NULL;
+    }
+    chan_fd_t* adaptor = chan_fd_new(fd, framing, chan);
+    if (!adaptor)
+    {
+        chan_dispose(chan);
+        return NULL;
+    }
+    *reader = uthread_create(chan_fd_read, adaptor);
+    return chan;
+}
+
+// Writes the count buffers of iov to fd once, without raising SIGPIPE if the
+// reader has gone: the write fails with EPIPE instead. A socket is told so by
+// sendmsg. For anything else, such as a pipe, SIGPIPE is blocked around the
+// write and the signal it raised is taken back, leaving one that was already
+// pending alone.
+static ssize_t chan_fd_writev_once(int fd, int is_socket, struct iovec* iov,
+    int count)
+{
+    if (is_socket)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+
+    sigset_t pipe_set;
+    sigset_t saved;
+    sigset_t pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &saved);
+    sigpending(&pending);
+    int was_pending = sigismember(&pending, SIGPIPE);
+
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0 && errno == EPIPE && !was_pending)
+    {
+        struct timespec zero = {0, 0};
+        sigtimedwait(&pipe_set, NULL, &zero);
+        errno = EPIPE;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return n;
+}
+
+// Writes the count buffers of iov to fd, waiting while it is full. Returns 0,
+// or -1 on a write error.
+static int chan_fd_writev(int fd, int is_socket, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = chan_fd_writev_once(fd, is_socket, iov, count);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (uthread_wait_fd(fd, UTHREAD_IO_WRITE, UTHREAD_FOREVER) < 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip what was written, which may end inside a buffer.
+        while (count > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Body of the writer of chan_to_fd. After a write error, or a message longer
+// than CHAN_FD_MAX_MSG, it closes the channel so that senders stop, and keeps
+// receiving only to free what is left.
+static void* chan_fd_write(void* arg)
+{
+    chan_fd_t*     adaptor = (chan_fd_t*) arg;
+    int            fd = adaptor->fd;
+    chan_framing_t framing = adaptor->framing;
+    chan_t*        chan = adaptor->chan;
+    free(adaptor);
+
+    struct stat st;
+    int is_socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+
+    static char    newline = '\n';
+    chan_fd_msg_t* batch[CHAN_FD_BATCH];
+    unsigned char  headers[CHAN_FD_BATCH][4];
+    struct iovec   iov[2 * CHAN_FD_BATCH];
+    void*          result = NULL;
+    int            n;
+    while ((n = chan_recv_many(chan, batch, CHAN_FD_BATCH, 1)) > 0)
+    {
+        int count = 0;
+        int oversized = 0;
+        int i;
+        for (i = 0; i < n && !result; i++)
+        {
+            size_t len = batch[i]->len;
+            if (len > CHAN_FD_MAX_MSG)
+            {
+                // The peer would take it for a malformed frame, and from 4 GiB
+                // on its length would not even fit the header. The messages
+                // before it are still written.
+                oversized = 1;
+                break;
+            }
+            if (framing == CHAN_FRAME_LENGTH)
+            {
+                headers[i][0] = len >> 24;
+                headers[i][1] = len >> 16;
+                headers[i][2] = len >> 8;
+                headers[i][3] = len;
+                iov[count].iov_base = headers[i];
+                iov[count++].iov_len = 4;
+            }
+            iov[count].iov_base = batch[i]->data;
+            iov[count++].iov_len = len;
+            if (framing == CHAN_FRAME_LINES)
+            {
+                iov[count].iov_base = &newline;
+                iov[count++].iov_len = 1;
+            }
+        }
+        if (!result &&
+            (chan_fd_writev(fd, is_socket, iov, count) != 0 || oversized))
+        {
+            result = (void*) -1;
+            chan_close(chan);
+        }
+        for (i = 0; i < n; i++)
+        {
+            free(batch[i]);
+        }
+    }
+    return result;
+}
+
+// Starts the writer of chan to fd and returns its thread, or 0.
+uthread_t chan_to_fd(chan_t* chan, int fd, chan_framing_t framing)
+{
+    if (chan->elem_size != 0)
+    {
+        return 0;
+    }
+    chan_fd_t* adaptor = chan_fd_new(fd, framing, chan);
+    if (!adaptor)
+    {
+        return 0;
+    }
+    return uthread_create(chan_fd_write, adaptor);
+}
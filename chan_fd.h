@@ -0,0 +1,64 @@
+#ifndef __chan_fd_h__
+#define __chan_fd_h__
+
+#include <stddef.h>
+
+#include "chan.h"
+
+// How messages are delimited on a byte stream: each one followed by a newline,
+// which is not part of the message, or preceded by its length as a 4-byte
+// big-endian integer.
+typedef enum chan_framing_t
+{
+    CHAN_FRAME_LINES,
+    CHAN_FRAME_LENGTH
+} chan_framing_t;
+
+// Longest message the adaptors accept.
+#define CHAN_FD_MAX_MSG (64 << 20)
+
+// A message carried by the adaptors' channels of pointers: len bytes of data
+// in the same allocation, released with free.
+typedef struct chan_fd_msg_t
+{
+    size_t len;
+    char   data[];
+} chan_fd_msg_t;
+
+// Allocates a message with room for len bytes of data. Returns NULL if
+// allocation failed.
+chan_fd_msg_t* chan_fd_msg_new(size_t len);
+
+// Starts a uthread that reads the stream on fd, splits it into messages with
+// the given framing and sends them as chan_fd_msg_t pointers on the returned
+// channel, which the receiver frees. fd is switched to non-blocking mode, and
+// the reader waits for input with uthread_wait_fd, so it holds no processor
+// while the stream is idle. Each read takes as much as is available into a
+// buffer and a spill area with one readv, and the messages it completes are
+// sent as a batch. The channel is closed at end of stream, on a read error or
+// on a malformed frame; a final line without a newline is still delivered.
+// The reader's thread is stored in reader, and must be joined before the
+// channel is disposed of, since until then the reader may still use it; fd
+// must stay open until the join too. Closing the channel early makes the
+// reader stop at its next batch, but a reader waiting on an idle stream only
+// gets there once input or end of stream arrives, so end the stream first,
+// with shutdown for a socket or by closing the write end of a pipe. The
+// reader's result is NULL after a clean end of stream or an early close of the
+// channel. It is (void*) -1 if the stream was cut short: by a read error, a
+// malformed frame, a length-prefixed frame left partial at end of stream, or
+// a failed allocation. Returns NULL if the adaptor could not be started.
+chan_t* chan_from_fd(int fd, chan_framing_t framing, uthread_t* reader);
+
+// Starts a uthread that receives chan_fd_msg_t pointers from chan, a channel
+// of pointers, writes them to fd with the given framing and frees them. fd is
+// switched to non-blocking mode. Messages are taken in batches and written
+// with one writev per batch, waiting with uthread_wait_fd while the stream is
+// full. The writer finishes once chan is closed and drained. On a write error,
+// or at a message longer than CHAN_FD_MAX_MSG, it closes chan and frees what
+// is left in it. A reader that has gone is such an error, without a SIGPIPE
+// being raised. Join the returned thread to learn when everything was written:
+// its result is NULL, or (void*) -1 after an error. Returns 0 if the adaptor
+// could not be started.
+uthread_t chan_to_fd(chan_t* chan, int fd, chan_framing_t framing);
+
+#endif
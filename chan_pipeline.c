@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chan_pipeline.h"
+
+// Number of values a segment takes from its input channel at once.
+#define CHAN_PIPELINE_BATCH 64
+
+// Allocates and returns a new pipeline from in to out. Channels inserted
+// between segments are buffered with the given capacity, or unbuffered if it
+// is 0. Returns NULL if initialization failed.
+chan_pipeline_t* chan_pipeline_init(chan_t* in, chan_t* out, size_t buffer)
+{
+    chan_pipeline_t* pipeline = (chan_pipeline_t*) malloc(sizeof(chan_pipeline_t));
+    if (!pipeline)
+    {
+        return NULL;
+    }
+
+    memset(pipeline, 0, sizeof(chan_pipeline_t));
+    pipeline->in = in;
+    pipeline->out = out;
+    pipeline->buffer = buffer;
+    return pipeline;
+}
+
+// Releases the pipeline resources, including the channels it inserted.
+void chan_pipeline_dispose(chan_pipeline_t* pipeline)
+{
+    int i;
+    for (i = 0; i + 1 < pipeline->segment_count; i++)
+    {
+        chan_dispose(pipeline->segments[i].out);
+    }
+    free(pipeline->segments);
+    free(pipeline->threads);
+    free(pipeline->stages);
+    free(pipeline);
+}
+
+static int chan_pipeline_add(chan_pipeline_t* pipeline, chan_stage_fn fn,
+    void* ctx, int kind, int workers)
+{
+    if (pipeline->segments || workers < 1)
+    {
+        return -1;
+    }
+
+    if (pipeline->stage_count == pipeline->stage_capacity)
+    {
+        int capacity = pipeline->stage_capacity ? pipeline->stage_capacity * 2 : 8;
+        chan_stage_t* stages = (chan_stage_t*) realloc(pipeline->stages,
+            capacity * sizeof(chan_stage_t));
+        if (!stages)
+        {
+            return -1;
+        }
+        pipeline->stages = stages;
+        pipeline->stage_capacity = capacity;
+    }
+
+    chan_stage_t* stage = &pipeline->stages[pipeline->stage_count++];
+    stage->fn = fn;
+    stage->ctx = ctx;
+    stage->kind = kind;
+    stage->workers = workers;
+    return 0;
+}
+
+// Appends a stage that is fused with its neighbours.
+int chan_pipeline_add_stage(chan_pipeline_t* pipeline, chan_stage_fn fn,
+    void* ctx)
+{
+    return chan_pipeline_add(pipeline, fn, ctx, CHAN_STAGE_FUSED, 1);
+}
+
+// Appends a stage that may block, run in its own uthread.
+int chan_pipeline_add_blocking_stage(chan_pipeline_t* pipeline,
+    chan_stage_fn fn, void* ctx)
+{
+    return chan_pipeline_add(pipeline, fn, ctx, CHAN_STAGE_BLOCKING, 1);
+}
+
+// Appends a stage run by workers uthreads at once.
+int chan_pipeline_add_parallel_stage(chan_pipeline_t* pipeline,
+    chan_stage_fn fn, void* ctx, int workers)
+{
+    return chan_pipeline_add(pipeline, fn, ctx, CHAN_STAGE_PARALLEL, workers);
+}
+
+// Body of the threads of a segment. Takes a batch of values, runs each through
+// the stages of the segment, keeping the survivors in place, and sends them
+// on as a batch. The last thread of the segment to see its input closed and
+// drained closes its output. A thread that finds its output closed closes its
+// input in turn.
+static void* chan_segment_run(void* arg)
+{
+    chan_segment_t* segment = (chan_segment_t*) arg;
+    chan_stage_t* stages = segment->pipeline->stages;
+    void* values[CHAN_PIPELINE_BATCH];
+    int received;
+    while ((received = chan_recv_many(segment->in, values,
+        CHAN_PIPELINE_BATCH, 1)) > 0)
+    {
+        int kept = 0;
+        int i;
+        for (i = 0; i < received; i++)
+        {
+            void* value = values[i];
+            int s;
+            for (s = segment->first; s < segment->last; s++)
+            {
+                if (!stages[s].fn(stages[s].ctx, &value))
+                {
+                    break;
+                }
+            }
+            if (s == segment->last)
+            {
+                values[kept++] = value;
+            }
+        }
+
+        int sent = 0;
+        while (sent < kept)
+        {
+            int n = chan_send_many(segment->out, values + sent, kept - sent);
+            if (n < 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+        if (sent < kept)
+        {
+            // The output was closed under us. Close the input too, so that
+            // whatever feeds it stops instead of waiting for room forever.
+            chan_close(segment->in);
+            break;
+        }
+    }
+
+    if (__atomic_sub_fetch(&segment->running, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        chan_close(segment->out);
+    }
+    return NULL;
+}
+
+// Splits the stages into segments: each maximal run of fused stages is one
+// segment, and every blocking or parallel stage is a segment of its own.
+// Returns the number of segments, storing them in segments if it is not NULL.
+static int chan_pipeline_split(chan_pipeline_t* pipeline,
+    chan_segment_t* segments)
+{
+    int count = 0;
+    int first = 0;
+    while (first < pipeline->stage_count || count == 0)
+    {
+        int last = first + 1;
+        int workers = 1;
+        if (first < pipeline->stage_count &&
+            pipeline->stages[first].kind == CHAN_STAGE_FUSED)
+        {
+            while (last < pipeline->stage_count &&
+                pipeline->stages[last].kind == CHAN_STAGE_FUSED)
+            {
+                last++;
+            }
+        }
+        else if (first < pipeline->stage_count)
+        {
+            workers = pipeline->stages[first].workers;
+        }
+        else
+        {
+            // No stages at all: one segment that forwards values.
+            last = first;
+        }
+
+        if (segments)
+        {
+            segments[count].pipeline = pipeline;
+            segments[count].first = first;
+            segments[count].last = last;
+            segments[count].workers = workers;
+            segments[count].running = workers;
+        }
+        count++;
+        first = last;
+    }
+    return count;
+}
+
+// Creates the channels and threads of the pipeline and starts it. Returns 0 if
+// the pipeline was started or -1 if it failed.
+int chan_pipeline_start(chan_pipeline_t* pipeline)
+{
+    if (pipeline->segments)
+    {
+        return -1;
+    }
+
+    int count = chan_pipeline_split(pipeline, NULL);
+    chan_segment_t* segments = (chan_segment_t*) malloc(
+        count * sizeof(chan_segment_t));
+    if (!segments)
+    {
+        return -1;
+    }
+    chan_pipeline_split(pipeline, segments);
+
+    int threads = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        segments[i].in = i == 0 ? pipeline->in : segments[i - 1].out;
+        segments[i].out = i == count - 1 ? pipeline->out :
+            chan_init(pipeline->buffer);
+        if (!segments[i].out)
+        {
+            while (--i >= 0)
+            {
+                chan_dispose(segments[i].out);
+            }
+            free(segments);
+            return -1;
+        }
+        threads += segments[i].workers;
+    }
+
+    pipeline->threads = (uthread_t*) malloc(threads * sizeof(uthread_t));
+    if (!pipeline->threads)
+    {
+        for (i = 0; i + 1 < count; i++)
+        {
+            chan_dispose(segments[i].out);
+        }
+        free(segments);
+        return -1;
+    }
+
+    pipeline->segments = segments;
+    pipeline->segment_count = count;
+    pipeline->thread_count = 0;
+    for (i = 0; i < count; i++)
+    {
+        int w;
+        for (w = 0; w < segments[i].workers; w++)
+        {
+            pipeline->threads[pipeline->thread_count++] =
+                uthread_create(chan_segment_run, &segments[i]);
+        }
+    }
+    return 0;
+}
+
+// Waits for every thread of a started pipeline to finish.
+void chan_pipeline_join(chan_pipeline_t* pipeline)
+{
+    int i;
+    for (i = 0; i < pipeline->thread_count; i++)
+    {
+        uthread_join(pipeline->threads[i], NULL);
+    }
+    pipeline->thread_count = 0;
+}
+
+// One slot of the reorder buffer of chan_parallel_map, holding a value and
+// then its result. done is set once the result is in place.
+typedef struct chan_map_slot_t
+{
+    void*        value;
+    volatile int done;
+} chan_map_slot_t;
+
+typedef struct chan_map_t
+{
+    chan_t*          in;
+    chan_t*          jobs;
+    void*          (*fn)(void* ctx, void* value);
+    void*            ctx;
+    chan_map_slot_t* slots;
+    size_t           window;
+    uthread_sem_t    free;
+    uthread_sem_t    completed;
+    volatile size_t  total;
+    volatile int     finished;
+} chan_map_t;
+
+// Receives values in arrival order, numbers them and hands them to the
+// workers once their slot of the window is free.
+static void* chan_map_feed(void* arg)
+{
+    chan_map_t* map = (chan_map_t*) arg;
+    size_t seq = 0;
+    void* value;
+    while (chan_recv(map->in, &value) == 0)
+    {
+        uthread_sem_wait(map->free);
+        map->slots[seq % map->window].value = value;
+        chan_send(map->jobs, (void*) seq);
+        seq++;
+    }
+
+    map->total = seq;
+    __atomic_store_n(&map->finished, 1, __ATOMIC_RELEASE);
+    chan_close(map->jobs);
+    uthread_sem_signal(map->completed);
+    return NULL;
+}
+
+static void* chan_map_work(void* arg)
+{
+    chan_map_t* map = (chan_map_t*) arg;
+    void* job;
+    while (chan_recv(map->jobs, &job) == 0)
+    {
+        chan_map_slot_t* slot = &map->slots[(size_t) job % map->window];
+        slot->value = map->fn(map->ctx, slot->value);
+        __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+        uthread_sem_signal(map->completed);
+    }
+    return NULL;
+}
+
+// Maps fn over the values received from in on workers uthreads, sending the
+// results to out in arrival order. The calling thread collects the results:
+// every completion signals completed, so while the next result in order is
+// missing there is always a completion still to come to wait for.
+int chan_parallel_map(chan_t* in, chan_t* out, void* (*fn)(void* ctx,
+    void* value), void* ctx, int workers, size_t window)
+{
+    if (workers < 1 || window < 1)
+    {
+        return -1;
+    }
+
+    chan_map_t map;
+    map.in = in;
+    map.fn = fn;
+    map.ctx = ctx;
+    map.window = window;
+    map.total = 0;
+    map.finished = 0;
+    map.jobs = chan_init(window);
+    map.slots = (chan_map_slot_t*) calloc(window, sizeof(chan_map_slot_t));
+    uthread_t* threads = (uthread_t*) malloc((workers + 1) * sizeof(uthread_t));
+    if (!map.jobs || !map.slots || !threads)
+    {
+        if (map.jobs)
+        {
+            chan_dispose(map.jobs);
+        }
+        free(map.slots);
+        free(threads);
+        return -1;
+    }
+    map.free = uthread_sem_create(window);
+    map.completed = uthread_sem_create(0);
+
+    int i;
+    threads[0] = uthread_create(chan_map_feed, &map);
+    for (i = 1; i <= workers; i++)
+    {
+        threads[i] = uthread_create(chan_map_work, &map);
+    }
+
+    int result = 0;
+    size_t next = 0;
+    for (;;)
+    {
+        chan_map_slot_t* slot = &map.slots[next % window];
+        while (!__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE))
+        {
+            if (__atomic_load_n(&map.finished, __ATOMIC_ACQUIRE) &&
+                next == map.total)
+            {
+                break;
+            }
+            uthread_sem_wait(map.completed);
+        }
+        if (!slot->done)
+        {
+            break;
+        }
+
+        // Once out is closed, results are still collected, and dropped, so
+        // that the feeder and workers can run to the end of the input.
+        if (result == 0 && chan_send(out, slot->value) != 0)
+        {
+            result = -1;
+        }
+        slot->done = 0;
+        next++;
+        uthread_sem_signal(map.free);
+    }
+    chan_close(out);
+
+    for (i = 0; i <= workers; i++)
+    {
+        uthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(map.slots);
+    chan_dispose(map.jobs);
+    uthread_sem_destroy(map.free);
+    uthread_sem_destroy(map.completed);
+    return result;
+}
@@ -0,0 +1,107 @@
+#ifndef __chan_pipeline_h__
+#define __chan_pipeline_h__
+
+#include "chan.h"
+
+// A pipeline stage. It receives each value in *value and returns non-zero to
+// pass the value, possibly replaced, on to the next stage, or 0 to drop it.
+// ctx is the pointer given when the stage was added. A stage is only ever
+// called by one thread at a time unless it was added as a parallel stage, so
+// it can keep state in ctx.
+typedef int (*chan_stage_fn)(void* ctx, void** value);
+
+#define CHAN_STAGE_FUSED    0
+#define CHAN_STAGE_BLOCKING 1
+#define CHAN_STAGE_PARALLEL 2
+
+typedef struct chan_stage_t
+{
+    chan_stage_fn fn;
+    void*         ctx;
+    int           kind;
+    int           workers;
+} chan_stage_t;
+
+// A run of stages executed by the same threads, with its own input and output
+// channels.
+typedef struct chan_segment_t
+{
+    struct chan_pipeline_t* pipeline;
+    int                     first;
+    int                     last;
+    chan_t*                 in;
+    chan_t*                 out;
+    int                     workers;
+    volatile int            running;
+} chan_segment_t;
+
+// A chain of stages from an input channel to an output channel of pointers.
+// Consecutive fused stages run in a single uthread as plain function calls,
+// so a value crosses them without a channel operation or a context switch.
+// Channels, and the threads that serve them, are only put around stages that
+// may block or that run on several threads at once.
+typedef struct chan_pipeline_t
+{
+    chan_t*          in;
+    chan_t*          out;
+    size_t           buffer;
+    chan_stage_t*    stages;
+    int              stage_count;
+    int              stage_capacity;
+
+    // Set up by chan_pipeline_start.
+    chan_segment_t*  segments;
+    int              segment_count;
+    uthread_t*       threads;
+    int              thread_count;
+} chan_pipeline_t;
+
+// Allocates and returns a new pipeline from in to out. Channels inserted
+// between segments are buffered with the given capacity, or unbuffered if it
+// is 0. Returns NULL if initialization failed.
+chan_pipeline_t* chan_pipeline_init(chan_t* in, chan_t* out, size_t buffer);
+
+// Releases the pipeline resources, including the channels it inserted. The
+// pipeline must not be running.
+void chan_pipeline_dispose(chan_pipeline_t* pipeline);
+
+// Appends a stage that is fused with its neighbours: it must not block.
+// Returns 0 if the stage was added or -1 if it failed.
+int chan_pipeline_add_stage(chan_pipeline_t* pipeline, chan_stage_fn fn,
+    void* ctx);
+
+// Appends a stage that may block, for instance on a channel or a mutex. It
+// runs in its own uthread, fed and drained through channels. Returns 0 if the
+// stage was added or -1 if it failed.
+int chan_pipeline_add_blocking_stage(chan_pipeline_t* pipeline,
+    chan_stage_fn fn, void* ctx);
+
+// Appends a stage run by workers uthreads at once, which all receive from the
+// same channel and send to the same channel, so values may pass each other.
+// fn must be safe to call concurrently. Returns 0 if the stage was added or -1
+// if it failed.
+int chan_pipeline_add_parallel_stage(chan_pipeline_t* pipeline,
+    chan_stage_fn fn, void* ctx, int workers);
+
+// Creates the channels and threads of the pipeline and starts it. Once the
+// input channel is closed and drained, each segment closes its output, so the
+// pipeline closes out when it is done. If out is closed first, each segment
+// closes its input in turn, so the close reaches in and whoever sends to it
+// sees its sends fail. Returns 0 if the pipeline was started or -1 if it
+// failed.
+int chan_pipeline_start(chan_pipeline_t* pipeline);
+
+// Waits for every thread of a started pipeline to finish.
+void chan_pipeline_join(chan_pipeline_t* pipeline);
+
+// Maps fn(ctx, value) over every value received from in on workers uthreads
+// at once, and sends the results to out in the order the values arrived. A
+// result that completes early waits in a reorder buffer of window slots, so a
+// slow value holds up at most window values behind it. fn must be safe to
+// call concurrently. Returns once in has been closed and drained and every
+// result sent, closing out. Returns 0, or -1 if the map could not be started
+// or out was closed under it.
+int chan_parallel_map(chan_t* in, chan_t* out, void* (*fn)(void* ctx,
+    void* value), void* ctx, int workers, size_t window);
+
+#endif
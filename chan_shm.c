@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "chan_shm.h"
+
+// Identifies the memory of a shared channel, "chanshm1".
+#define CHAN_SHM_MAGIC 0x6368616e73686d31ULL
+
+// Number of rounds a blocked operation spins before it sleeps on the futex.
+// The first CHAN_SHM_PAUSES rounds only pause, which is enough when the peer
+// is running on another CPU. The others yield to the other uthreads of the
+// process and then to other processes, which is what lets the peer make
+// progress when the two share a CPU.
+#define CHAN_SHM_SPINS  48
+#define CHAN_SHM_PAUSES 16
+
+// Longest sleep on the futex before the operation checks the ring again and
+// lets the other uthreads of its process run.
+#define CHAN_SHM_SLEEP_NS 1000000
+
+// A slot of the ring: its sequence number as in mpmc_slot_t and the length of
+// the message that follows it.
+typedef struct chan_shm_slot_t
+{
+    volatile size_t seq;
+    size_t          len;
+} chan_shm_slot_t;
+
+// Returns the slot for position pos.
+static inline chan_shm_slot_t* chan_shm_slot(chan_shm_t* shm, size_t pos)
+{
+    return (chan_shm_slot_t*) (shm->slots + (pos & shm->ring->mask) *
+        shm->ring->stride);
+}
+
+// Maps the whole channel memory of fd and returns a handle on it, or NULL.
+static chan_shm_t* chan_shm_map(int fd, size_t size)
+{
+    chan_shm_t* shm = (chan_shm_t*) malloc(sizeof(chan_shm_t));
+    if (!shm)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        free(shm);
+        return NULL;
+    }
+
+    shm->ring = (chan_shm_ring_t*) base;
+    shm->slots = (char*) base + sizeof(chan_shm_ring_t);
+    shm->fd = fd;
+    return shm;
+}
+
+// Allocates and returns a new channel between processes for messages of up to
+// msg_size bytes, holding up to capacity messages rounded up to a power of
+// two. Sets errno and returns NULL if initialization failed.
+chan_shm_t* chan_shm_init(size_t msg_size, size_t capacity)
+{
+    if (capacity == 0 || msg_size == 0 || msg_size > SIZE_MAX / 2)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Rounding up at most doubles the capacity, and is checked first because
+    // queue_pow2 cannot round past the top bit of a size_t.
+    size_t stride = (sizeof(chan_shm_slot_t) + msg_size + sizeof(size_t) - 1)
+        / sizeof(size_t) * sizeof(size_t);
+    if (capacity > (SIZE_MAX - sizeof(chan_shm_ring_t)) / stride / 2)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t count = queue_pow2(capacity < 2 ? 2 : capacity);
+    size_t size = sizeof(chan_shm_ring_t) + count * stride;
+
+    // The descriptor is kept across exec so that a program started by the
+    // creator can map the channel with chan_shm_open.
+    int fd = memfd_create("chan_shm", 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    chan_shm_t* shm = NULL;
+    if (ftruncate(fd, size) != 0 || !(shm = chan_shm_map(fd, size)))
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    // A new memory file is zero-filled, so only the non-zero fields are set.
+    chan_shm_ring_t* ring = shm->ring;
+    ring->capacity = count;
+    ring->mask = count - 1;
+    ring->msg_size = msg_size;
+    ring->stride = stride;
+    ring->map_size = size;
+
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        chan_shm_slot(shm, i)->seq = i;
+    }
+    __atomic_store_n(&ring->magic, CHAN_SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+// Maps the channel backed by fd, a descriptor returned by chan_shm_fd in
+// another process. Sets errno and returns NULL if it failed.
+chan_shm_t* chan_shm_open(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(chan_shm_ring_t))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int copy = dup(fd);
+    if (copy < 0)
+    {
+        return NULL;
+    }
+    chan_shm_t* shm = chan_shm_map(copy, st.st_size);
+    if (!shm)
+    {
+        int error = errno;
+        close(copy);
+        errno = error;
+        return NULL;
+    }
+
+    if (__atomic_load_n(&shm->ring->magic, __ATOMIC_ACQUIRE) != CHAN_SHM_MAGIC
+        || shm->ring->map_size != (size_t) st.st_size)
+    {
+        chan_shm_dispose(shm);
+        errno = EINVAL;
+        return NULL;
+    }
+    return shm;
+}
+
+// Returns the memory file descriptor backing the channel.
+int chan_shm_fd(chan_shm_t* shm)
+{
+    return shm->fd;
+}
+
+// Unmaps the channel and closes this process's descriptor.
+void chan_shm_dispose(chan_shm_t* shm)
+{
+    munmap(shm->ring, shm->ring->map_size ? shm->ring->map_size :
+        sizeof(chan_shm_ring_t));
+    close(shm->fd);
+    free(shm);
+}
+
+static long chan_shm_futex(volatile uint32_t* futex, int op, uint32_t val,
+    const struct timespec* timeout)
+{
+    return syscall(SYS_futex, futex, op, val, timeout, NULL, 0);
+}
+
+// Wakes one sleeper of the side whose futex and waiters are given, if the
+// count shows any. The fence orders the update of the ring that made the
+// side ready before the read of the count, pairing with the increment in
+// chan_shm_sleep: either the sleeper sees the update before it sleeps, or
+// this sees the sleeper and changes the futex word under it.
+static void chan_shm_wake(volatile uint32_t* futex, volatile uint32_t* waiters,
+    int n)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0)
+    {
+        __atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+        chan_shm_futex(futex, FUTEX_WAKE, n, NULL);
+    }
+}
+
+static int chan_shm_can_send(chan_shm_t* shm)
+{
+    size_t tail = __atomic_load_n(&shm->ring->tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&chan_shm_slot(shm, tail)->seq, __ATOMIC_ACQUIRE) ==
+        tail || shm->ring->closed;
+}
+
+static int chan_shm_can_recv(chan_shm_t* shm)
+{
+    size_t head = __atomic_load_n(&shm->ring->head, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&chan_shm_slot(shm, head)->seq, __ATOMIC_ACQUIRE) ==
+        head + 1 || shm->ring->closed;
+}
+
+// Sleeps on futex until woken, or for at most CHAN_SHM_SLEEP_NS, unless the
+// side is already ready once this thread is counted in waiters.
+static void chan_shm_sleep(chan_shm_t* shm, volatile uint32_t* futex,
+    volatile uint32_t* waiters, int (*ready)(chan_shm_t*))
+{
+    uint32_t seq = __atomic_load_n(futex, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (!ready(shm))
+    {
+        struct timespec timeout = { 0, CHAN_SHM_SLEEP_NS };
+        chan_shm_futex(futex, FUTEX_WAIT, seq, &timeout);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+// Closes the channel in every process and wakes every sleeper.
+int chan_shm_close(chan_shm_t* shm)
+{
+    chan_shm_ring_t* ring = shm->ring;
+    if (__atomic_exchange_n(&ring->closed, 1, __ATOMIC_SEQ_CST))
+    {
+        return -1;
+    }
+    chan_shm_wake(&ring->r_futex, &ring->r_waiters, INT_MAX);
+    chan_shm_wake(&ring->w_futex, &ring->w_waiters, INT_MAX);
+    return 0;
+}
+
+// Non-blocking chan_shm_send.
+int chan_shm_try_send(chan_shm_t* shm, const void* msg, size_t len)
+{
+    chan_shm_ring_t* ring = shm->ring;
+    if (len > ring->msg_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    chan_shm_slot_t* slot;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = chan_shm_slot(shm, pos);
+        size_t   seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return CHAN_WOULDBLOCK;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->len = len;
+    memcpy(slot + 1, msg, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    chan_shm_wake(&ring->r_futex, &ring->r_waiters, 1);
+    return 0;
+}
+
+// Non-blocking chan_shm_recv.
+int chan_shm_try_recv(chan_shm_t* shm, void* msg, size_t* len)
+{
+    chan_shm_ring_t* ring = shm->ring;
+    chan_shm_slot_t* slot;
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = chan_shm_slot(shm, pos);
+        size_t   seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Empty, unless a sender has claimed the slot and is still
+            // copying in, in which case a closed channel is not drained yet.
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == pos)
+            {
+                return -1;
+            }
+            return CHAN_WOULDBLOCK;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (len)
+    {
+        *len = slot->len;
+    }
+    memcpy(msg, slot + 1, slot->len);
+    __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    chan_shm_wake(&ring->w_futex, &ring->w_waiters, 1);
+    return 0;
+}
+
+// One round of the spinning that precedes a sleep.
+static void chan_shm_spin(int spins)
+{
+    if (spins < CHAN_SHM_PAUSES)
+    {
+        asm volatile ("pause");
+    }
+    else
+    {
+        uthread_yield();
+        sched_yield();
+    }
+}
+
+// Sends a copy of the len bytes at msg, blocking while the channel is full.
+int chan_shm_send(chan_shm_t* shm, const void* msg, size_t len)
+{
+    int spins = 0;
+    for (;;)
+    {
+        int result = chan_shm_try_send(shm, msg, len);
+        if (result != CHAN_WOULDBLOCK)
+        {
+            return result;
+        }
+        if (spins < CHAN_SHM_SPINS)
+        {
+            chan_shm_spin(spins++);
+        }
+        else
+        {
+            chan_shm_sleep(shm, &shm->ring->w_futex, &shm->ring->w_waiters,
+                chan_shm_can_send);
+
+            // Let the other uthreads run once between sleeps.
+            spins = CHAN_SHM_SPINS - 1;
+        }
+    }
+}
+
+// Receives a message into msg, blocking while the channel is empty.
+int chan_shm_recv(chan_shm_t* shm, void* msg, size_t* len)
+{
+    int spins = 0;
+    for (;;)
+    {
+        int result = chan_shm_try_recv(shm, msg, len);
+        if (result != CHAN_WOULDBLOCK)
+        {
+            return result;
+        }
+        if (spins < CHAN_SHM_SPINS)
+        {
+            chan_shm_spin(spins++);
+        }
+        else
+        {
+            chan_shm_sleep(shm, &shm->ring->r_futex, &shm->ring->r_waiters,
+                chan_shm_can_recv);
+            spins = CHAN_SHM_SPINS - 1;
+        }
+    }
+}
+
+// Returns the number of messages in the channel.
+int chan_shm_size(chan_shm_t* shm)
+{
+    size_t head = __atomic_load_n(&shm->ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&shm->ring->tail, __ATOMIC_ACQUIRE);
+    return tail > head ? (int) (tail - head) : 0;
+}
@@ -0,0 +1,100 @@
+#ifndef __chan_shm_h__
+#define __chan_shm_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chan.h"
+
+// Header of the shared memory of a chan_shm_t, followed by the slots. Nothing
+// in it is a pointer, so every process can map it at its own address. The
+// ring is the multi-producer/multi-consumer design of mpmc_queue_t, with each
+// slot holding a sequence number, the message length and up to msg_size bytes
+// of message. A side that finds the ring full or empty spins for a while and
+// then sleeps on its futex word, after counting itself in its waiters field;
+// the other side only bumps the futex word and makes the wake-up system call
+// when that count is non-zero, so a transfer between two busy processes makes
+// no system call at all.
+typedef struct chan_shm_ring_t
+{
+    // Producer side.
+    volatile size_t   tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+    volatile uint32_t w_futex;
+    volatile uint32_t w_waiters;
+
+    // Consumer side.
+    volatile size_t   head __attribute__((aligned(QUEUE_CACHE_LINE)));
+    volatile uint32_t r_futex;
+    volatile uint32_t r_waiters;
+
+    // Read-only after initialization, apart from closed.
+    size_t            magic __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t            capacity;
+    size_t            mask;
+    size_t            msg_size;
+    size_t            stride;
+    size_t            map_size;
+    volatile int      closed;
+} chan_shm_ring_t;
+
+// One process's handle on a shared-memory channel: the mapping of the ring
+// and the memory file descriptor that backs it.
+typedef struct chan_shm_t
+{
+    chan_shm_ring_t* ring;
+    char*            slots;
+    int              fd;
+} chan_shm_t;
+
+// Allocates and returns a new channel between processes for messages of up to
+// msg_size bytes, holding up to capacity messages rounded up to a power of
+// two. The channel lives in an anonymous memory file, so a child forked
+// afterwards shares it through the inherited mapping, and any other process
+// that is handed the descriptor from chan_shm_fd, across exec or over a unix
+// socket, can map it with chan_shm_open. Each process uses its own uthread
+// runtime; a process that forks must do so before calling uthread_init.
+// Sets errno and returns NULL if initialization failed.
+chan_shm_t* chan_shm_init(size_t msg_size, size_t capacity);
+
+// Maps the channel backed by fd, a descriptor returned by chan_shm_fd in
+// another process. The handle takes its own copy of the descriptor. Sets
+// errno and returns NULL if fd is not such a channel or the mapping failed.
+chan_shm_t* chan_shm_open(int fd);
+
+// Returns the memory file descriptor backing the channel.
+int chan_shm_fd(chan_shm_t* shm);
+
+// Unmaps the channel and closes this process's descriptor. The channel is
+// released once every process has disposed of its handle or exited.
+void chan_shm_dispose(chan_shm_t* shm);
+
+// Closes the channel in every process. Messages already sent can still be
+// received, after which receives fail; sends fail at once. Blocked senders
+// and receivers in every process are woken. Returns 0 if the channel was
+// closed or -1 if it already was.
+int chan_shm_close(chan_shm_t* shm);
+
+// Sends a copy of the len bytes at msg, blocking while the channel is full.
+// A blocked sender first spins, yielding to the other uthreads of its
+// process, and then sleeps on a futex, which parks its uthread's processor
+// too; it rechecks every millisecond so that a process with a single
+// processor still runs its other uthreads. Returns 0 if the message was sent,
+// or -1 if the channel is closed or len exceeds its message size.
+int chan_shm_send(chan_shm_t* shm, const void* msg, size_t len);
+
+// Receives a message into msg, which must have room for the channel's message
+// size, and stores its length in len unless len is NULL. Blocks as
+// chan_shm_send does while the channel is empty. Returns 0 if a message was
+// received or -1 if the channel is closed and drained.
+int chan_shm_recv(chan_shm_t* shm, void* msg, size_t* len);
+
+// Non-blocking chan_shm_send and chan_shm_recv. Return 0 on success,
+// CHAN_WOULDBLOCK if the channel is full or empty, or -1 as the blocking
+// operations do.
+int chan_shm_try_send(chan_shm_t* shm, const void* msg, size_t len);
+int chan_shm_try_recv(chan_shm_t* shm, void* msg, size_t* len);
+
+// Returns the number of messages in the channel.
+int chan_shm_size(chan_shm_t* shm);
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include "uthread.h"
+#include "uthread_util.h"
+#include "coro.h"
+
+//
+// COROUTINES
+//
+// A coroutine is a body running on its own stack that hands values back to whoever resumes
+// it.  Resume and yield switch stacks directly, saving only the callee-saved registers, so
+// the ready queue, the thread state and every lock are bypassed: a coroutine runs as part of
+// the thread that resumes it, which may be a different thread each time, but only one at a
+// time.  A coroutine that blocks blocks its resumer.
+//
+// The coroutine's stack is laid out like a thread's, STACK_SIZE aligned, and the coroutine
+// itself sits at its base with the resuming thread as its first field, so uthread_self works
+// in the body, and coro_yield finds the running coroutine the same way.
+//
+
+struct coro {
+  uthread_t      thread;
+  void*          sp;
+  void*          resumer_sp;
+  void*          value;
+  int            done;
+  void*        (*body) (void*);
+  void*          arg;
+  void*          memory;
+};
+
+void        coro_switch (void** from_sp, void* to_sp);
+void        coro_start  ();
+static void coro_main   (coro_t coro);
+
+/**
+ * coro_switch
+ *    Save the callee-saved registers and the stack pointer in *from_sp and restore them from
+ *    to_sp.  It returns with an indirect jump rather than ret, which the return stack would
+ *    always mispredict, since it holds the call made on the other stack.  A new coroutine's
+ *    stack is made to look as if it had switched away into coro_start, which calls coro_main
+ *    on the coroutine, both held in restored registers.
+ */
+
+#if __APPLE__
+#define CORO_SYMBOL(name) "_" #name
+#else
+#define CORO_SYMBOL(name) #name
+#endif
+
+asm (
+     ".text\n"
+     ".globl " CORO_SYMBOL (coro_switch) "\n"
+     ".globl " CORO_SYMBOL (coro_start) "\n"
+#if __LP64__
+// IA32-64
+     CORO_SYMBOL (coro_switch) ":\n"
+     "    pushq %rbp\n"
+     "    pushq %rbx\n"
+     "    pushq %r12\n"
+     "    pushq %r13\n"
+     "    pushq %r14\n"
+     "    pushq %r15\n"
+     "    movq  %rsp, (%rdi)\n"
+     "    movq  %rsi, %rsp\n"
+     "    popq  %r15\n"
+     "    popq  %r14\n"
+     "    popq  %r13\n"
+     "    popq  %r12\n"
+     "    popq  %rbx\n"
+     "    popq  %rbp\n"
+     "    popq  %rcx\n"
+     "    jmp   *%rcx\n"
+     CORO_SYMBOL (coro_start) ":\n"
+     "    movq  %r12, %rdi\n"
+     "    call  *%r13\n"
+     "    hlt\n"
+#else
+// IA32-32
+     CORO_SYMBOL (coro_switch) ":\n"
+     "    movl  4(%esp), %eax\n"
+     "    movl  8(%esp), %edx\n"
+     "    pushl %ebp\n"
+     "    pushl %ebx\n"
+     "    pushl %esi\n"
+     "    pushl %edi\n"
+     "    movl  %esp, (%eax)\n"
+     "    movl  %edx, %esp\n"
+     "    popl  %edi\n"
+     "    popl  %esi\n"
+     "    popl  %ebx\n"
+     "    popl  %ebp\n"
+     "    popl  %ecx\n"
+     "    jmp   *%ecx\n"
+     CORO_SYMBOL (coro_start) ":\n"
+     "    pushl %ebx\n"
+     "    call  *%esi\n"
+     "    hlt\n"
+#endif
+);
+
+/**
+ * coro_main
+ *    Run the body and switch back to the resumer for the last time.
+ */
+
+static void coro_main (coro_t coro) {
+  coro->value = coro->body (coro->arg);
+  coro->done  = 1;
+  coro_switch (&coro->sp, coro->resumer_sp);
+  assert (0);
+}
+
+/**
+ * coro_self
+ *    The coroutine whose stack this is.  Only meaningful in a coroutine's body.
+ */
+
+static coro_t coro_self () {
+  int dummy_local;
+  return (coro_t) (((uintptr_t) &dummy_local) & ~(STACK_SIZE - 1));
+}
+
+/**
+ * coro_create
+ *    Create a coroutine that will run body (arg) when first resumed.
+ */
+
+coro_t coro_create (void* (*body)(void*), void* arg) {
+  void*      memory = malloc (STACK_SIZE * 2);
+  coro_t     coro;
+  uintptr_t* sp;
+
+  assert (memory);
+  coro = (coro_t) ((((uintptr_t) memory) + STACK_SIZE - 1) & ~(STACK_SIZE - 1));
+  coro->thread     = 0;
+  coro->resumer_sp = 0;
+  coro->value      = 0;
+  coro->done       = 0;
+  coro->body       = body;
+  coro->arg        = arg;
+  coro->memory     = memory;
+
+  // a frame for coro_switch to pop, jumping to coro_start with the stack 16-byte aligned
+  sp = (uintptr_t*) (((uintptr_t) coro) + STACK_SIZE);
+#if __LP64__
+  sp -= 2;
+  *--sp = (uintptr_t) coro_start;
+  *--sp = 0;                          // rbp
+  *--sp = 0;                          // rbx
+  *--sp = (uintptr_t) coro;           // r12
+  *--sp = (uintptr_t) coro_main;      // r13
+  *--sp = 0;                          // r14
+  *--sp = 0;                          // r15
+#else
+  sp -= 3;
+  *--sp = (uintptr_t) coro_start;
+  *--sp = 0;                          // ebp
+  *--sp = (uintptr_t) coro;           // ebx
+  *--sp = (uintptr_t) coro_main;      // esi
+  *--sp = 0;                          // edi
+#endif
+  coro->sp = sp;
+  return coro;
+}
+
+/**
+ * coro_resume
+ *    Run the coroutine until it yields or its body returns, storing the value it yielded or
+ *    returned in *value unless value is NULL.  Returns 1 if it yielded, 0 if it has finished,
+ *    in which case resuming it again just returns its result.
+ */
+
+int coro_resume (coro_t coro, void** value) {
+  if (! coro->done) {
+    coro->thread = uthread_self ();
+    coro_switch (&coro->resumer_sp, coro->sp);
+  }
+  if (value)
+    *value = coro->value;
+  return ! coro->done;
+}
+
+/**
+ * coro_yield
+ *    Hand value to the resumer of the running coroutine and suspend until it is resumed.
+ *    Must be called from a coroutine's body.
+ */
+
+void coro_yield (void* value) {
+  coro_t coro = coro_self ();
+
+  coro->value = value;
+  coro_switch (&coro->sp, coro->resumer_sp);
+}
+
+/**
+ * coro_is_done
+ */
+
+int coro_is_done (coro_t coro) {
+  return coro->done;
+}
+
+/**
+ * coro_destroy
+ *    Free the coroutine.  One that hasn't finished is discarded where it stands.
+ */
+
+void coro_destroy (coro_t coro) {
+  free (coro->memory);
+}
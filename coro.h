@@ -0,0 +1,13 @@
+#ifndef __coro_h__
+#define __coro_h__
+
+struct coro;
+typedef struct coro* coro_t;
+
+coro_t coro_create  (void* (*body)(void* arg), void* arg);
+int    coro_resume  (coro_t coro, void** value);
+void   coro_yield   (void* value);
+int    coro_is_done (coro_t coro);
+void   coro_destroy (coro_t coro);
+
+#endif
@@ -86,10 +86,10 @@ int main (int argc, char** argv)
   args.a.num = numprimes;
   for (i=0;i<numprimes;i++) {
 	args.a.i = i;
-	pchan[i] = chan_init(0);
+	pchan[i] = chan_init_typed(sizeof(int32_t), 0);
     primethread[i] = uthread_create ((void *)prime,args.p);
   }
-  pchan[numprimes] = chan_init(0);
+  pchan[numprimes] = chan_init_typed(sizeof(int32_t), 0);
   uthread_t stopthread = uthread_create ((void *)stop,args.p);  // needs the value of total number primes
   uthread_t genthread = uthread_create ((void *)gen,NULL);
   for (i=0;i<numprimes;i++)  uthread_join(primethread[i],0);
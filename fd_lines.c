@@ -0,0 +1,165 @@
+/*
+ * Byte streams as channels.
+ * Messages go through chan_to_fd into one end of a socketpair and come out
+ * of chan_from_fd at the other, with either framing, while many idle
+ * connections have readers parked on them that hold no processor.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "uthread.h"
+#include "chan.h"
+#include "chan_fd.h"
+
+#ifndef NUM_MESSAGES
+#define NUM_MESSAGES 200000
+#endif
+#ifndef NUM_IDLE
+#define NUM_IDLE     100
+#endif
+
+chan_t *out;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fail(const char *what) {
+    printf("%s\n", what);
+    exit(1);
+}
+
+/* message i is "message <i>" padded with dots to a length that varies */
+size_t fill(char *data, long i) {
+    size_t len = sprintf(data, "message %ld", i);
+    size_t pad = i % 50;
+    memset(data + len, '.', pad);
+    return len + pad;
+}
+
+void *produce(void *arg) {
+    char data[100];
+    long i;
+    for (i = 0; i < NUM_MESSAGES; i++) {
+        size_t len = fill(data, i);
+        chan_fd_msg_t *msg = chan_fd_msg_new(len);
+        memcpy(msg->data, data, len);
+        if (chan_send(out, msg) != 0)
+            fail("send failed");
+    }
+    chan_close(out);
+    return NULL;
+}
+
+/* sends NUM_MESSAGES through a socketpair with the given framing */
+void transfer(chan_framing_t framing, const char *name) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        fail("socketpair failed");
+    out = chan_init(128);
+    uthread_t writer = chan_to_fd(out, sv[0], framing);
+    uthread_t reader;
+    chan_t *in = chan_from_fd(sv[1], framing, &reader);
+    if (!writer || !in)
+        fail("adaptor failed");
+
+    double start = now();
+    uthread_t producer = uthread_create(produce, NULL);
+    char data[100];
+    void *value;
+    long i;
+    for (i = 0; i < NUM_MESSAGES; i++) {
+        chan_fd_msg_t *msg;
+        if (chan_recv(in, &value) != 0)
+            fail("stream ended early");
+        msg = value;
+        size_t len = fill(data, i);
+        if (msg->len != len || memcmp(msg->data, data, len) != 0)
+            fail("message garbled");
+        free(msg);
+    }
+    double elapsed = now() - start;
+
+    void *result;
+    uthread_join(producer, NULL);
+    uthread_join(writer, &result);
+    if (result)
+        fail("write failed");
+    shutdown(sv[0], SHUT_WR);
+    uthread_join(reader, &result);
+    if (result || chan_recv(in, &value) == 0)
+        fail("stream did not end cleanly");
+    chan_dispose(in);
+    chan_dispose(out);
+    close(sv[0]);
+    close(sv[1]);
+    printf("%-6s framing: %d messages, %.0f messages/s\n", name, NUM_MESSAGES,
+           NUM_MESSAGES / elapsed);
+}
+
+/* a stream whose last line has no newline still delivers that line */
+void partial_line() {
+    static const char *expected[] = {"first", "", "last without newline"};
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        fail("socketpair failed");
+    const char *text = "first\n\nlast without newline";
+    if (write(sv[0], text, strlen(text)) != (ssize_t) strlen(text))
+        fail("write failed");
+    shutdown(sv[0], SHUT_WR);
+
+    uthread_t reader;
+    chan_t *in = chan_from_fd(sv[1], CHAN_FRAME_LINES, &reader);
+    void *value;
+    int i;
+    for (i = 0; chan_recv(in, &value) == 0; i++) {
+        chan_fd_msg_t *msg = value;
+        if (i >= 3 || msg->len != strlen(expected[i]) ||
+            memcmp(msg->data, expected[i], msg->len) != 0)
+            fail("partial line garbled");
+        free(msg);
+    }
+    void *result;
+    uthread_join(reader, &result);
+    if (i != 3 || result)
+        fail("partial line lost");
+    chan_dispose(in);
+    close(sv[0]);
+    close(sv[1]);
+    printf("partial last line delivered\n");
+}
+
+int main (int argc, char** argv)
+{
+    uthread_init(1);
+
+    /* idle connections: their readers wait in uthread_wait_fd */
+    int idle[NUM_IDLE][2];
+    uthread_t idle_readers[NUM_IDLE];
+    chan_t *idle_chans[NUM_IDLE];
+    int i;
+    for (i = 0; i < NUM_IDLE; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, idle[i]) != 0)
+            fail("socketpair failed");
+        idle_chans[i] = chan_from_fd(idle[i][1], CHAN_FRAME_LINES, &idle_readers[i]);
+    }
+
+    transfer(CHAN_FRAME_LINES, "lines");
+    transfer(CHAN_FRAME_LENGTH, "length");
+    partial_line();
+
+    for (i = 0; i < NUM_IDLE; i++) {
+        shutdown(idle[i][0], SHUT_WR);
+        uthread_join(idle_readers[i], NULL);
+        chan_dispose(idle_chans[i]);
+        close(idle[i][0]);
+        close(idle[i][1]);
+    }
+    printf("%d idle connections served by one processor\n", NUM_IDLE);
+    exit(0);
+}
@@ -0,0 +1,68 @@
+/*
+ * Stopping a pipeline from its far end.
+ * A producer feeds a three-segment pipeline without end; the consumer takes
+ * what it needs and closes the output. The close must travel back through
+ * every segment to the producer, whose next send then fails.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "uthread.h"
+#include "chan.h"
+#include "chan_pipeline.h"
+
+#ifndef NUM_WANTED
+#define NUM_WANTED 1000
+#endif
+
+chan_t *in, *out;
+
+/* a stage that may block, so that each one is a segment of its own */
+int add_one(void *ctx, void **value) {
+    *value = (void *) ((intptr_t) *value + 1);
+    uthread_yield();
+    return 1;
+}
+
+void *produce(void *arg) {
+    intptr_t i = 0;
+    while (chan_send(in, (void *) i) == 0)
+        i++;
+    return (void *) i;
+}
+
+int main (int argc, char** argv)
+{
+    uthread_init(1);
+    in = chan_init(16);
+    out = chan_init(16);
+    chan_pipeline_t *pipeline = chan_pipeline_init(in, out, 16);
+    int i;
+    for (i = 0; i < 3; i++)
+        chan_pipeline_add_blocking_stage(pipeline, add_one, NULL);
+    if (chan_pipeline_start(pipeline) != 0) {
+        printf("chan_pipeline_start failed\n");
+        exit(1);
+    }
+    uthread_t producer = uthread_create(produce, NULL);
+
+    void *value;
+    for (i = 0; i < NUM_WANTED; i++) {
+        if (chan_recv(out, &value) != 0 || (intptr_t) value != i + 3) {
+            printf("value %d wrong\n", i);
+            exit(1);
+        }
+    }
+    chan_close(out);
+
+    /* both joins hang if the close does not reach the producer */
+    void *sent;
+    uthread_join(producer, &sent);
+    chan_pipeline_join(pipeline);
+    chan_pipeline_dispose(pipeline);
+    chan_dispose(in);
+    chan_dispose(out);
+    printf("stopped after %ld values sent, %d received\n", (long) (intptr_t) sent,
+           NUM_WANTED);
+    exit(0);
+}
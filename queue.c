@@ -1,6 +1,8 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "queue.h"
 
@@ -8,12 +10,12 @@
 #define ENOBUFS -1
 #define ENOMEM -1
 #define INT_MAX 1000000
-int errno;
+extern int errno;
 
 // Returns 0 if the queue is not at capacity. Returns 1 otherwise.
 static inline int queue_at_capacity(queue_t* queue)
 {
-    return queue->size >= queue->capacity;
+    return queue->tail - queue->head >= queue->capacity;
 }
 
 // Allocates and returns a new queue. The capacity specifies the maximum
@@ -28,8 +30,13 @@ queue_t* queue_init(size_t capacity)
         return NULL;
     }
 
-    queue_t* queue = (queue_t*) malloc(sizeof(queue_t));
-    void**   data  = (void**) malloc(capacity * sizeof(void*));
+    size_t   slots = queue_pow2(capacity);
+    queue_t* queue = NULL;
+    void**   data  = (void**) malloc(slots * sizeof(void*));
+    if (posix_memalign((void**) &queue, QUEUE_CACHE_LINE, sizeof(queue_t)) != 0)
+    {
+        queue = NULL;
+    }
     if (!queue || !data)
     {
         // In case of free(NULL), no operation is performed.
@@ -39,9 +46,10 @@ queue_t* queue_init(size_t capacity)
         return NULL;
     }
 
-    queue->size = 0;
-    queue->next = 0;
+    queue->head = 0;
+    queue->tail = 0;
     queue->capacity = capacity;
+    queue->mask = slots - 1;
     queue->data = data;
     return queue;
 }
@@ -63,15 +71,7 @@ int queue_add(queue_t* queue, void* value)
         return -1;
     }
 
-    int pos = queue->next + queue->size;
-    if (pos >= queue->capacity)
-    {
-       pos -= queue->capacity;
-    }
-
-    queue->data[pos] = value;
-
-    queue->size++;
+    queue->data[queue->tail++ & queue->mask] = value;
     return 0;
 }
 
@@ -81,15 +81,9 @@ void* queue_remove(queue_t* queue)
 {
     void* value = NULL;
 
-    if (queue->size > 0)
+    if (queue->tail != queue->head)
     {
-        value = queue->data[queue->next];
-        queue->next++;
-        queue->size--;
-        if (queue->next >= queue->capacity)
-        {
-            queue->next -= queue->capacity;
-        }
+        value = queue->data[queue->head++ & queue->mask];
     }
 
     return value;
@@ -99,5 +93,710 @@ void* queue_remove(queue_t* queue)
 // queue is empty.
 void* queue_peek(queue_t* queue)
 {
-    return queue->size ? queue->data[queue->next] : NULL;
+    return queue->tail != queue->head ? queue->data[queue->head & queue->mask] :
+        NULL;
+}
+
+// Returns the smallest power of two that is at least n.
+size_t queue_pow2(size_t n)
+{
+    size_t pow2 = 1;
+    while (pow2 < n)
+    {
+        pow2 <<= 1;
+    }
+    return pow2;
+}
+
+// Allocates and returns a new single-producer/single-consumer queue that holds
+// at most capacity elements of elem_size bytes. Returns NULL if initialization
+// failed.
+spsc_queue_t* spsc_queue_init(size_t capacity, size_t elem_size)
+{
+    if (capacity == 0 || elem_size == 0 || capacity > INT_MAX / elem_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t        slots = queue_pow2(capacity);
+    spsc_queue_t* queue = NULL;
+    char*         data  = (char*) malloc(slots * elem_size);
+    if (posix_memalign((void**) &queue, QUEUE_CACHE_LINE, sizeof(spsc_queue_t)) != 0)
+    {
+        queue = NULL;
+    }
+    if (!queue || !data)
+    {
+        free(queue);
+        free(data);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue->head = 0;
+    queue->tail_cache = 0;
+    queue->tail = 0;
+    queue->head_cache = 0;
+    queue->capacity = capacity;
+    queue->mask = slots - 1;
+    queue->elem_size = elem_size;
+    queue->data = data;
+    return queue;
+}
+
+// Releases the queue resources.
+void spsc_queue_dispose(spsc_queue_t* queue)
+{
+    free(queue->data);
+    free(queue);
+}
+
+// Enqueues a copy of the element at elem. Must only be called by the
+// producer. Returns 0 if the add succeeded or -1 if the queue is full.
+int spsc_queue_add(spsc_queue_t* queue, const void* elem)
+{
+    size_t tail = queue->tail;
+    if (tail - queue->head_cache >= queue->capacity)
+    {
+        queue->head_cache = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (tail - queue->head_cache >= queue->capacity)
+        {
+            return -1;
+        }
+    }
+
+    memcpy(queue->data + (tail & queue->mask) * queue->elem_size, elem,
+        queue->elem_size);
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Dequeues an element and copies it to elem, unless elem is NULL. Must only be
+// called by the consumer. Returns 0 if an element was removed or -1 if the
+// queue is empty.
+int spsc_queue_remove(spsc_queue_t* queue, void* elem)
+{
+    size_t head = queue->head;
+    if (head == queue->tail_cache)
+    {
+        queue->tail_cache = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (head == queue->tail_cache)
+        {
+            return -1;
+        }
+    }
+
+    if (elem)
+    {
+        memcpy(elem, queue->data + (head & queue->mask) * queue->elem_size,
+            queue->elem_size);
+    }
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Enqueues copies of up to n consecutive elements from elems, publishing them
+// with a single index update. Must only be called by the producer. Returns the
+// number of elements added, which is 0 if the queue is full.
+size_t spsc_queue_add_many(spsc_queue_t* queue, const void* elems, size_t n)
+{
+    size_t tail = queue->tail;
+    size_t room = queue->capacity - (tail - queue->head_cache);
+    if (room < n)
+    {
+        queue->head_cache = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        room = queue->capacity - (tail - queue->head_cache);
+    }
+    if (n > room)
+    {
+        n = room;
+    }
+
+    // Copy in at most two runs, splitting where the ring wraps.
+    size_t first = (queue->mask + 1) - (tail & queue->mask);
+    if (first > n)
+    {
+        first = n;
+    }
+    memcpy(queue->data + (tail & queue->mask) * queue->elem_size, elems,
+        first * queue->elem_size);
+    memcpy(queue->data, (const char*) elems + first * queue->elem_size,
+        (n - first) * queue->elem_size);
+    __atomic_store_n(&queue->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Dequeues up to n elements into consecutive elements of elems, unless elems
+// is NULL, with a single index update. Must only be called by the consumer.
+// Returns the number of elements removed, which is 0 if the queue is empty.
+size_t spsc_queue_remove_many(spsc_queue_t* queue, void* elems, size_t n)
+{
+    size_t head = queue->head;
+    if (queue->tail_cache - head < n)
+    {
+        queue->tail_cache = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    }
+    if (n > queue->tail_cache - head)
+    {
+        n = queue->tail_cache - head;
+    }
+
+    if (elems)
+    {
+        size_t first = (queue->mask + 1) - (head & queue->mask);
+        if (first > n)
+        {
+            first = n;
+        }
+        memcpy(elems, queue->data + (head & queue->mask) * queue->elem_size,
+            first * queue->elem_size);
+        memcpy((char*) elems + first * queue->elem_size, queue->data,
+            (n - first) * queue->elem_size);
+    }
+    __atomic_store_n(&queue->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Returns the number of items in the queue. The result is exact only when
+// called by the producer or the consumer while the other side is idle.
+size_t spsc_queue_size(spsc_queue_t* queue)
+{
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
+
+// Returns the slot for position pos.
+static inline mpmc_slot_t* mpmc_slot(mpmc_queue_t* queue, size_t pos)
+{
+    return (mpmc_slot_t*) (queue->slots + (pos & queue->mask) * queue->stride);
+}
+
+// Allocates and returns a new multi-producer/multi-consumer queue that holds
+// at most capacity elements of elem_size bytes. Returns NULL if initialization
+// failed.
+mpmc_queue_t* mpmc_queue_init(size_t capacity, size_t elem_size)
+{
+    // Each slot is its sequence number followed by the element, padded so
+    // the next sequence number stays aligned.
+    size_t stride = (sizeof(mpmc_slot_t) + elem_size + sizeof(mpmc_slot_t) - 1)
+        / sizeof(mpmc_slot_t) * sizeof(mpmc_slot_t);
+    // The limit is on the elements, as for queue_init, not on the slots.
+    if (capacity == 0 || elem_size == 0 || capacity > INT_MAX / elem_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // A ring of one slot would let a producer reuse the slot while the
+    // consumer that claimed it is still copying out, so use at least two.
+    size_t        count = queue_pow2(capacity < 2 ? 2 : capacity);
+    mpmc_queue_t* queue = NULL;
+    char*         slots = (char*) malloc(count * stride);
+    if (posix_memalign((void**) &queue, QUEUE_CACHE_LINE, sizeof(mpmc_queue_t)) != 0)
+    {
+        queue = NULL;
+    }
+    if (!queue || !slots)
+    {
+        free(queue);
+        free(slots);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue->tail = 0;
+    queue->head = 0;
+    queue->capacity = capacity;
+    queue->mask = count - 1;
+    queue->elem_size = elem_size;
+    queue->stride = stride;
+    queue->slots = slots;
+
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        mpmc_slot(queue, i)->seq = i;
+    }
+    return queue;
+}
+
+// Releases the queue resources.
+void mpmc_queue_dispose(mpmc_queue_t* queue)
+{
+    free(queue->slots);
+    free(queue);
+}
+
+// Enqueues a copy of the element at elem. Returns 0 if the add succeeded or -1
+// if the queue is full.
+int mpmc_queue_add(mpmc_queue_t* queue, const void* elem)
+{
+    mpmc_slot_t* slot;
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = mpmc_slot(queue, pos);
+        size_t   seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0)
+        {
+            // The slot is free, but the ring may be larger than the capacity.
+            if (pos - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) >= queue->capacity)
+            {
+                return -1;
+            }
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // The slot still holds the item from the previous lap.
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(slot + 1, elem, queue->elem_size);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Dequeues an element and copies it to elem, unless elem is NULL. Returns 0 if
+// an element was removed or -1 if the queue is empty.
+int mpmc_queue_remove(mpmc_queue_t* queue, void* elem)
+{
+    mpmc_slot_t* slot;
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = mpmc_slot(queue, pos);
+        size_t   seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (elem)
+    {
+        memcpy(elem, slot + 1, queue->elem_size);
+    }
+    __atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Enqueues copies of up to n consecutive elements from elems. The run of free
+// slots is claimed with a single compare-and-swap. Returns the number of
+// elements added, which is 0 if the queue is full.
+size_t mpmc_queue_add_many(mpmc_queue_t* queue, const void* elems, size_t n)
+{
+    size_t count;
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        size_t   seq  = __atomic_load_n(&mpmc_slot(queue, pos)->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff < 0 || n == 0)
+        {
+            return 0;
+        }
+        if (diff > 0)
+        {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        size_t used = pos - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (used >= queue->capacity)
+        {
+            return 0;
+        }
+
+        // Extend the claim over the following slots that are free as well.
+        count = queue->capacity - used < n ? queue->capacity - used : n;
+        size_t i;
+        for (i = 1; i < count; i++)
+        {
+            if (__atomic_load_n(&mpmc_slot(queue, pos + i)->seq, __ATOMIC_ACQUIRE)
+                != pos + i)
+            {
+                break;
+            }
+        }
+        count = i;
+
+        if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + count, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    // Publish in order, so consumers see a prefix of the run at any time.
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        mpmc_slot_t* slot = mpmc_slot(queue, pos + i);
+        memcpy(slot + 1, (const char*) elems + i * queue->elem_size,
+            queue->elem_size);
+        __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+// Dequeues up to n elements into consecutive elements of elems, unless elems
+// is NULL. The run of published items is claimed with a single
+// compare-and-swap. Returns the number of elements removed, which is 0 if the
+// queue is empty.
+size_t mpmc_queue_remove_many(mpmc_queue_t* queue, void* elems, size_t n)
+{
+    size_t count;
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        size_t   seq  = __atomic_load_n(&mpmc_slot(queue, pos)->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff < 0 || n == 0)
+        {
+            return 0;
+        }
+        if (diff > 0)
+        {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Extend the claim over the following items that are published too.
+        size_t i;
+        for (i = 1; i < n; i++)
+        {
+            if (__atomic_load_n(&mpmc_slot(queue, pos + i)->seq, __ATOMIC_ACQUIRE)
+                != pos + i + 1)
+            {
+                break;
+            }
+        }
+        count = i;
+
+        if (__atomic_compare_exchange_n(&queue->head, &pos, pos + count, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        mpmc_slot_t* slot = mpmc_slot(queue, pos + i);
+        if (elems)
+        {
+            memcpy((char*) elems + i * queue->elem_size, slot + 1,
+                queue->elem_size);
+        }
+        __atomic_store_n(&slot->seq, pos + i + queue->mask + 1, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+// Returns 1 if the item at the head of the queue has been published or has
+// already been taken by another consumer, i.e. if mpmc_queue_remove is worth
+// retrying. Returns 0 otherwise.
+int mpmc_queue_can_remove(mpmc_queue_t* queue)
+{
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t seq = __atomic_load_n(&mpmc_slot(queue, pos)->seq, __ATOMIC_ACQUIRE);
+    return (intptr_t) seq - (intptr_t) (pos + 1) >= 0;
+}
+
+// Returns 1 if the queue has room for another item, 0 otherwise.
+int mpmc_queue_can_add(mpmc_queue_t* queue)
+{
+    return mpmc_queue_size(queue) < queue->capacity;
+}
+
+// Returns the approximate number of items in the queue.
+size_t mpmc_queue_size(mpmc_queue_t* queue)
+{
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return tail > head ? tail - head : 0;
+}
+
+// Bytes of elements in a segment when seg_queue_init picks the size, and the
+// number of drained segments kept for reuse.
+#define SEG_QUEUE_BYTES  4096
+#define SEG_QUEUE_SPARES 4
+
+// Spins until lock is taken. The critical sections of a seg_queue_t never
+// block, so a holder always finishes promptly.
+static void seg_queue_lock(volatile int* lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        {
+            asm volatile ("pause");
+        }
+    }
+}
+
+static void seg_queue_unlock(volatile int* lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline char* seg_queue_elem(seg_queue_t* queue, seg_queue_seg_t* seg,
+    size_t index)
+{
+    return (char*) (seg + 1) + index * queue->elem_size;
+}
+
+// Returns a spare segment, or a new one if there is none, or NULL if
+// allocation failed.
+static seg_queue_seg_t* seg_queue_seg_get(seg_queue_t* queue)
+{
+    seg_queue_lock(&queue->spare_lock);
+    seg_queue_seg_t* seg = queue->spares;
+    if (seg)
+    {
+        queue->spares = seg->next;
+        queue->spare_count--;
+    }
+    seg_queue_unlock(&queue->spare_lock);
+
+    if (!seg)
+    {
+        seg = (seg_queue_seg_t*) malloc(sizeof(seg_queue_seg_t) +
+            queue->seg_size * queue->elem_size);
+    }
+    if (seg)
+    {
+        seg->next = NULL;
+    }
+    return seg;
+}
+
+// Keeps a drained segment for reuse, or frees it if there are enough spares.
+static void seg_queue_seg_put(seg_queue_t* queue, seg_queue_seg_t* seg)
+{
+    seg_queue_lock(&queue->spare_lock);
+    if (queue->spare_count < SEG_QUEUE_SPARES)
+    {
+        seg->next = queue->spares;
+        queue->spares = seg;
+        queue->spare_count++;
+        seg = NULL;
+    }
+    seg_queue_unlock(&queue->spare_lock);
+    free(seg);
+}
+
+// Allocates and returns a new unbounded queue of elements of elem_size bytes,
+// allocated seg_size elements at a time. A seg_size of 0 picks segments of
+// about a page. Returns NULL if initialization failed.
+seg_queue_t* seg_queue_init(size_t elem_size, size_t seg_size)
+{
+    if (seg_size == 0)
+    {
+        seg_size = elem_size < SEG_QUEUE_BYTES / 8 ?
+            SEG_QUEUE_BYTES / elem_size : 8;
+    }
+    if (elem_size == 0 || seg_size > INT_MAX / elem_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    seg_queue_t* queue = NULL;
+    if (posix_memalign((void**) &queue, QUEUE_CACHE_LINE, sizeof(seg_queue_t)) != 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(queue, 0, sizeof(seg_queue_t));
+    queue->elem_size = elem_size;
+    queue->seg_size = seg_size;
+    queue->high = SIZE_MAX;
+
+    seg_queue_seg_t* seg = seg_queue_seg_get(queue);
+    if (!seg)
+    {
+        free(queue);
+        errno = ENOMEM;
+        return NULL;
+    }
+    queue->head_seg = seg;
+    queue->tail_seg = seg;
+    return queue;
+}
+
+// Releases the queue resources.
+void seg_queue_dispose(seg_queue_t* queue)
+{
+    seg_queue_seg_t* seg = queue->head_seg;
+    while (seg)
+    {
+        seg_queue_seg_t* next = seg->next;
+        free(seg);
+        seg = next;
+    }
+    seg = queue->spares;
+    while (seg)
+    {
+        seg_queue_seg_t* next = seg->next;
+        free(seg);
+        seg = next;
+    }
+    free(queue);
+}
+
+// Arranges for on_high(arg, size) to be called by the producer whose add takes
+// the queue from below high elements to high or more.
+void seg_queue_set_watermark(seg_queue_t* queue, size_t high,
+    void (*on_high)(void* arg, size_t size), void* arg)
+{
+    seg_queue_lock(&queue->tail_lock);
+    queue->high = high;
+    queue->on_high = on_high;
+    queue->on_high_arg = arg;
+    seg_queue_unlock(&queue->tail_lock);
+}
+
+// Enqueues a copy of the element at elem. Returns 0 if the add succeeded or -1
+// if a segment could not be allocated.
+int seg_queue_add(seg_queue_t* queue, const void* elem)
+{
+    return seg_queue_add_many(queue, elem, 1) == 1 ? 0 : -1;
+}
+
+// Dequeues an element and copies it to elem, unless elem is NULL. Returns 0 if
+// an element was removed or -1 if the queue is empty.
+int seg_queue_remove(seg_queue_t* queue, void* elem)
+{
+    return seg_queue_remove_many(queue, elem, 1) == 1 ? 0 : -1;
+}
+
+// Enqueues copies of up to n consecutive elements from elems. The elements
+// are written in runs, one per segment, and published to consumers with a
+// single update of count, after any new segment has been linked.
+size_t seg_queue_add_many(seg_queue_t* queue, const void* elems, size_t n)
+{
+    size_t added = 0;
+    seg_queue_lock(&queue->tail_lock);
+    while (added < n)
+    {
+        if (queue->tail_index == queue->seg_size)
+        {
+            seg_queue_seg_t* seg = seg_queue_seg_get(queue);
+            if (!seg)
+            {
+                errno = ENOMEM;
+                break;
+            }
+            queue->tail_seg->next = seg;
+            queue->tail_seg = seg;
+            queue->tail_index = 0;
+        }
+
+        size_t run = queue->seg_size - queue->tail_index;
+        if (run > n - added)
+        {
+            run = n - added;
+        }
+        memcpy(seg_queue_elem(queue, queue->tail_seg, queue->tail_index),
+            (const char*) elems + added * queue->elem_size,
+            run * queue->elem_size);
+        queue->tail_index += run;
+        added += run;
+    }
+
+    size_t old = __atomic_fetch_add(&queue->count, added, __ATOMIC_RELEASE);
+    size_t high = queue->high;
+    void (*on_high)(void*, size_t) = queue->on_high;
+    void* arg = queue->on_high_arg;
+    seg_queue_unlock(&queue->tail_lock);
+
+    if (on_high && old < high && old + added >= high)
+    {
+        on_high(arg, old + added);
+    }
+    return added;
+}
+
+// Dequeues up to n elements into consecutive elements of elems, unless elems
+// is NULL. Only consumers decrease count, so the count read under the head
+// lock is a number of elements this consumer can take.
+size_t seg_queue_remove_many(seg_queue_t* queue, void* elems, size_t n)
+{
+    if (__atomic_load_n(&queue->count, __ATOMIC_ACQUIRE) == 0)
+    {
+        return 0;
+    }
+
+    seg_queue_lock(&queue->head_lock);
+    size_t available = __atomic_load_n(&queue->count, __ATOMIC_ACQUIRE);
+    if (n > available)
+    {
+        n = available;
+    }
+
+    size_t removed = 0;
+    while (removed < n)
+    {
+        if (queue->head_index == queue->seg_size)
+        {
+            // The producer linked the next segment before publishing anything
+            // in it, and has moved on from this one.
+            seg_queue_seg_t* seg = queue->head_seg;
+            queue->head_seg = seg->next;
+            queue->head_index = 0;
+            seg_queue_seg_put(queue, seg);
+        }
+
+        size_t run = queue->seg_size - queue->head_index;
+        if (run > n - removed)
+        {
+            run = n - removed;
+        }
+        if (elems)
+        {
+            memcpy((char*) elems + removed * queue->elem_size,
+                seg_queue_elem(queue, queue->head_seg, queue->head_index),
+                run * queue->elem_size);
+        }
+        queue->head_index += run;
+        removed += run;
+    }
+
+    __atomic_sub_fetch(&queue->count, removed, __ATOMIC_RELEASE);
+    seg_queue_unlock(&queue->head_lock);
+    return removed;
+}
+
+// Returns the number of items in the queue.
+size_t seg_queue_size(seg_queue_t* queue)
+{
+    return __atomic_load_n(&queue->count, __ATOMIC_ACQUIRE);
 }
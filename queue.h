@@ -2,12 +2,24 @@
 #define queue_h
 
 
-// Defines a circular buffer which acts as a FIFO queue.
+#define QUEUE_CACHE_LINE 64
+
+// Defines a circular buffer which acts as a FIFO queue. The buffer has a
+// power-of-two number of slots, so positions wrap with a mask, and head and
+// tail are free-running counts whose difference is the size. The consumer
+// index and the producer index live on separate cache lines from each other
+// and from the read-only fields.
 typedef struct queue_t
 {
-    int    size;
-    int    next;
-    int    capacity;
+    // Consumer index.
+    size_t head __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // Producer index.
+    size_t tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // Read-only after initialization.
+    size_t capacity __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t mask;
     void** data;
 } queue_t;
 
@@ -32,4 +44,200 @@ void* queue_remove(queue_t* queue);
 // queue is empty.
 void* queue_peek(queue_t*);
 
+// Returns the smallest power of two that is at least n.
+size_t queue_pow2(size_t n);
+
+// Defines a lock-free circular buffer for exactly one producer and one
+// consumer. Items are fixed-size elements stored inline and copied in and out
+// by value. The consumer index and the producer index live on separate cache
+// lines, and each side keeps a private copy of the other side's index so it
+// only touches the shared line when the buffer looks full or empty.
+typedef struct spsc_queue_t
+{
+    // Consumer side.
+    volatile size_t head __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t          tail_cache;
+
+    // Producer side.
+    volatile size_t tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t          head_cache;
+
+    // Read-only after initialization.
+    size_t          capacity __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t          mask;
+    size_t          elem_size;
+    char*           data;
+} spsc_queue_t;
+
+// Allocates and returns a new single-producer/single-consumer queue that holds
+// at most capacity elements of elem_size bytes. Returns NULL if initialization
+// failed.
+spsc_queue_t* spsc_queue_init(size_t capacity, size_t elem_size);
+
+// Releases the queue resources.
+void spsc_queue_dispose(spsc_queue_t* queue);
+
+// Enqueues a copy of the element at elem. Must only be called by the
+// producer. Returns 0 if the add succeeded or -1 if the queue is full.
+int spsc_queue_add(spsc_queue_t* queue, const void* elem);
+
+// Dequeues an element and copies it to elem, unless elem is NULL. Must only be
+// called by the consumer. Returns 0 if an element was removed or -1 if the
+// queue is empty.
+int spsc_queue_remove(spsc_queue_t* queue, void* elem);
+
+// Enqueues copies of up to n consecutive elements from elems, publishing them
+// with a single index update. Must only be called by the producer. Returns the
+// number of elements added, which is 0 if the queue is full.
+size_t spsc_queue_add_many(spsc_queue_t* queue, const void* elems, size_t n);
+
+// Dequeues up to n elements into consecutive elements of elems, unless elems
+// is NULL, with a single index update. Must only be called by the consumer.
+// Returns the number of elements removed, which is 0 if the queue is empty.
+size_t spsc_queue_remove_many(spsc_queue_t* queue, void* elems, size_t n);
+
+// Returns the number of items in the queue. The result is exact only when
+// called by the producer or the consumer while the other side is idle.
+size_t spsc_queue_size(spsc_queue_t* queue);
+
+// Defines a lock-free bounded circular buffer for any number of producers and
+// consumers (D. Vyukov's design). Each slot carries a sequence number that
+// tells a producer whether the slot is free for position pos (seq == pos) and
+// a consumer whether it holds the item for position pos (seq == pos + 1), so
+// producers and consumers only contend on their own index. Elements are
+// stored inline after the sequence number of their slot.
+typedef struct mpmc_slot_t
+{
+    volatile size_t seq;
+} mpmc_slot_t;
+
+typedef struct mpmc_queue_t
+{
+    // Producer index.
+    volatile size_t tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // Consumer index.
+    volatile size_t head __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // Read-only after initialization.
+    size_t          capacity __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t          mask;
+    size_t          elem_size;
+    size_t          stride;
+    char*           slots;
+} mpmc_queue_t;
+
+// Allocates and returns a new multi-producer/multi-consumer queue that holds
+// at most capacity elements of elem_size bytes. Returns NULL if initialization
+// failed.
+mpmc_queue_t* mpmc_queue_init(size_t capacity, size_t elem_size);
+
+// Releases the queue resources.
+void mpmc_queue_dispose(mpmc_queue_t* queue);
+
+// Enqueues a copy of the element at elem. Returns 0 if the add succeeded or -1
+// if the queue is full.
+int mpmc_queue_add(mpmc_queue_t* queue, const void* elem);
+
+// Dequeues an element and copies it to elem, unless elem is NULL. Returns 0 if
+// an element was removed or -1 if the queue is empty.
+int mpmc_queue_remove(mpmc_queue_t* queue, void* elem);
+
+// Enqueues copies of up to n consecutive elements from elems. The run of free
+// slots is claimed with a single compare-and-swap. Returns the number of
+// elements added, which is 0 if the queue is full.
+size_t mpmc_queue_add_many(mpmc_queue_t* queue, const void* elems, size_t n);
+
+// Dequeues up to n elements into consecutive elements of elems, unless elems
+// is NULL. The run of published items is claimed with a single
+// compare-and-swap. Returns the number of elements removed, which is 0 if the
+// queue is empty.
+size_t mpmc_queue_remove_many(mpmc_queue_t* queue, void* elems, size_t n);
+
+// Returns 1 if the item at the head of the queue has been published or has
+// already been taken by another consumer, i.e. if mpmc_queue_remove is worth
+// retrying. Returns 0 otherwise.
+int mpmc_queue_can_remove(mpmc_queue_t* queue);
+
+// Returns 1 if the queue has room for another item, 0 otherwise.
+int mpmc_queue_can_add(mpmc_queue_t* queue);
+
+// Returns the approximate number of items in the queue.
+size_t mpmc_queue_size(mpmc_queue_t* queue);
+
+// A segment of a seg_queue_t. Its elements follow it in memory.
+typedef struct seg_queue_seg_t
+{
+    struct seg_queue_seg_t* next;
+} seg_queue_seg_t;
+
+// Defines an unbounded multi-producer/multi-consumer queue of fixed-size
+// elements, stored inline in a linked list of fixed-size segments. Producers
+// serialize on the tail lock and consumers on the head lock, so the two sides
+// only share count, the number of published elements. A drained segment goes
+// to a short spare list for reuse and is freed beyond that, so memory stays
+// proportional to the number of queued elements.
+typedef struct seg_queue_t
+{
+    // Consumer side.
+    volatile int     head_lock __attribute__((aligned(QUEUE_CACHE_LINE)));
+    seg_queue_seg_t* head_seg;
+    size_t           head_index;
+
+    // Producer side.
+    volatile int     tail_lock __attribute__((aligned(QUEUE_CACHE_LINE)));
+    seg_queue_seg_t* tail_seg;
+    size_t           tail_index;
+
+    volatile size_t  count __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+    // Drained segments kept for reuse.
+    volatile int     spare_lock;
+    seg_queue_seg_t* spares;
+    size_t           spare_count;
+
+    // Read-only after initialization, apart from the watermark.
+    size_t           elem_size __attribute__((aligned(QUEUE_CACHE_LINE)));
+    size_t           seg_size;
+    size_t           high;
+    void           (*on_high)(void* arg, size_t size);
+    void*            on_high_arg;
+} seg_queue_t;
+
+// Allocates and returns a new unbounded queue of elements of elem_size bytes,
+// allocated seg_size elements at a time. A seg_size of 0 picks segments of
+// about a page. Returns NULL if initialization failed.
+seg_queue_t* seg_queue_init(size_t elem_size, size_t seg_size);
+
+// Releases the queue resources.
+void seg_queue_dispose(seg_queue_t* queue);
+
+// Arranges for on_high(arg, size) to be called by the producer whose add takes
+// the queue from below high elements to high or more. The watermark is soft:
+// adds never fail because of it, and the callback fires again only after the
+// queue has dropped below high.
+void seg_queue_set_watermark(seg_queue_t* queue, size_t high,
+    void (*on_high)(void* arg, size_t size), void* arg);
+
+// Enqueues a copy of the element at elem. Returns 0 if the add succeeded or -1
+// if a segment could not be allocated.
+int seg_queue_add(seg_queue_t* queue, const void* elem);
+
+// Dequeues an element and copies it to elem, unless elem is NULL. Returns 0 if
+// an element was removed or -1 if the queue is empty.
+int seg_queue_remove(seg_queue_t* queue, void* elem);
+
+// Enqueues copies of up to n consecutive elements from elems. Returns the
+// number of elements added, which is less than n only if a segment could not
+// be allocated.
+size_t seg_queue_add_many(seg_queue_t* queue, const void* elems, size_t n);
+
+// Dequeues up to n elements into consecutive elements of elems, unless elems
+// is NULL. Returns the number of elements removed, which is 0 if the queue is
+// empty.
+size_t seg_queue_remove_many(seg_queue_t* queue, void* elems, size_t n);
+
+// Returns the number of items in the queue.
+size_t seg_queue_size(seg_queue_t* queue);
+
 #endif
@@ -0,0 +1,107 @@
+/*
+ * Ping-pong between two processes over shared-memory channels.
+ * The channels are made before fork(), so the child shares them through
+ * the inherited mapping; each process then starts its own uthreads.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "uthread.h"
+#include "chan_shm.h"
+
+#ifndef NUM_ITERATIONS
+#define NUM_ITERATIONS 100000
+#endif
+#define MSG_SIZE 64
+
+chan_shm_t *ping, *pong;
+
+/* child: echo every message back until the ping channel is closed */
+void *echo(void *arg) {
+    char msg[MSG_SIZE];
+    size_t len;
+    long n = 0;
+    while (chan_shm_recv(ping, msg, &len) == 0) {
+        if (chan_shm_send(pong, msg, len) != 0) {
+            printf("child: send failed\n");
+            exit(1);
+        }
+        n++;
+    }
+    chan_shm_close(pong);
+    return (void *) n;
+}
+
+/* parent: send numbered messages and check that each comes back intact */
+void *serve(void *arg) {
+    char msg[MSG_SIZE], reply[MSG_SIZE];
+    size_t len;
+    long i;
+    for (i = 0; i < NUM_ITERATIONS; i++) {
+        int n = snprintf(msg, sizeof(msg), "ping %ld", i);
+        if (chan_shm_send(ping, msg, n + 1) != 0 ||
+            chan_shm_recv(pong, reply, &len) != 0) {
+            printf("parent: transfer %ld failed\n", i);
+            exit(1);
+        }
+        if (len != (size_t) n + 1 || strcmp(msg, reply) != 0) {
+            printf("parent: sent \"%s\", got \"%s\"\n", msg, reply);
+            exit(1);
+        }
+    }
+    chan_shm_close(ping);
+
+    /* the child closes pong once it has seen the close */
+    if (chan_shm_recv(pong, reply, &len) != -1) {
+        printf("parent: pong still open\n");
+        exit(1);
+    }
+    return NULL;
+}
+
+int main (int argc, char** argv)
+{
+    /* a capacity that cannot be rounded up to a power of two is refused */
+    if (chan_shm_init(MSG_SIZE, SIZE_MAX) != NULL ||
+        chan_shm_init(MSG_SIZE, ((size_t) 1 << 63) + 1) != NULL) {
+        printf("oversized channel accepted\n");
+        exit(1);
+    }
+
+    ping = chan_shm_init(MSG_SIZE, 16);
+    pong = chan_shm_init(MSG_SIZE, 16);
+    if (!ping || !pong) {
+        printf("chan_shm_init failed\n");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("fork failed\n");
+        exit(1);
+    }
+
+    uthread_init(1);
+    if (pid == 0) {
+        void *n;
+        uthread_join(uthread_create(echo, NULL), &n);
+        chan_shm_dispose(ping);
+        chan_shm_dispose(pong);
+        exit((long) n == NUM_ITERATIONS ? 0 : 1);
+    }
+
+    uthread_join(uthread_create(serve, NULL), 0);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        printf("child failed\n");
+        exit(1);
+    }
+    chan_shm_dispose(ping);
+    chan_shm_dispose(pong);
+    printf("%d round trips ok\n", NUM_ITERATIONS);
+    exit(0);
+}
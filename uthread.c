@@ -37,10 +37,18 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #if PTHREAD_SUPPORT
 #include <pthread.h>
 #endif
+#if PTHREAD_IDLE_SLEEP
+#include <sys/eventfd.h>
+#endif
 #if SIG_PROTECTED
 #include <signal.h>
 #endif
@@ -55,8 +63,6 @@
 #define TS_DYING   4
 #define TS_DEAD    5
 
-#define STACK_SIZE     (8*1024*1024)
-
 #if SIG_PROTECTED
 sigset_t uthread_protected_sigset;
 #endif
@@ -172,6 +178,411 @@ int uthread_queue_is_empty (uthread_queue_t* queue) {
   return queue->head == 0;
 }
 
+//
+// TIMERS
+//
+// Pending timers are kept in a binary heap ordered by deadline.  Workers poll it each time
+// they look for a thread to run, so a timer fires at the first scheduling point after its
+// deadline.  timer_count and timer_next let the poll skip the lock, and the clock, when no
+// timer can be due.  A timer's fire procedure runs on the polling worker with no locks held
+// and must not block.
+//
+
+#define TIMER_IDLE    0
+#define TIMER_PENDING 1
+#define TIMER_FIRING  2
+
+static spinlock_t         timer_spinlock;
+static uthread_timer_t**  timer_heap;
+static int                timer_heap_capacity;
+static volatile int       timer_count;
+static volatile uint64_t  timer_next = UTHREAD_FOREVER;
+
+/**
+ * uthread_now
+ *    Monotonic time in nanoseconds; timer deadlines are on this clock.
+ */
+
+uint64_t uthread_now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * timer_heap_set
+ */
+
+static void timer_heap_set (int i, uthread_timer_t* timer) {
+  timer_heap [i] = timer;
+  timer->index   = i;
+}
+
+/**
+ * timer_heap_sift
+ *    Restore heap order around position i, moving its timer up or down.
+ */
+
+static void timer_heap_sift (int i) {
+  uthread_timer_t* timer = timer_heap [i];
+  while (i > 0 && timer_heap [(i - 1) / 2]->deadline > timer->deadline) {
+    timer_heap_set (i, timer_heap [(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= timer_count)
+      break;
+    if (child + 1 < timer_count && timer_heap [child + 1]->deadline < timer_heap [child]->deadline)
+      child += 1;
+    if (timer_heap [child]->deadline >= timer->deadline)
+      break;
+    timer_heap_set (i, timer_heap [child]);
+    i = child;
+  }
+  timer_heap_set (i, timer);
+}
+
+/**
+ * timer_heap_remove
+ *    Remove the timer at position i.  timer_spinlock must be held.
+ */
+
+static void timer_heap_remove (int i) {
+  timer_count -= 1;
+  if (i < timer_count) {
+    timer_heap_set  (i, timer_heap [timer_count]);
+    timer_heap_sift (i);
+  }
+  timer_next = timer_count? timer_heap [0]->deadline: UTHREAD_FOREVER;
+}
+
+/**
+ * timer_poll
+ *    Fire every timer whose deadline has passed.
+ */
+
+static void timer_poll () {
+  if (timer_count == 0)
+    return;
+  uint64_t now = uthread_now();
+  while (now >= timer_next) {
+    uthread_timer_t* timer = 0;
+    spinlock_lock (&timer_spinlock);
+    if (timer_count && timer_heap [0]->deadline <= now) {
+      timer = timer_heap [0];
+      timer->state = TIMER_FIRING;
+      timer_heap_remove (0);
+    }
+    spinlock_unlock (&timer_spinlock);
+    if (! timer)
+      break;
+    timer->fire (timer->arg);
+    __atomic_store_n (&timer->state, TIMER_IDLE, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * uthread_timer_start
+ *    Arrange for fire (arg) to be called once deadline (see uthread_now) has passed.  The
+ *    timer must stay allocated until it has fired or uthread_timer_cancel has returned.
+ */
+
+void uthread_timer_start (uthread_timer_t* timer, uint64_t deadline, void (*fire) (void*), void* arg) {
+  timer->deadline = deadline;
+  timer->fire     = fire;
+  timer->arg      = arg;
+  timer->state    = TIMER_PENDING;
+  spinlock_lock (&timer_spinlock);
+  if (timer_count == timer_heap_capacity) {
+    timer_heap_capacity = timer_heap_capacity? timer_heap_capacity * 2: 64;
+    timer_heap          = realloc (timer_heap, timer_heap_capacity * sizeof (uthread_timer_t*));
+    assert (timer_heap);
+  }
+  timer_heap_set  (timer_count, timer);
+  timer_count += 1;
+  timer_heap_sift (timer_count - 1);
+  timer_next = timer_heap [0]->deadline;
+  spinlock_unlock (&timer_spinlock);
+}
+
+/**
+ * uthread_timer_cancel
+ *    Returns 1 if the timer was cancelled before firing and 0 if it has fired.  In either
+ *    case its fire procedure is not running when this returns.
+ */
+
+int uthread_timer_cancel (uthread_timer_t* timer) {
+  int cancelled = 0;
+  spinlock_lock (&timer_spinlock);
+  if (timer->state == TIMER_PENDING) {
+    timer_heap_remove (timer->index);
+    timer->state = TIMER_IDLE;
+    cancelled    = 1;
+  }
+  spinlock_unlock (&timer_spinlock);
+  // Spin rather than yield: fire may already have made this thread runnable.
+  while (__atomic_load_n (&timer->state, __ATOMIC_ACQUIRE) == TIMER_FIRING)
+    asm volatile ("pause");
+  return cancelled;
+}
+
+//
+// IO WAITING
+//
+// A thread waiting for a file descriptor to become readable or writable is recorded in
+// io_fds, indexed by descriptor, and the descriptor is armed one-shot in io_epoll for the
+// directions someone waits for.  Workers poll io_epoll without blocking when they find the
+// ready queue empty, and otherwise only every IO_POLL_PERIOD scheduling points, so busy
+// workers rarely make the system call.  At most one worker polls at a time.  With
+// PTHREAD_IDLE_SLEEP, one idle worker sleeps in epoll_wait instead of on the condition
+// variable, and io_wakeup is written to wake it when a thread becomes ready.
+//
+
+#define IO_POLL_PERIOD 64
+#define IO_POLL_EVENTS 64
+
+struct io_waiter {
+  uthread_t thread;
+  int       fd;
+  int       timed_out;
+};
+
+struct io_fd {
+  struct io_waiter* reader;
+  struct io_waiter* writer;
+  int               armed;
+};
+
+static spinlock_t    io_spinlock;
+static int           io_epoll = -1;
+static struct io_fd* io_fds;
+static int           io_fds_capacity;
+static volatile int  io_count;
+static volatile int  io_polling;
+static unsigned int  io_ticks;
+#if PTHREAD_IDLE_SLEEP
+static int           io_wakeup = -1;
+static int           io_sleeping;
+#endif
+
+/**
+ * io_arm
+ *    (Re)arm fd for the directions that have a waiter.  io_spinlock must be held.  The
+ *    descriptor may have been closed and reopened since it was last armed, so fall back
+ *    between adding and modifying.
+ */
+
+static int io_arm (int fd) {
+  struct io_fd*      slot = &io_fds [fd];
+  struct epoll_event event;
+  int                op, result;
+
+  event.events  = (slot->reader? EPOLLIN: 0) | (slot->writer? EPOLLOUT: 0);
+  event.data.fd = fd;
+  if (event.events == 0)
+    return 0;
+  event.events |= EPOLLONESHOT;
+  op     = slot->armed? EPOLL_CTL_MOD: EPOLL_CTL_ADD;
+  result = epoll_ctl (io_epoll, op, fd, &event);
+  if (result < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+    result = epoll_ctl (io_epoll, EPOLL_CTL_ADD, fd, &event);
+  else if (result < 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+    result = epoll_ctl (io_epoll, EPOLL_CTL_MOD, fd, &event);
+  slot->armed = result == 0;
+  return result;
+}
+
+/**
+ * io_dispatch
+ *    Unblock the waiters of the descriptors that events report ready.
+ */
+
+static void io_dispatch (struct epoll_event* events, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    int       fd     = events [i].data.fd;
+    uint32_t  ready  = events [i].events;
+    uthread_t reader = 0, writer = 0;
+#if PTHREAD_IDLE_SLEEP
+    if (fd == io_wakeup) {
+      uint64_t count;
+      if (read (io_wakeup, &count, sizeof (count)) < 0) {}
+      continue;
+    }
+#endif
+    spinlock_lock (&io_spinlock);
+    struct io_fd* slot = &io_fds [fd];
+    slot->armed = 1;
+    if ((ready & (EPOLLIN | EPOLLERR | EPOLLHUP)) && slot->reader) {
+      reader       = slot->reader->thread;
+      slot->reader = 0;
+      io_count    -= 1;
+    }
+    if ((ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && slot->writer) {
+      writer       = slot->writer->thread;
+      slot->writer = 0;
+      io_count    -= 1;
+    }
+    io_arm (fd);
+    spinlock_unlock (&io_spinlock);
+    // the waiters are on their threads' stacks; don't touch them once unblocked
+    if (reader)
+      uthread_unblock (reader);
+    if (writer)
+      uthread_unblock (writer);
+  }
+}
+
+/**
+ * io_poll
+ *    Unblock the threads whose descriptors are ready, if this is a scheduling point at
+ *    which to look: always when idle, otherwise every IO_POLL_PERIOD calls.  Only called
+ *    while io_count is non-zero.
+ */
+
+static void io_poll (int idle) {
+  struct epoll_event events [IO_POLL_EVENTS];
+  int                n;
+
+  if (! idle && ++io_ticks % IO_POLL_PERIOD != 0)
+    return;
+  if (__atomic_exchange_n (&io_polling, 1, __ATOMIC_ACQUIRE))
+    return;
+  n = epoll_wait (io_epoll, events, IO_POLL_EVENTS, 0);
+  if (n > 0)
+    io_dispatch (events, n);
+  __atomic_store_n (&io_polling, 0, __ATOMIC_RELEASE);
+}
+
+#if PTHREAD_IDLE_SLEEP
+/**
+ * io_sleep
+ *    Block the calling worker until a descriptor is ready, io_wakeup is written or the next
+ *    timer is due.
+ */
+
+static void io_sleep () {
+  struct epoll_event events [IO_POLL_EVENTS];
+  int                n, timeout = -1;
+
+  if (timer_count) {
+    uint64_t now = uthread_now();
+    timeout = timer_next <= now? 0: (int) ((timer_next - now + 999999) / 1000000);
+  }
+  n = epoll_wait (io_epoll, events, IO_POLL_EVENTS, timeout);
+  if (n > 0)
+    io_dispatch (events, n);
+}
+#endif
+
+/**
+ * io_timer_fire
+ *    Withdraw a waiter whose deadline passed before its descriptor was ready.
+ */
+
+static void io_timer_fire (void* arg) {
+  struct io_waiter* waiter = arg;
+  uthread_t         thread = 0;
+
+  spinlock_lock (&io_spinlock);
+  struct io_fd* slot = &io_fds [waiter->fd];
+  if (slot->reader == waiter)
+    slot->reader = 0;
+  else if (slot->writer == waiter)
+    slot->writer = 0;
+  else
+    waiter = 0;
+  if (waiter) {
+    waiter->timed_out = 1;
+    thread            = waiter->thread;
+    io_count         -= 1;
+  }
+  spinlock_unlock (&io_spinlock);
+  if (thread)
+    uthread_unblock (thread);
+}
+
+/**
+ * io_init
+ *    Create io_epoll on first use.  io_spinlock must be held.
+ */
+
+static int io_init () {
+  if (io_epoll >= 0)
+    return 0;
+  io_epoll = epoll_create1 (EPOLL_CLOEXEC);
+  if (io_epoll < 0)
+    return -1;
+#if PTHREAD_IDLE_SLEEP
+  struct epoll_event event;
+  io_wakeup     = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  assert (io_wakeup >= 0);
+  event.events  = EPOLLIN;
+  event.data.fd = io_wakeup;
+  epoll_ctl (io_epoll, EPOLL_CTL_ADD, io_wakeup, &event);
+#endif
+  return 0;
+}
+
+/**
+ * uthread_wait_fd
+ *    Block until fd is ready for events (UTHREAD_IO_READ or UTHREAD_IO_WRITE) or deadline
+ *    has passed.  Returns 0 when ready, 1 on timeout and -1 on error, including when another
+ *    thread is already waiting on fd in the same direction.  Readiness is a hint, as with
+ *    poll: the operation itself must be non-blocking and may still find nothing to do.
+ */
+
+int uthread_wait_fd (int fd, int events, uint64_t deadline) {
+  struct io_waiter   waiter;
+  struct io_waiter** slot;
+  uthread_timer_t    timer;
+
+  assert (events == UTHREAD_IO_READ || events == UTHREAD_IO_WRITE);
+  if (fd < 0)
+    return -1;
+  waiter.thread    = uthread_self();
+  waiter.fd        = fd;
+  waiter.timed_out = 0;
+  spinlock_lock (&io_spinlock);
+  if (io_init() < 0) {
+    spinlock_unlock (&io_spinlock);
+    return -1;
+  }
+  if (fd >= io_fds_capacity) {
+    int capacity = io_fds_capacity? io_fds_capacity: 64;
+    while (capacity <= fd)
+      capacity *= 2;
+    io_fds = realloc (io_fds, capacity * sizeof (struct io_fd));
+    assert (io_fds);
+    memset (io_fds + io_fds_capacity, 0, (capacity - io_fds_capacity) * sizeof (struct io_fd));
+    io_fds_capacity = capacity;
+  }
+  slot = events == UTHREAD_IO_READ? &io_fds [fd].reader: &io_fds [fd].writer;
+  if (*slot) {
+    spinlock_unlock (&io_spinlock);
+    return -1;
+  }
+  *slot     = &waiter;
+  io_count += 1;
+  if (io_arm (fd) < 0) {
+    // epoll refuses regular files, which are always ready
+    int ready = errno == EPERM;
+    *slot     = 0;
+    io_count -= 1;
+    spinlock_unlock (&io_spinlock);
+    return ready? 0: -1;
+  }
+  spinlock_unlock (&io_spinlock);
+
+  if (deadline != UTHREAD_FOREVER)
+    uthread_timer_start (&timer, deadline, io_timer_fire, &waiter);
+  uthread_block();
+  if (deadline != UTHREAD_FOREVER)
+    uthread_timer_cancel (&timer);
+  return waiter.timed_out;
+}
+
 //
 // READY QUEUE
 //
@@ -183,6 +594,18 @@ pthread_mutex_t        pthread_mutex;
 pthread_cond_t         pthread_wakeup;
 int                    pthread_num_sleeping = 0;
 pthread_key_t          pthread_base_thread;
+
+/**
+ * io_wake_sleeper
+ *    Wake the worker sleeping in io_sleep, if any.  pthread_mutex must be held.
+ */
+
+static void io_wake_sleeper () {
+  if (io_sleeping) {
+    uint64_t one = 1;
+    if (write (io_wakeup, &one, sizeof (one)) < 0) {}
+  }
+}
 #endif
 
 /**
@@ -196,6 +619,7 @@ static void ready_queue_enqueue (uthread_t thread) {
   if (pthread_num_sleeping) {
     pthread_mutex_lock   (&pthread_mutex);
     pthread_cond_signal  (&pthread_wakeup);
+    io_wake_sleeper      ();
     pthread_mutex_unlock (&pthread_mutex);
   }
 #endif
@@ -210,6 +634,9 @@ static uthread_t ready_queue_dequeue() {
   uthread_t thread = 0;
   
   while (! thread) {
+    timer_poll ();
+    if (io_count)
+      io_poll (ready_queue.head == 0);
     spinlock_lock (&ready_queue_spinlock);
     thread = uthread_dequeue (&ready_queue);
 #if PTHREAD_IDLE_SLEEP
@@ -221,7 +648,20 @@ static uthread_t ready_queue_dequeue() {
         pthread_mutex_lock   (&pthread_mutex);
         spinlock_unlock      (&ready_queue_spinlock);
         pthread_num_sleeping ++;
-        pthread_cond_wait    (&pthread_wakeup, &pthread_mutex);
+        if (io_count && ! io_sleeping) {
+          // sleep in epoll_wait so that a ready descriptor also wakes this worker
+          io_sleeping = 1;
+          pthread_mutex_unlock (&pthread_mutex);
+          io_sleep             ();
+          pthread_mutex_lock   (&pthread_mutex);
+          io_sleeping = 0;
+        } else if (timer_count) {
+          // sleep no longer than until the next timer is due
+          uint64_t        next = timer_next;
+          struct timespec ts   = {next / 1000000000, next % 1000000000};
+          pthread_cond_timedwait (&pthread_wakeup, &pthread_mutex, &ts);
+        } else
+          pthread_cond_wait (&pthread_wakeup, &pthread_mutex);
         pthread_num_sleeping --;
         pthread_mutex_unlock (&pthread_mutex);
         thread = 0;
@@ -234,6 +674,29 @@ static uthread_t ready_queue_dequeue() {
   return thread;
 }
 
+/**
+ * ready_queue_enqueue_all
+ *    Append every thread on queue to the ready queue with a single acquisition of its lock.
+ */
+
+static void ready_queue_enqueue_all (uthread_queue_t* queue) {
+  spinlock_lock (&ready_queue_spinlock);
+  if (ready_queue.tail)
+    ready_queue.tail->next = queue->head;
+  else
+    ready_queue.head = queue->head;
+  ready_queue.tail = queue->tail;
+#if PTHREAD_IDLE_SLEEP
+  if (pthread_num_sleeping) {
+    pthread_mutex_lock     (&pthread_mutex);
+    pthread_cond_broadcast (&pthread_wakeup);
+    io_wake_sleeper        ();
+    pthread_mutex_unlock   (&pthread_mutex);
+  }
+#endif
+  spinlock_unlock (&ready_queue_spinlock);
+}
+
 static void ready_queue_init () {
   spinlock_create   (&ready_queue_spinlock);
   uthread_initqueue (&ready_queue);
@@ -256,6 +719,7 @@ static uthread_t uthread_new_thread (void* (*)(void*), void*);
 
 static uthread_t base_thread;
 static uintptr_t base_sp_lower_bound, base_sp_upper_bound;
+static int       processors;
 
 #if PTHREAD_SETSTACK_SUPPORT==0
 #define MAX_PTHREADS 100
@@ -313,10 +777,16 @@ void uthread_init (int num_processors) {
   base_thread         = uthread_alloc ();
   base_thread->state  = TS_RUNNING;
   base_thread->stack  = 0;
+  processors          = num_processors;
   ready_queue_init      ();
+  spinlock_create       (&timer_spinlock);
+  spinlock_create       (&io_spinlock);
 #if PTHREAD_IDLE_SLEEP
+  pthread_condattr_t condattr;
+  pthread_condattr_init        (&condattr);
+  pthread_condattr_setclock    (&condattr, CLOCK_MONOTONIC);
   pthread_mutex_init           (&pthread_mutex, NULL);
-  pthread_cond_init            (&pthread_wakeup, NULL);
+  pthread_cond_init            (&pthread_wakeup, &condattr);
   pthread_key_create           (&pthread_base_thread, 0);
   uthread = uthread_new_thread (pthread_base, 0);
   pthread_setspecific          (pthread_base_thread, uthread);
@@ -625,6 +1095,15 @@ uthread_t uthread_self() {
   }
 }
 
+/**
+ * uthread_num_processors
+ *    Number of processors (pthreads) passed to uthread_init.
+ */
+
+int uthread_num_processors () {
+  return processors;
+}
+
 /**
  * uthead_yield
  */
@@ -711,3 +1190,15 @@ void uthread_block () {
 void uthread_unblock (uthread_t thread) {
   uthread_start (thread);
 }
+
+/**
+ * uthread_unblock_queue
+ *    Unblock every thread on queue at once, leaving queue empty.
+ */
+
+void uthread_unblock_queue (uthread_queue_t* queue) {
+  if (queue->head) {
+    ready_queue_enqueue_all (queue);
+    uthread_initqueue       (queue);
+  }
+}
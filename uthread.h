@@ -6,16 +6,39 @@
 #ifndef __uthread_h__
 #define __uthread_h__
 
+#include <stdint.h>
+
 struct uthread_TCB;
 typedef struct uthread_TCB* uthread_t;
 
+struct uthread_timer {
+  uint64_t      deadline;
+  void        (*fire) (void*);
+  void*         arg;
+  int           index;
+  volatile int  state;
+};
+typedef struct uthread_timer uthread_timer_t;
+
+#define UTHREAD_FOREVER UINT64_MAX
+
+#define UTHREAD_IO_READ  1
+#define UTHREAD_IO_WRITE 2
+
 void      uthread_init    (int num_processors);
 uthread_t uthread_create  (void* (*start_proc)(void*), void* start_arg);
 void      uthread_detach  (uthread_t thread);
 int       uthread_join    (uthread_t thread, void** value_ptr);
 uthread_t uthread_self();
+int       uthread_num_processors ();
 void      uthread_yield();
 void      uthread_block();
 void      uthread_unblock (uthread_t thread);
 
+uint64_t  uthread_now          ();
+void      uthread_timer_start  (uthread_timer_t* timer, uint64_t deadline, void (*fire) (void*), void* arg);
+int       uthread_timer_cancel (uthread_timer_t* timer);
+
+int       uthread_wait_fd      (int fd, int events, uint64_t deadline);
+
 #endif
\ No newline at end of file
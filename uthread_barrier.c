@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "spinlock.h"
+#include "uthread.h"
+#include "uthread_util.h"
+#include "uthread_barrier.h"
+
+//
+// BARRIERS AND LATCHES
+//
+// Arriving threads push a waiter record (on their own stack) onto a lock-free list and then
+// atomically count their arrival.  Because every push happens before its arrival is counted,
+// the thread that brings the count to zero finds everyone on the list; it detaches the list
+// and releases all of them with a single ready queue operation.
+//
+
+struct uthread_waiter {
+  uthread_t              thread;
+  struct uthread_waiter* next;
+};
+
+#define LATCH_RELEASED ((struct uthread_waiter*) 1)
+
+struct uthread_barrier {
+  int                             count;
+  volatile int                    remaining;
+  struct uthread_waiter* volatile waiters;
+};
+
+struct uthread_latch {
+  volatile int                    count;
+  struct uthread_waiter* volatile waiters;
+};
+
+/**
+ * waiter_push
+ *    Push waiter onto *list unless it has been set to stop; returns 0 iff the list was stop.
+ */
+
+static int waiter_push (struct uthread_waiter* volatile* list, struct uthread_waiter* waiter, struct uthread_waiter* stop) {
+  struct uthread_waiter* head = __atomic_load_n (list, __ATOMIC_RELAXED);
+  do {
+    if (stop && head == stop)
+      return 0;
+    waiter->next = head;
+  } while (! __atomic_compare_exchange_n (list, &head, waiter, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return 1;
+}
+
+/**
+ * waiter_release
+ *    Unblock every thread on a detached waiter list, except self
+ */
+
+static void waiter_release (struct uthread_waiter* waiter, struct uthread_waiter* self) {
+  uthread_queue_t ready;
+
+  uthread_initqueue (&ready);
+  for (; waiter; waiter = waiter->next)
+    if (waiter != self)
+      uthread_enqueue (&ready, waiter->thread);
+  uthread_unblock_queue (&ready);
+}
+
+/**
+ * uthread_barrier_create
+ */
+
+uthread_barrier_t uthread_barrier_create (int count) {
+  uthread_barrier_t barrier = malloc (sizeof (struct uthread_barrier));
+  assert (count > 0);
+  barrier->count     = count;
+  barrier->remaining = count;
+  barrier->waiters   = 0;
+  return barrier;
+}
+
+/**
+ * uthread_barrier_destroy
+ */
+
+void uthread_barrier_destroy (uthread_barrier_t barrier) {
+  free (barrier);
+}
+
+/**
+ * uthread_barrier_wait
+ *    Block until count threads have arrived.  The barrier is reusable: the last arriver resets
+ *    it before releasing the others, and is the one that gets UTHREAD_BARRIER_SERIAL_THREAD.
+ */
+
+int uthread_barrier_wait (uthread_barrier_t barrier) {
+  struct uthread_waiter waiter, *waiters;
+
+  waiter.thread = uthread_self();
+  waiter_push (&barrier->waiters, &waiter, 0);
+  if (__atomic_fetch_sub (&barrier->remaining, 1, __ATOMIC_ACQ_REL) == 1) {
+    waiters = __atomic_exchange_n (&barrier->waiters, 0, __ATOMIC_ACQUIRE);
+    __atomic_store_n (&barrier->remaining, barrier->count, __ATOMIC_RELEASE);
+    waiter_release (waiters, &waiter);
+    return UTHREAD_BARRIER_SERIAL_THREAD;
+  }
+  uthread_block();
+  return 0;
+}
+
+/**
+ * uthread_latch_create
+ */
+
+uthread_latch_t uthread_latch_create (int count) {
+  uthread_latch_t latch = malloc (sizeof (struct uthread_latch));
+  assert (count >= 0);
+  latch->count   = count;
+  latch->waiters = count? 0: LATCH_RELEASED;
+  return latch;
+}
+
+/**
+ * uthread_latch_destroy
+ */
+
+void uthread_latch_destroy (uthread_latch_t latch) {
+  free (latch);
+}
+
+/**
+ * uthread_latch_count_down
+ *    Subtract n from the count; the call that reaches zero releases every waiter
+ */
+
+void uthread_latch_count_down (uthread_latch_t latch, int n) {
+  int old = __atomic_fetch_sub (&latch->count, n, __ATOMIC_ACQ_REL);
+  assert (old >= n);
+  if (old == n && n > 0)
+    waiter_release (__atomic_exchange_n (&latch->waiters, LATCH_RELEASED, __ATOMIC_ACQ_REL), 0);
+}
+
+/**
+ * uthread_latch_try_wait
+ *    Returns 1 if the latch has been released, 0 otherwise
+ */
+
+int uthread_latch_try_wait (uthread_latch_t latch) {
+  return __atomic_load_n (&latch->count, __ATOMIC_ACQUIRE) == 0;
+}
+
+/**
+ * uthread_latch_wait
+ */
+
+void uthread_latch_wait (uthread_latch_t latch) {
+  struct uthread_waiter waiter;
+
+  if (uthread_latch_try_wait (latch))
+    return;
+  waiter.thread = uthread_self();
+  if (waiter_push (&latch->waiters, &waiter, LATCH_RELEASED))
+    uthread_block();
+}
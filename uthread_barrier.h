@@ -0,0 +1,21 @@
+#ifndef __uthread_barrier_h__
+#define __uthread_barrier_h__
+
+#define UTHREAD_BARRIER_SERIAL_THREAD 1
+
+struct uthread_barrier;
+typedef struct uthread_barrier* uthread_barrier_t;
+struct uthread_latch;
+typedef struct uthread_latch*   uthread_latch_t;
+
+uthread_barrier_t uthread_barrier_create     (int count);
+int               uthread_barrier_wait       (uthread_barrier_t);
+void              uthread_barrier_destroy    (uthread_barrier_t);
+
+uthread_latch_t   uthread_latch_create       (int count);
+void              uthread_latch_count_down   (uthread_latch_t, int n);
+void              uthread_latch_wait         (uthread_latch_t);
+int               uthread_latch_try_wait     (uthread_latch_t);
+void              uthread_latch_destroy      (uthread_latch_t);
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "uthread.h"
+#include "uthread_util.h"
+#include "uthread_future.h"
+
+//
+// FUTURES
+//
+// A future is a result slot and a lock-free list of waiter records, as for latches.  Setting
+// the result stores it and then swaps the list for FUTURE_DONE: that single atomic exchange
+// is the completion, and it hands the setter every waiter that arrived before it, which it
+// unblocks directly.  A waiter that finds FUTURE_DONE when it tries to push itself returns
+// without blocking.
+//
+// uthread_await_any can't leave a record on its stack in the lists of the futures that don't
+// complete, so its records are allocated together with a shared group.  The first setter to
+// claim the group wakes the thread, and the group is freed by whoever drops its last
+// reference: the awaiter, or the setter of the last future still holding one of its records.
+//
+
+struct future_any;
+
+struct future_waiter {
+  uthread_t              thread;
+  struct future_waiter*  next;
+  struct future_any*     any;
+  int                    index;
+};
+
+struct future_any {
+  uthread_t              thread;
+  volatile int           winner;
+  volatile int           refs;
+  struct future_waiter   waiters [];
+};
+
+#define FUTURE_DONE ((struct future_waiter*) 1)
+
+struct uthread_future {
+  void*                           result;
+  struct future_waiter* volatile  waiters;
+  void*                         (*fn) (void*);
+  void*                           arg;
+};
+
+/**
+ * future_any_release
+ *    Drop a reference to group, freeing it with the last one.
+ */
+
+static void future_any_release (struct future_any* any) {
+  if (__atomic_sub_fetch (&any->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free (any);
+}
+
+/**
+ * future_any_claim
+ *    Make index the winner of group unless there already is one; returns 1 if it did.
+ */
+
+static int future_any_claim (struct future_any* any, int index) {
+  int none = -1;
+  return __atomic_compare_exchange_n (&any->winner, &none, index, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * uthread_future_create
+ */
+
+uthread_future_t uthread_future_create () {
+  uthread_future_t future = malloc (sizeof (struct uthread_future));
+  assert (future);
+  future->result  = 0;
+  future->waiters = 0;
+  future->fn      = 0;
+  future->arg     = 0;
+  return future;
+}
+
+/**
+ * uthread_future_set
+ *    Complete the future with result and wake everyone waiting for it.  Must be called once.
+ */
+
+void uthread_future_set (uthread_future_t future, void* result) {
+  struct future_waiter *waiter, *next;
+  uthread_queue_t       ready;
+
+  future->result = result;
+  waiter = __atomic_exchange_n (&future->waiters, FUTURE_DONE, __ATOMIC_ACQ_REL);
+  assert (waiter != FUTURE_DONE);
+  uthread_initqueue (&ready);
+  for (; waiter; waiter = next) {
+    // read next first: the record may be freed, or its thread resumed, once it is handled
+    next = waiter->next;
+    if (waiter->any == 0)
+      uthread_enqueue (&ready, waiter->thread);
+    else {
+      struct future_any* any = waiter->any;
+      if (future_any_claim (any, waiter->index))
+        uthread_enqueue (&ready, any->thread);
+      future_any_release (any);
+    }
+  }
+  uthread_unblock_queue (&ready);
+}
+
+/**
+ * uthread_future_is_done
+ */
+
+int uthread_future_is_done (uthread_future_t future) {
+  return __atomic_load_n (&future->waiters, __ATOMIC_ACQUIRE) == FUTURE_DONE;
+}
+
+/**
+ * future_push
+ *    Push waiter onto the future's list unless it is done; returns 0 iff it was done.
+ */
+
+static int future_push (uthread_future_t future, struct future_waiter* waiter) {
+  struct future_waiter* head = __atomic_load_n (&future->waiters, __ATOMIC_ACQUIRE);
+  do {
+    if (head == FUTURE_DONE)
+      return 0;
+    waiter->next = head;
+  } while (! __atomic_compare_exchange_n (&future->waiters, &head, waiter, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  return 1;
+}
+
+/**
+ * uthread_await
+ *    Block until the future is complete and return its result.  Any number of threads may
+ *    await the same future, any number of times.
+ */
+
+void* uthread_await (uthread_future_t future) {
+  struct future_waiter waiter;
+
+  if (! uthread_future_is_done (future)) {
+    waiter.thread = uthread_self();
+    waiter.any    = 0;
+    if (future_push (future, &waiter))
+      uthread_block();
+  }
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return future->result;
+}
+
+/**
+ * uthread_await_any
+ *    Block until at least one of the n futures is complete and return the index of one that
+ *    is.
+ */
+
+int uthread_await_any (uthread_future_t* futures, int n) {
+  struct future_any* any;
+  int                i, pushed;
+
+  assert (n > 0);
+  for (i = 0; i < n; i++)
+    if (uthread_future_is_done (futures [i]))
+      return i;
+  any = malloc (sizeof (struct future_any) + n * sizeof (struct future_waiter));
+  assert (any);
+  any->thread = uthread_self();
+  any->winner = -1;
+  any->refs   = n + 1;
+  for (pushed = 0; pushed < n; pushed++) {
+    any->waiters [pushed].thread = any->thread;
+    any->waiters [pushed].any    = any;
+    any->waiters [pushed].index  = pushed;
+    if (! future_push (futures [pushed], &any->waiters [pushed])) {
+      // completed since the scan: claim it, unless a setter already has another one
+      future_any_claim (any, pushed);
+      break;
+    }
+  }
+  if (pushed < n)
+    // drop the references of the records that were never pushed, including the one refused
+    __atomic_sub_fetch (&any->refs, n - pushed, __ATOMIC_ACQ_REL);
+  else
+    uthread_block();
+  // If this thread claimed the group itself, a setter may still have claimed it first and
+  // unblocked it; block to consume that wakeup so it isn't delivered to a later wait.
+  if (pushed < n && any->winner != pushed)
+    uthread_block();
+  i = any->winner;
+  future_any_release (any);
+  return i;
+}
+
+/**
+ * uthread_await_all
+ *    Block until all n futures are complete, storing their results in results unless it is
+ *    NULL.
+ */
+
+void uthread_await_all (uthread_future_t* futures, int n, void** results) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    void* result = uthread_await (futures [i]);
+    if (results)
+      results [i] = result;
+  }
+}
+
+/**
+ * future_run
+ *    Body of the thread started by uthread_async.
+ */
+
+static void* future_run (void* arg) {
+  uthread_future_t future = arg;
+  uthread_future_set (future, future->fn (future->arg));
+  return 0;
+}
+
+/**
+ * uthread_async
+ *    Run fn (arg) in a new thread and return a future for its result.
+ */
+
+uthread_future_t uthread_async (void* (*fn)(void*), void* arg) {
+  uthread_future_t future = uthread_future_create();
+  future->fn  = fn;
+  future->arg = arg;
+  uthread_detach (uthread_create (future_run, future));
+  return future;
+}
+
+/**
+ * uthread_future_destroy
+ *    Wait for the future to complete, if it hasn't, and free it.
+ */
+
+void uthread_future_destroy (uthread_future_t future) {
+  uthread_await (future);
+  free (future);
+}
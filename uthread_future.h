@@ -0,0 +1,17 @@
+#ifndef __uthread_future_h__
+#define __uthread_future_h__
+
+struct uthread_future;
+typedef struct uthread_future* uthread_future_t;
+
+uthread_future_t uthread_future_create  ();
+void             uthread_future_set     (uthread_future_t, void* result);
+int              uthread_future_is_done (uthread_future_t);
+void             uthread_future_destroy (uthread_future_t);
+
+uthread_future_t uthread_async          (void* (*fn)(void*), void* arg);
+void*            uthread_await          (uthread_future_t);
+int              uthread_await_any      (uthread_future_t* futures, int n);
+void             uthread_await_all      (uthread_future_t* futures, int n, void** results);
+
+#endif
@@ -3,9 +3,17 @@
 // Do not redistribute any portion of this code without permission.
 //
 
+#ifndef UTHREAD_MUTEX_PROFILE
+#define UTHREAD_MUTEX_PROFILE 0
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#if UTHREAD_MUTEX_PROFILE
+#include <time.h>
+#endif
 #include "spinlock.h"
 #include "uthread.h"
 #include "uthread_util.h"
@@ -21,6 +29,12 @@ struct uthread_mutex {
   spinlock_t      spinlock;
   uthread_queue_t waiter_queue;
   uthread_queue_t reader_waiter_queue;
+#if UTHREAD_MUTEX_PROFILE
+  struct uthread_mutex_profile profile;
+  unsigned long long           acquired_at;
+  struct uthread_mutex*        profile_prev;
+  struct uthread_mutex*        profile_next;
+#endif
 };
 
 struct uthread_cond {
@@ -28,25 +42,114 @@ struct uthread_cond {
   uthread_queue_t waiter_queue;
 };
 
+#if UTHREAD_MUTEX_PROFILE
+//
+// CONTENTION PROFILE
+//
+// Every live mutex is on the profile list.  Counters are only updated while holding the
+// mutex's own spinlock, so the only added cost on the uncontended path is reading the clock
+// on lock and unlock to accumulate hold time.
+//
+
+static spinlock_t            profile_spinlock = 0;
+static struct uthread_mutex* profile_list     = 0;
+static int                   profile_count    = 0;
+static int                   profile_atexit   = 0;
+
+static unsigned long long profile_now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void profile_dump_at_exit () {
+  uthread_mutex_profile_dump (stderr);
+}
+
+static void profile_register (uthread_mutex_t mutex, const char* name, void* site) {
+  mutex->profile.name         = name;
+  mutex->profile.site         = site;
+  mutex->profile.acquisitions = 0;
+  mutex->profile.contended    = 0;
+  mutex->profile.wait_ns      = 0;
+  mutex->profile.max_wait_ns  = 0;
+  mutex->profile.hold_ns      = 0;
+  mutex->acquired_at          = 0;
+  spinlock_lock (&profile_spinlock);
+  if (! profile_atexit) {
+    atexit (profile_dump_at_exit);
+    profile_atexit = 1;
+  }
+  mutex->profile_prev = 0;
+  mutex->profile_next = profile_list;
+  if (profile_list)
+    profile_list->profile_prev = mutex;
+  profile_list   = mutex;
+  profile_count += 1;
+  spinlock_unlock (&profile_spinlock);
+}
+
+static void profile_unregister (uthread_mutex_t mutex) {
+  spinlock_lock (&profile_spinlock);
+  if (mutex->profile_prev)
+    mutex->profile_prev->profile_next = mutex->profile_next;
+  else
+    profile_list = mutex->profile_next;
+  if (mutex->profile_next)
+    mutex->profile_next->profile_prev = mutex->profile_prev;
+  profile_count -= 1;
+  spinlock_unlock (&profile_spinlock);
+}
+
+static int profile_compare (const void* a, const void* b) {
+  unsigned long long wa = ((const struct uthread_mutex_profile*) a)->wait_ns;
+  unsigned long long wb = ((const struct uthread_mutex_profile*) b)->wait_ns;
+  return wa < wb? 1: wa > wb? -1: 0;
+}
+#endif
+
 /**
- * uthread_mutex_create
+ * uthread_mutex_new
  */
 
-uthread_mutex_t uthread_mutex_create () {
+static uthread_mutex_t uthread_mutex_new (const char* name, void* site) {
   uthread_mutex_t mutex = malloc (sizeof (struct uthread_mutex));
   mutex->holder = 0;
   mutex->reader_count = 0;
   spinlock_create   (&mutex->spinlock);
   uthread_initqueue (&mutex->waiter_queue);
   uthread_initqueue (&mutex->reader_waiter_queue);
+#if UTHREAD_MUTEX_PROFILE
+  profile_register (mutex, name, site);
+#endif
   return mutex;
 }
 
+/**
+ * uthread_mutex_create
+ */
+
+uthread_mutex_t uthread_mutex_create () {
+  return uthread_mutex_new (0, __builtin_return_address (0));
+}
+
+/**
+ * uthread_mutex_create_named
+ *    name is not copied and must outlive the mutex; it labels the mutex in the contention profile
+ */
+
+uthread_mutex_t uthread_mutex_create_named (const char* name) {
+  return uthread_mutex_new (name, __builtin_return_address (0));
+}
+
 /**
  * uthread_mutex_destroy
  */
 
 void uthread_mutex_destroy (uthread_mutex_t mutex) {
+#if UTHREAD_MUTEX_PROFILE
+  profile_unregister (mutex);
+#endif
   free (mutex);
 }
 
@@ -55,14 +158,32 @@ void uthread_mutex_destroy (uthread_mutex_t mutex) {
  */
 
 void uthread_mutex_lock (uthread_mutex_t mutex) {
+#if UTHREAD_MUTEX_PROFILE
+  unsigned long long wait_start = 0;
+#endif
   spinlock_lock (&mutex->spinlock);
   while (mutex->holder || mutex->reader_count > 0) {
+#if UTHREAD_MUTEX_PROFILE
+    if (! wait_start)
+      wait_start = profile_now();
+#endif
     uthread_enqueue (&mutex->waiter_queue, uthread_self());
     spinlock_unlock (&mutex->spinlock);
     uthread_block();
     spinlock_lock (&mutex->spinlock);
   }
   mutex->holder = uthread_self();
+#if UTHREAD_MUTEX_PROFILE
+  mutex->acquired_at = profile_now();
+  mutex->profile.acquisitions += 1;
+  if (wait_start) {
+    unsigned long long wait = mutex->acquired_at - wait_start;
+    mutex->profile.contended += 1;
+    mutex->profile.wait_ns   += wait;
+    if (wait > mutex->profile.max_wait_ns)
+      mutex->profile.max_wait_ns = wait;
+  }
+#endif
   spinlock_unlock (&mutex->spinlock);
 }
 
@@ -71,14 +192,33 @@ void uthread_mutex_lock (uthread_mutex_t mutex) {
  */
 
 void uthread_mutex_lock_readonly (uthread_mutex_t mutex) {
+#if UTHREAD_MUTEX_PROFILE
+  unsigned long long wait_start = 0;
+#endif
   spinlock_lock (&mutex->spinlock);
   while (mutex->holder || !uthread_queue_is_empty (&mutex->waiter_queue)) {
+#if UTHREAD_MUTEX_PROFILE
+    if (! wait_start)
+      wait_start = profile_now();
+#endif
     uthread_enqueue (&mutex->reader_waiter_queue, uthread_self());
     spinlock_unlock (&mutex->spinlock);
     uthread_block();
     spinlock_lock   (&mutex->spinlock);
   }
   mutex->reader_count += 1;
+#if UTHREAD_MUTEX_PROFILE
+  if (mutex->reader_count == 1)
+    mutex->acquired_at = profile_now();
+  mutex->profile.acquisitions += 1;
+  if (wait_start) {
+    unsigned long long wait = profile_now() - wait_start;
+    mutex->profile.contended += 1;
+    mutex->profile.wait_ns   += wait;
+    if (wait > mutex->profile.max_wait_ns)
+      mutex->profile.max_wait_ns = wait;
+  }
+#endif
   spinlock_unlock (&mutex->spinlock);
 }
 
@@ -93,9 +233,16 @@ void uthread_mutex_unlock (uthread_mutex_t mutex) {
   if (mutex->holder) {
     assert (mutex->holder == uthread_self());
     mutex->holder = 0;
+#if UTHREAD_MUTEX_PROFILE
+    mutex->profile.hold_ns += profile_now() - mutex->acquired_at;
+#endif
   } else {
     assert (mutex->reader_count > 0);
     mutex->reader_count -= 1;
+#if UTHREAD_MUTEX_PROFILE
+    if (mutex->reader_count == 0)
+      mutex->profile.hold_ns += profile_now() - mutex->acquired_at;
+#endif
   }
   if (mutex->reader_count == 0) {
     waiter_thread = uthread_dequeue (&mutex->waiter_queue);
@@ -109,6 +256,80 @@ void uthread_mutex_unlock (uthread_mutex_t mutex) {
   spinlock_unlock (&mutex->spinlock);
 }
 
+/**
+ * uthread_mutex_profile
+ *    Copy the contention counters of one mutex into *profile (zeros if profiling is not compiled in)
+ */
+
+void uthread_mutex_profile (uthread_mutex_t mutex, struct uthread_mutex_profile* profile) {
+#if UTHREAD_MUTEX_PROFILE
+  spinlock_lock   (&mutex->spinlock);
+  *profile = mutex->profile;
+  spinlock_unlock (&mutex->spinlock);
+#else
+  memset (profile, 0, sizeof (*profile));
+#endif
+}
+
+/**
+ * uthread_mutex_profile_all
+ *    Copy up to max profiles, sorted by total wait time, into profiles; returns the number copied
+ */
+
+int uthread_mutex_profile_all (struct uthread_mutex_profile* profiles, int max) {
+  int count = 0;
+#if UTHREAD_MUTEX_PROFILE
+  struct uthread_mutex_profile* all;
+  uthread_mutex_t               mutex;
+
+  spinlock_lock (&profile_spinlock);
+  all = malloc ((profile_count? profile_count: 1) * sizeof (struct uthread_mutex_profile));
+  for (mutex = profile_list; mutex; mutex = mutex->profile_next) {
+    spinlock_lock   (&mutex->spinlock);
+    all [count++] = mutex->profile;
+    spinlock_unlock (&mutex->spinlock);
+  }
+  spinlock_unlock (&profile_spinlock);
+  qsort (all, count, sizeof (struct uthread_mutex_profile), profile_compare);
+  if (count > max)
+    count = max;
+  memcpy (profiles, all, count * sizeof (struct uthread_mutex_profile));
+  free (all);
+#endif
+  return count;
+}
+
+/**
+ * uthread_mutex_profile_dump
+ *    Print every live mutex that has been acquired, heaviest total wait first
+ */
+
+void uthread_mutex_profile_dump (FILE* file) {
+#if UTHREAD_MUTEX_PROFILE
+  struct uthread_mutex_profile* profiles;
+  int                           count, i;
+
+  spinlock_lock   (&profile_spinlock);
+  count = profile_count;
+  spinlock_unlock (&profile_spinlock);
+  profiles = malloc ((count? count: 1) * sizeof (struct uthread_mutex_profile));
+  count    = uthread_mutex_profile_all (profiles, count);
+  fprintf (file, "%-32s %12s %12s %14s %14s %14s\n", "mutex", "acquired", "contended", "wait_ns", "max_wait_ns", "hold_ns");
+  for (i = 0; i < count; i++) {
+    char site [32];
+    if (profiles[i].acquisitions == 0)
+      continue;
+    if (! profiles[i].name)
+      snprintf (site, sizeof (site), "%p", profiles[i].site);
+    fprintf (file, "%-32s %12lu %12lu %14llu %14llu %14llu\n",
+             profiles[i].name? profiles[i].name: site,
+             profiles[i].acquisitions, profiles[i].contended,
+             profiles[i].wait_ns, profiles[i].max_wait_ns, profiles[i].hold_ns);
+  }
+  free (profiles);
+#endif
+}
+
 /**
  * uthread_cond_create
  */
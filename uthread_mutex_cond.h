@@ -6,12 +6,15 @@
 #ifndef __uthread_mutex_cond_h__
 #define __uthread_mutex_cond_h__
 
+#include <stdio.h>
+
 struct uthread_mutex;
 typedef struct uthread_mutex* uthread_mutex_t;
 struct uthread_cond;
 typedef struct uthread_cond*  uthread_cond_t;
 
 uthread_mutex_t uthread_mutex_create        ();
+uthread_mutex_t uthread_mutex_create_named  (const char* name);
 void            uthread_mutex_lock          (uthread_mutex_t);
 void            uthread_mutex_lock_readonly (uthread_mutex_t);
 void            uthread_mutex_unlock        (uthread_mutex_t);
@@ -23,4 +26,21 @@ void            uthread_cond_signal         (uthread_cond_t);
 void            uthread_cond_broadcast      (uthread_cond_t);
 void            uthread_cond_destroy        (uthread_cond_t);
 
+// Contention profile, collected when compiled with -DUTHREAD_MUTEX_PROFILE=1.  A mutex
+// created without a name is identified by the address of its creation call-site.  hold_ns
+// counts exclusive holds, and for readers the time from the first reader in to the last out.
+struct uthread_mutex_profile {
+  const char*        name;
+  void*              site;
+  unsigned long      acquisitions;
+  unsigned long      contended;
+  unsigned long long wait_ns;
+  unsigned long long max_wait_ns;
+  unsigned long long hold_ns;
+};
+
+void            uthread_mutex_profile       (uthread_mutex_t, struct uthread_mutex_profile*);
+int             uthread_mutex_profile_all   (struct uthread_mutex_profile*, int max);
+void            uthread_mutex_profile_dump  (FILE*);
+
 #endif
@@ -0,0 +1,483 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "spinlock.h"
+#include "uthread.h"
+#include "uthread_parallel.h"
+
+//
+// TASKS
+//
+// Tasks run on one worker thread per processor, each with its own work-stealing deque: the
+// owner pushes and pops at the bottom and idle workers steal from the top (Chase and Lev,
+// with the orderings of Le et al.).  A loop is a single range task until some worker needs
+// work: the worker running a range checks between grains whether its deque is empty, and
+// only then splits off the upper half of what is left for a thief.  Tasks spawned by
+// threads that are not workers go on a shared injection list.
+//
+// Workers don't block while running tasks, so they own their processors while there is
+// work.  A worker that finds nothing for PARALLEL_STEAL_ROUNDS rounds parks in
+// uthread_block until a new task wakes it.  A group counts its pending tasks in the upper
+// bits of state; its low bit says a thread is blocked in sync, and the task whose
+// completion brings state to exactly that bit unblocks it.  A worker in sync runs tasks
+// until none are left to take, and only then blocks.
+//
+
+#define PARALLEL_CACHE_LINE   64
+#define PARALLEL_DEQUE_SIZE   1024
+#define PARALLEL_STEAL_ROUNDS 64
+
+struct task {
+  struct task*           next;
+  uthread_task_group_t   group;
+  void                 (*fn)   (void*);
+  void*                  arg;
+  void                 (*body) (void*, long, long);
+  void*                  ctx;
+  long                   begin, end, grain;
+};
+
+struct uthread_task_group {
+  volatile long  state;
+  uthread_t      waiter;
+};
+
+struct deque {
+  volatile long          top    __attribute__ ((aligned (PARALLEL_CACHE_LINE)));
+  volatile long          bottom __attribute__ ((aligned (PARALLEL_CACHE_LINE)));
+  struct task* volatile  slots  [PARALLEL_DEQUE_SIZE];
+};
+
+struct worker {
+  struct deque  deque;
+  uthread_t     thread;
+  volatile int  parked;
+  unsigned int  seed;
+} __attribute__ ((aligned (PARALLEL_CACHE_LINE)));
+
+static struct worker*  workers;
+static int             num_workers;
+static volatile int    num_parked;
+static volatile int    started;
+static spinlock_t      start_spinlock;
+static spinlock_t      inject_spinlock;
+static struct task*    inject_head;
+static struct task*    inject_tail;
+
+//
+// DEQUES
+//
+
+/**
+ * deque_push
+ *    Called by the owner only.  Returns 0 if the deque is full.
+ */
+
+static int deque_push (struct deque* deque, struct task* task) {
+  long bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED);
+  long top    = __atomic_load_n (&deque->top,    __ATOMIC_ACQUIRE);
+
+  if (bottom - top >= PARALLEL_DEQUE_SIZE)
+    return 0;
+  __atomic_store_n (&deque->slots [bottom & (PARALLEL_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+  __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * deque_pop
+ *    Called by the owner only.  Takes the newest task, racing thieves for the last one.
+ */
+
+static struct task* deque_pop (struct deque* deque) {
+  long         bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED) - 1;
+  long         top;
+  struct task* task   = 0;
+
+  __atomic_store_n (&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  top = __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+  if (top <= bottom) {
+    task = __atomic_load_n (&deque->slots [bottom & (PARALLEL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      if (! __atomic_compare_exchange_n (&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        task = 0;
+      __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else
+    __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return task;
+}
+
+/**
+ * deque_steal
+ *    Take the oldest task; returns 0 if the deque is empty or another thread got it first.
+ */
+
+static struct task* deque_steal (struct deque* deque) {
+  long top = __atomic_load_n (&deque->top, __ATOMIC_ACQUIRE);
+  long bottom;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n (&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top < bottom) {
+    struct task* task = __atomic_load_n (&deque->slots [top & (PARALLEL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n (&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return task;
+  }
+  return 0;
+}
+
+/**
+ * deque_is_empty
+ */
+
+static int deque_is_empty (struct deque* deque) {
+  return __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED) <= __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+}
+
+//
+// WORKERS
+//
+
+/**
+ * inject_take
+ */
+
+static struct task* inject_take () {
+  struct task* task;
+
+  if (! __atomic_load_n (&inject_head, __ATOMIC_RELAXED))
+    return 0;
+  spinlock_lock (&inject_spinlock);
+  task = inject_head;
+  if (task) {
+    inject_head = task->next;
+    if (! inject_head)
+      inject_tail = 0;
+  }
+  spinlock_unlock (&inject_spinlock);
+  return task;
+}
+
+/**
+ * inject_put
+ */
+
+static void inject_put (struct task* task) {
+  task->next = 0;
+  spinlock_lock (&inject_spinlock);
+  if (inject_tail)
+    inject_tail->next = task;
+  else
+    inject_head = task;
+  inject_tail = task;
+  spinlock_unlock (&inject_spinlock);
+}
+
+/**
+ * work_available
+ *    Is there a task that a parking worker could take?
+ */
+
+static int work_available () {
+  int i;
+
+  if (__atomic_load_n (&inject_head, __ATOMIC_SEQ_CST))
+    return 1;
+  for (i = 0; i < num_workers; i++)
+    if (! deque_is_empty (&workers [i].deque))
+      return 1;
+  return 0;
+}
+
+/**
+ * worker_wake
+ *    Wake a parked worker, if there is one, to take a task that was just made available.
+ */
+
+static void worker_wake () {
+  int i;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&num_parked, __ATOMIC_RELAXED) == 0)
+    return;
+  for (i = 0; i < num_workers; i++)
+    if (workers [i].parked && __atomic_exchange_n (&workers [i].parked, 0, __ATOMIC_SEQ_CST)) {
+      __atomic_sub_fetch (&num_parked, 1, __ATOMIC_SEQ_CST);
+      uthread_unblock (workers [i].thread);
+      return;
+    }
+}
+
+/**
+ * worker_park
+ *    Block until worker_wake picks this worker.  The worker announces itself before looking
+ *    for work one last time, so a task pushed meanwhile either is seen here or sees it.
+ */
+
+static void worker_park (struct worker* worker) {
+  __atomic_store_n  (&worker->parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&num_parked, 1, __ATOMIC_SEQ_CST);
+  if (work_available () && __atomic_exchange_n (&worker->parked, 0, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch (&num_parked, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  // if worker_wake got here first, this consumes its unblock
+  uthread_block ();
+}
+
+/**
+ * worker_find
+ *    Pop a task from the worker's own deque or, failing that, try the injection list and
+ *    steal from the others, starting at a random victim, for a bounded number of rounds.
+ */
+
+static struct task* worker_find (struct worker* worker) {
+  struct task* task = deque_pop (&worker->deque);
+  int          round, i, start;
+
+  for (round = 0; ! task && round < PARALLEL_STEAL_ROUNDS; round++) {
+    task = inject_take ();
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    start = worker->seed % num_workers;
+    for (i = 0; ! task && i < num_workers; i++) {
+      struct worker* victim = &workers [(start + i) % num_workers];
+      if (victim != worker)
+        task = deque_steal (&victim->deque);
+    }
+    if (! task)
+      asm volatile ("pause");
+  }
+  return task;
+}
+
+/**
+ * current_worker
+ *    The worker that is the current thread, or 0 if it isn't one.
+ */
+
+static struct worker* current_worker () {
+  uthread_t self = uthread_self ();
+  int       i;
+
+  if (! __atomic_load_n (&started, __ATOMIC_ACQUIRE))
+    return 0;
+  for (i = 0; i < num_workers; i++)
+    if (workers [i].thread == self)
+      return &workers [i];
+  return 0;
+}
+
+static void task_run (struct worker*, struct task*);
+
+/**
+ * worker_main
+ */
+
+static void* worker_main (void* arg) {
+  struct worker* worker = arg;
+
+  worker->thread = uthread_self ();
+  while (1) {
+    struct task* task = worker_find (worker);
+    if (task)
+      task_run (worker, task);
+    else
+      worker_park (worker);
+  }
+  return 0;
+}
+
+/**
+ * parallel_start
+ *    Start the workers, one per processor, the first time they are needed.
+ */
+
+static void parallel_start () {
+  int i;
+
+  if (__atomic_load_n (&started, __ATOMIC_ACQUIRE))
+    return;
+  spinlock_lock (&start_spinlock);
+  if (! started) {
+    num_workers = uthread_num_processors ();
+    if (num_workers < 1)
+      num_workers = 1;
+    if (posix_memalign ((void**) &workers, PARALLEL_CACHE_LINE, num_workers * sizeof (struct worker)))
+      assert (0);
+    memset (workers, 0, num_workers * sizeof (struct worker));
+    for (i = 0; i < num_workers; i++) {
+      workers [i].seed = 2463534242u + i;
+      uthread_detach (uthread_create (worker_main, &workers [i]));
+    }
+    __atomic_store_n (&started, 1, __ATOMIC_RELEASE);
+  }
+  spinlock_unlock (&start_spinlock);
+}
+
+//
+// TASKS AND GROUPS
+//
+
+/**
+ * task_new
+ */
+
+static struct task* task_new (uthread_task_group_t group) {
+  struct task* task = malloc (sizeof (struct task));
+  assert (task);
+  task->group = group;
+  task->fn    = 0;
+  task->body  = 0;
+  return task;
+}
+
+/**
+ * task_submit
+ *    Count the task in its group and make it available: on the deque of the current worker,
+ *    run right away if that is full, or on the injection list.
+ */
+
+static void task_submit (struct task* task) {
+  struct worker* worker;
+
+  parallel_start ();
+  worker = current_worker ();
+  __atomic_add_fetch (&task->group->state, 2, __ATOMIC_ACQ_REL);
+  if (worker) {
+    if (! deque_push (&worker->deque, task)) {
+      task_run (worker, task);
+      return;
+    }
+  } else
+    inject_put (task);
+  worker_wake ();
+}
+
+/**
+ * task_run
+ *    Run the task and retire it from its group.  A range task runs a grain at a time and
+ *    splits whenever the worker's deque has run dry, keeping the lower half.
+ */
+
+static void task_run (struct worker* worker, struct task* task) {
+  uthread_task_group_t group = task->group;
+
+  if (task->body) {
+    long begin = task->begin, end = task->end, grain = task->grain;
+    while (end - begin > grain) {
+      if (num_workers > 1 && deque_is_empty (&worker->deque)) {
+        struct task* half = task_new (group);
+        half->body  = task->body;
+        half->ctx   = task->ctx;
+        half->grain = grain;
+        half->begin = begin + (end - begin) / 2;
+        half->end   = end;
+        end         = half->begin;
+        __atomic_add_fetch (&group->state, 2, __ATOMIC_ACQ_REL);
+        if (deque_push (&worker->deque, half))
+          worker_wake ();
+        else
+          assert (0);
+        continue;
+      }
+      task->body (task->ctx, begin, begin + grain);
+      begin += grain;
+    }
+    task->body (task->ctx, begin, end);
+  } else
+    task->fn (task->arg);
+  free (task);
+  if (__atomic_sub_fetch (&group->state, 2, __ATOMIC_ACQ_REL) == 1)
+    uthread_unblock (group->waiter);
+}
+
+/**
+ * uthread_task_group_create
+ */
+
+uthread_task_group_t uthread_task_group_create () {
+  uthread_task_group_t group = malloc (sizeof (struct uthread_task_group));
+  assert (group);
+  group->state  = 0;
+  group->waiter = 0;
+  return group;
+}
+
+/**
+ * uthread_task_group_destroy
+ *    Wait for the group's tasks, if there are any left, and free it.
+ */
+
+void uthread_task_group_destroy (uthread_task_group_t group) {
+  uthread_task_sync (group);
+  free (group);
+}
+
+/**
+ * uthread_task_spawn
+ *    Run fn (arg) as a task of group.  fn should not block for long: it holds a worker.
+ */
+
+void uthread_task_spawn (uthread_task_group_t group, void (*fn)(void*), void* arg) {
+  struct task* task = task_new (group);
+  task->fn  = fn;
+  task->arg = arg;
+  task_submit (task);
+}
+
+/**
+ * uthread_task_sync
+ *    Wait until every task spawned in group so far has finished.  A worker runs tasks,
+ *    its own first, while it waits.  The group can be reused afterwards.
+ */
+
+void uthread_task_sync (uthread_task_group_t group) {
+  struct worker* worker = current_worker ();
+
+  if (worker)
+    while (__atomic_load_n (&group->state, __ATOMIC_ACQUIRE) >> 1) {
+      struct task* task = worker_find (worker);
+      if (! task)
+        break;
+      task_run (worker, task);
+    }
+  if (__atomic_load_n (&group->state, __ATOMIC_ACQUIRE) >> 1) {
+    group->waiter = uthread_self ();
+    if (__atomic_fetch_or (&group->state, 1, __ATOMIC_ACQ_REL) >> 1)
+      uthread_block ();
+  }
+  group->state = 0;
+}
+
+/**
+ * uthread_parallel_for
+ *    Call body (ctx, b, e) on disjoint subranges [b, e) that cover [begin, end), in parallel
+ *    across the workers, and return once all have finished.  Subranges are grain long,
+ *    except the last of each split; a range no longer than grain is run by the caller.
+ */
+
+void uthread_parallel_for (long begin, long end, long grain, void (*body)(void* ctx, long begin, long end), void* ctx) {
+  struct uthread_task_group group = {0, 0};
+  struct task*              task;
+
+  if (grain < 1)
+    grain = 1;
+  if (end - begin <= grain) {
+    if (end > begin)
+      body (ctx, begin, end);
+    return;
+  }
+  task        = task_new (&group);
+  task->body  = body;
+  task->ctx   = ctx;
+  task->begin = begin;
+  task->end   = end;
+  task->grain = grain;
+  task_submit (task);
+  uthread_task_sync (&group);
+}
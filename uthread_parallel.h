@@ -0,0 +1,15 @@
+#ifndef __uthread_parallel_h__
+#define __uthread_parallel_h__
+
+struct uthread_task_group;
+typedef struct uthread_task_group* uthread_task_group_t;
+
+uthread_task_group_t uthread_task_group_create  ();
+void                 uthread_task_group_destroy (uthread_task_group_t);
+void                 uthread_task_spawn         (uthread_task_group_t, void (*fn)(void*), void* arg);
+void                 uthread_task_sync          (uthread_task_group_t);
+
+void                 uthread_parallel_for       (long begin, long end, long grain,
+                                                 void (*body)(void* ctx, long begin, long end), void* ctx);
+
+#endif
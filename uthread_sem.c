@@ -14,11 +14,25 @@
 //
 // SEMAPHORES
 //
+// value is updated atomically and is the only thing touched when it stays non-negative.
+// A negative value is the number of units owed to waiting threads.  Owed units are handed
+// to waiters in FIFO order under spinlock; units that arrive before their waiter has had
+// a chance to enqueue are parked in pending, which is never positive when the queue is
+// non-empty.
+//
+
+struct uthread_sem_waiter {
+  uthread_t                  thread;
+  int                        need;
+  struct uthread_sem_waiter* next;
+};
 
 struct uthread_sem {
-  int             value;
-  spinlock_t      spinlock;
-  uthread_queue_t waiter_queue;
+  volatile int               value;
+  spinlock_t                 spinlock;
+  int                        pending;
+  struct uthread_sem_waiter* head;
+  struct uthread_sem_waiter* tail;
 };
 
 /**
@@ -27,10 +41,12 @@ struct uthread_sem {
 
 uthread_sem_t uthread_sem_create (int initial_value) {
   uthread_sem_t sem = malloc (sizeof (struct uthread_sem));
-  
-  sem->value = initial_value;
-  spinlock_create   (&sem->spinlock);
-  uthread_initqueue (&sem->waiter_queue);
+
+  sem->value   = initial_value;
+  sem->pending = initial_value < 0? initial_value: 0;
+  sem->head    = 0;
+  sem->tail    = 0;
+  spinlock_create (&sem->spinlock);
   return sem;
 }
 
@@ -43,35 +59,111 @@ void uthread_sem_destroy (uthread_sem_t sem) {
 }
 
 /**
- * uthread_sem_signal (aka increment or V)
+ * uthread_sem_deliver
+ *    Hand n owed units to waiters in FIFO order, parking any surplus in pending.
  */
 
-void uthread_sem_signal (uthread_sem_t sem) {
-  uthread_t waiter_thread;
-  
+static void uthread_sem_deliver (uthread_sem_t sem, int n) {
+  struct uthread_sem_waiter* waiter;
+
   spinlock_lock (&sem->spinlock);
-  sem->value += 1;
-  waiter_thread = uthread_dequeue (&sem->waiter_queue);
-  if (waiter_thread)
-    uthread_unblock (waiter_thread);
+  if (sem->pending < 0) {
+    // still paying off a negative initial value
+    int absorbed = -sem->pending < n? -sem->pending: n;
+    sem->pending += absorbed;
+    n            -= absorbed;
+  }
+  while (n > 0 && (waiter = sem->head)) {
+    if (waiter->need > n) {
+      waiter->need -= n;
+      n = 0;
+    } else {
+      n -= waiter->need;
+      sem->head = waiter->next;
+      if (sem->head == 0)
+        sem->tail = 0;
+      // waiter is on the waiting thread's stack; don't touch it once that thread is unblocked
+      uthread_unblock (waiter->thread);
+    }
+  }
+  sem->pending += n;
   spinlock_unlock (&sem->spinlock);
 }
 
 /**
- * uthread_sem_wait (aka decrement or P)
+ * uthread_sem_collect
+ *    Wait for the need units that were owed to this thread when it drove value negative.
  */
 
-void uthread_sem_wait (uthread_sem_t sem) {
-  uthread_t waiter_thread;
-  
+static void uthread_sem_collect (uthread_sem_t sem, int need) {
+  struct uthread_sem_waiter waiter;
+
   spinlock_lock (&sem->spinlock);
-  while (sem->value < 1) {
-    uthread_enqueue (&sem->waiter_queue, uthread_self());
+  if (sem->pending > 0) {
+    int taken = sem->pending < need? sem->pending: need;
+    sem->pending -= taken;
+    need         -= taken;
+  }
+  if (need == 0) {
     spinlock_unlock (&sem->spinlock);
-    uthread_block();
-    spinlock_lock (&sem->spinlock);
+    return;
   }
-  sem->value -= 1;
+  waiter.thread = uthread_self();
+  waiter.need   = need;
+  waiter.next   = 0;
+  if (sem->tail)
+    sem->tail->next = &waiter;
+  else
+    sem->head = &waiter;
+  sem->tail = &waiter;
   spinlock_unlock (&sem->spinlock);
+  uthread_block();
+}
+
+/**
+ * uthread_sem_signal_n (increment by n)
+ */
+
+void uthread_sem_signal_n (uthread_sem_t sem, int n) {
+  int old, owed;
+
+  assert (n >= 0);
+  old  = __atomic_fetch_add (&sem->value, n, __ATOMIC_ACQ_REL);
+  owed = old < 0? (-old < n? -old: n): 0;
+  if (owed)
+    uthread_sem_deliver (sem, owed);
 }
 
+/**
+ * uthread_sem_wait_n (decrement by n)
+ *    Units are reserved as they become available, so a large request can't be starved by
+ *    a stream of small ones.
+ */
+
+void uthread_sem_wait_n (uthread_sem_t sem, int n) {
+  int old, need;
+
+  assert (n >= 0);
+  old  = __atomic_fetch_sub (&sem->value, n, __ATOMIC_ACQ_REL);
+  need = old >= n? 0: (old > 0? n - old: n);
+  if (need)
+    uthread_sem_collect (sem, need);
+}
+
+/**
+ * uthread_sem_signal (aka increment or V)
+ */
+
+void uthread_sem_signal (uthread_sem_t sem) {
+  if (__atomic_fetch_add (&sem->value, 1, __ATOMIC_ACQ_REL) < 0)
+    uthread_sem_deliver (sem, 1);
+}
+
+/**
+ * uthread_sem_wait (aka decrement or P)
+ */
+
+void uthread_sem_wait (uthread_sem_t sem) {
+  if (__atomic_fetch_sub (&sem->value, 1, __ATOMIC_ACQ_REL) < 1)
+    uthread_sem_collect (sem, 1);
+}
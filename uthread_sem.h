@@ -9,10 +9,12 @@
 struct uthread_sem;
 typedef struct uthread_sem* uthread_sem_t;
 
-uthread_sem_t uthread_sem_create  (int initial_value);
-void          uthread_sem_destroy (uthread_sem_t);
-void          uthread_sem_wait    (uthread_sem_t);
-void          uthread_sem_signal  (uthread_sem_t);
+uthread_sem_t uthread_sem_create   (int initial_value);
+void          uthread_sem_destroy  (uthread_sem_t);
+void          uthread_sem_wait     (uthread_sem_t);
+void          uthread_sem_signal   (uthread_sem_t);
+void          uthread_sem_wait_n   (uthread_sem_t, int n);
+void          uthread_sem_signal_n (uthread_sem_t, int n);
 
 #endif
 
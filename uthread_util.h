@@ -6,6 +6,10 @@
 #ifndef __uthread_util_h__
 #define __uthread_util_h__
 
+// Stacks are STACK_SIZE long and aligned, with the owning thread stored at their base, which is
+// how uthread_self finds it.
+#define STACK_SIZE     (8*1024*1024)
+
 struct uthread_queue {
   uthread_t head, tail;
 };
@@ -15,6 +19,7 @@ void      uthread_initqueue      (uthread_queue_t*);
 void      uthread_enqueue        (uthread_queue_t*, uthread_t);
 uthread_t uthread_dequeue        (uthread_queue_t*);
 int       uthread_queue_is_empty (uthread_queue_t* queue);
+void      uthread_unblock_queue  (uthread_queue_t* queue);
 
 void uthread_setInterrupt (int);
 